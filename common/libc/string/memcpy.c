@@ -40,6 +40,8 @@
 #include <string.h>
 #endif
 
+#include "wordcopy.h"
+
 /*
  * C standard function - copy a block of memory.
  */
@@ -47,39 +49,83 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	word_t *wd;
+	const word_t *ws;
+	word_t w0, w1;
+	unsigned shift;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For speed, copy bytes only until the destination is
+	 * word-aligned, and then copy words. If the source is aligned
+	 * too, the words go straight across, four at a time. If it
+	 * isn't, read it by aligned words anyway and put each
+	 * destination word together from two of them (WORDMERGE). A
+	 * read of an aligned word never crosses into a page the bytes
+	 * asked for aren't on, so this can't fault where a byte copy
+	 * wouldn't. Whatever's left at the end is copied by bytes.
 	 *
-	 * The alignment logic below should be portable. We rely on
-	 * the compiler to be reasonably intelligent about optimizing
-	 * the divides and modulos out. Fortunately, it is.
+	 * Each word read is done before the word written from it, and
+	 * the destination never gets ahead of the source, so this is
+	 * safe for memmove's forwards case too.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-
-		long *d = dst;
-		const long *s = src;
+	if (len >= WORDMIN) {
+		while ((uintptr_t)d & WORDMASK) {
+			*d++ = *s++;
+			len--;
+		}
+		wd = (word_t *)d;
+		shift = ((uintptr_t)s & WORDMASK) * 8;
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		if (shift == 0) {
+			ws = (const word_t *)s;
+			for (; len >= 4 * WORDSIZE; len -= 4 * WORDSIZE) {
+				wd[0] = ws[0];
+				wd[1] = ws[1];
+				wd[2] = ws[2];
+				wd[3] = ws[3];
+				wd += 4;
+				ws += 4;
+			}
+			for (; len >= WORDSIZE; len -= WORDSIZE) {
+				*wd++ = *ws++;
+			}
+			s = (const unsigned char *)ws;
 		}
+		else {
+			ws = (const word_t *)(s - shift / 8);
+			w0 = *ws++;
+			for (; len >= 4 * WORDSIZE; len -= 4 * WORDSIZE) {
+				w1 = ws[0];
+				wd[0] = WORDMERGE(w0, w1, shift);
+				w0 = ws[1];
+				wd[1] = WORDMERGE(w1, w0, shift);
+				w1 = ws[2];
+				wd[2] = WORDMERGE(w0, w1, shift);
+				w0 = ws[3];
+				wd[3] = WORDMERGE(w1, w0, shift);
+				wd += 4;
+				ws += 4;
+			}
+			for (; len >= WORDSIZE; len -= WORDSIZE) {
+				w1 = *ws++;
+				*wd++ = WORDMERGE(w0, w1, shift);
+				w0 = w1;
+			}
+			/* W0, the last word read, holds the next byte. */
+			s = (const unsigned char *)(ws - 1) + shift / 8;
+		}
+		d = (unsigned char *)wd;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
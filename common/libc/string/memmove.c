@@ -40,6 +40,8 @@
 #include <string.h>
 #endif
 
+#include "wordcopy.h"
+
 /*
  * C standard function - copy a block of memory, handling overlapping
  * regions correctly.
@@ -48,7 +50,12 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	word_t *wd;
+	const word_t *ws;
+	word_t w0, w1;
+	unsigned shift;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,33 +91,67 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Otherwise copy backwards, the same way memcpy copies forwards
+	 * (look there for more information): bytes until the end of the
+	 * destination is word-aligned, then words, merged from pairs of
+	 * aligned source words if the source isn't aligned, then the
+	 * bytes left at the front.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-
-		long *d = dst;
-		const long *s = src;
-
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+	d += len;
+	s += len;
+	if (len >= WORDMIN) {
+		while ((uintptr_t)d & WORDMASK) {
+			*--d = *--s;
+			len--;
+		}
+		wd = (word_t *)d;
+		shift = ((uintptr_t)s & WORDMASK) * 8;
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		if (shift == 0) {
+			ws = (const word_t *)s;
+			for (; len >= 4 * WORDSIZE; len -= 4 * WORDSIZE) {
+				wd -= 4;
+				ws -= 4;
+				wd[3] = ws[3];
+				wd[2] = ws[2];
+				wd[1] = ws[1];
+				wd[0] = ws[0];
+			}
+			for (; len >= WORDSIZE; len -= WORDSIZE) {
+				*--wd = *--ws;
+			}
+			s = (const unsigned char *)ws;
 		}
+		else {
+			ws = (const word_t *)(s - shift / 8);
+			w1 = *ws;
+			for (; len >= 4 * WORDSIZE; len -= 4 * WORDSIZE) {
+				wd -= 4;
+				ws -= 4;
+				w0 = ws[3];
+				wd[3] = WORDMERGE(w0, w1, shift);
+				w1 = ws[2];
+				wd[2] = WORDMERGE(w1, w0, shift);
+				w0 = ws[1];
+				wd[1] = WORDMERGE(w0, w1, shift);
+				w1 = ws[0];
+				wd[0] = WORDMERGE(w1, w0, shift);
+			}
+			for (; len >= WORDSIZE; len -= WORDSIZE) {
+				w0 = *--ws;
+				*--wd = WORDMERGE(w0, w1, shift);
+				w1 = w0;
+			}
+			/* W1, the last word read, holds the byte before. */
+			s = (const unsigned char *)ws + shift / 8;
+		}
+		d = (unsigned char *)wd;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -31,9 +31,12 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+#include "wordcopy.h"
+
 /*
  * C standard function - initialize a block of memory
  */
@@ -41,11 +44,47 @@
 void *
 memset(void *ptr, int ch, size_t len)
 {
-	char *p = ptr;
-	size_t i;
+	unsigned char *p = ptr;
+	word_t *wp;
+	word_t w;
+
+	/*
+	 * Like memcpy: store bytes until the pointer is word-aligned,
+	 * then whole words of copies of CH, four at a time, then bytes
+	 * again for whatever's left.
+	 */
+
+	if (len >= WORDMIN) {
+		while ((uintptr_t)p & WORDMASK) {
+			*p++ = ch;
+			len--;
+		}
+
+		w = (unsigned char)ch;
+		w |= w << 8;
+		w |= w << 16;
+		if (WORDSIZE > 4) {
+			/* two shifts, so this compiles where longs are 32 bits */
+			w |= w << 16 << 16;
+		}
+
+		wp = (word_t *)p;
+		for (; len >= 4 * WORDSIZE; len -= 4 * WORDSIZE) {
+			wp[0] = w;
+			wp[1] = w;
+			wp[2] = w;
+			wp[3] = w;
+			wp += 4;
+		}
+		for (; len >= WORDSIZE; len -= WORDSIZE) {
+			*wp++ = w;
+		}
+		p = (unsigned char *)wp;
+	}
 
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	while (len > 0) {
+		*p++ = ch;
+		len--;
 	}
 
 	return ptr;
@@ -0,0 +1,48 @@
+/**
+ * @file:   wordcopy.h
+ * @brief:  word-at-a-time helpers for memcpy, memmove, and memset
+ */
+
+#ifndef _WORDCOPY_H_
+#define _WORDCOPY_H_
+
+/*
+ * Like the string functions that use it, this is shared between libc
+ * and the kernel. It's also compiled into the host build of the
+ * membench microbenchmark, where there's no OS/161 endian.h, so ask
+ * the compiler there.
+ */
+#if defined(_KERNEL)
+#include <endian.h>
+#define WC_BIGENDIAN	(_BYTE_ORDER == _BIG_ENDIAN)
+#elif defined(HOST)
+#define WC_BIGENDIAN	(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#else
+#include <sys/endian.h>
+#define WC_BIGENDIAN	(_BYTE_ORDER == _BIG_ENDIAN)
+#endif
+
+typedef unsigned long word_t;
+
+#define WORDSIZE	sizeof(word_t)
+#define WORDMASK	(WORDSIZE - 1)
+#define WORDBITS	(WORDSIZE * 8)
+
+/* Shorter than this, getting aligned for words isn't worth it. */
+#define WORDMIN		(4 * WORDSIZE)
+
+/*
+ * Given consecutive aligned words LO and HI (LO at the lower address)
+ * from a source that starts SHIFT bits past LO, the word that starts
+ * at the source. SHIFT must not be 0: that would shift HI by the
+ * whole word size, which C leaves undefined.
+ */
+#if WC_BIGENDIAN
+#define WORDMERGE(lo, hi, shift) \
+	(((lo) << (shift)) | ((hi) >> (WORDBITS - (shift))))
+#else
+#define WORDMERGE(lo, hi, shift) \
+	(((lo) >> (shift)) | ((hi) << (WORDBITS - (shift))))
+#endif
+
+#endif /* _WORDCOPY_H_ */
@@ -66,6 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -116,14 +117,33 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+struct semaphore;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* Drop this address space's entries */
+	struct semaphore *ts_done;	/* V'd when they're gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-cpu state for the TLB refill handler, mips_utlb_refill in
+ * exception-mips1.S, which knows this layout (and the size). It walks
+ * vr_dir, the active address space's page directory, and counts what
+ * it does in vr_refills and vr_cycles; vm.c collects those into
+ * counters from time to time.
+ */
+struct vm_refill {
+	uint32_t **vr_dir;		/* Page directory, or NULL */
+	volatile uint32_t vr_refills;	/* Entries loaded */
+	volatile uint32_t vr_cycles;	/* Cycles spent loading them */
+	uint32_t vr_start;		/* Scratch for the handler */
+	uint32_t vr_saveat;
+	uint32_t vr_pad[3];
+};
+
+extern struct vm_refill vm_refill[];
+
 
 #endif /* _MIPS_VM_H_ */
@@ -35,11 +35,13 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <trace.h>
 #include "endian.h"
 #include "copyinout.h"
 #include "uio.h"
 #include <kern/wait.h>
 #include <kern/machine/endian.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -128,6 +130,7 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	TRACE(TRACE_SYSCALL, callno, tf->tf_a0);
 
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
@@ -140,6 +143,9 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
     int param3;
+#if !OPT_DUMBVM
+    off_t param6;
+#endif
     char retval_ll[8] ;
     bool return_val_is64 = 0;
 
@@ -183,6 +189,40 @@ syscall(struct trapframe *tf)
         err = syscall_dup2(tf->tf_a0, tf->tf_a1, &retval);
         break;
 
+        case SYS_futex:
+        err = syscall_futex((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+        break;
+
+#if !OPT_DUMBVM
+        case SYS_mmap:
+        /* fd is at sp+16; the 64-bit offset is aligned, at sp+24 */
+        err = fetch_data_from_userstack(tf, 0, &param3, 4);
+        if (err == 0)
+        {
+            err = fetch_data_from_userstack(tf, 8, &param6, 8);
+        }
+        if (err != 0)
+        {
+            retval = err;
+            break;
+        }
+        err = syscall_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3, param3, param6, &retval);
+        break;
+        case SYS_munmap:
+        err = syscall_munmap((userptr_t)tf->tf_a0, tf->tf_a1, &retval);
+        break;
+        case SYS_msync:
+        err = syscall_msync((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+        break;
+#endif
+
+        case SYS_setaffinity:
+        err = syscall_setaffinity(tf->tf_a0, &retval);
+        break;
+        case SYS_getaffinity:
+        err = syscall_getaffinity((userptr_t)tf->tf_a0, &retval);
+        break;
+
         /* end */
 
 	    default:
@@ -234,6 +274,8 @@ syscall(struct trapframe *tf)
 
 	tf->tf_epc += 4;
 
+	TRACE(TRACE_SYSRET, callno, tf->tf_a3 ? tf->tf_v0 : 0);
+
 	/* Make sure the syscall code didn't forget to lower spl */
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
@@ -38,6 +38,7 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <coremap.h>
 
 ////////////////////////////////////////////////////////////
 
@@ -248,6 +249,21 @@ cpu_irqonoff(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Cycle counter: coprocessor 0 register 9, "count", which goes up by
+ * one every cycle.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t x;
+
+	__asm volatile("mfc0 %0,$9" : "=r" (x));
+	return x;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Idling.
  */
@@ -287,11 +303,17 @@ wait(void)
 }
 
 /*
- * Idle the processor until something happens.
+ * Idle the processor until something happens. If there's a page to
+ * zero for later, do that instead of waiting, and just take any
+ * interrupts that came in meanwhile.
  */
 void
 cpu_idle(void)
 {
+	if (coremap_idlezero()) {
+		cpu_irqonoff();
+		return;
+	}
 	wait();
         cpu_irqonoff();
 }
@@ -0,0 +1,507 @@
+/**
+ * @file:   vm.c
+ * @brief:  MIPS side of the paged VM system: faults, TLB, kernel pages
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <membar.h>
+#include <pcounter.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Kernel pages live in kseg0, so they're just physical frames seen
+ * through the direct map. User pages go through the address space's
+ * page table; the TLB is loaded from it on each miss.
+ *
+ * ASIDs. TLB entries are tagged with a 6-bit address space ID, and
+ * only entries with the ASID in c0_entryhi match, so entries for
+ * several address spaces can stay in the TLB across context switches.
+ * Each cpu hands out ASIDs by counting up, and an address space keeps
+ * the count it got on each cpu in as_asid[]. The bits above the ASID
+ * are a generation number: when the ASID part wraps, the cpu flushes
+ * its TLB and starts a new generation, and any address space holding
+ * a count from an older one gets a new ASID when it's next activated.
+ * ASID 0 is never handed out; it's what's loaded while no address
+ * space is, and no entry is ever tagged with it.
+ *
+ * Taking an address space's entries away (vm_tlbshootdown_as) doesn't
+ * hunt for them. Each cpu that might have some just forgets the
+ * address space's ASID, so they can't match again, and they age out
+ * of the TLB or go at the next flush. An as_asid[] of 0 means the
+ * address space has no ASID on that cpu, which tells vm_tlbshootdown_as
+ * which cpus it can leave alone. Only a cpu itself changes its own
+ * slot, at splhigh.
+ *
+ * Refills. Most TLB misses never get here: mips_utlb_refill (in
+ * exception-mips1.S) walks the active address space's page table
+ * itself and loads the entry if the PTE is valid, writeable if it has
+ * PTE_WRITE. vm_fault only sees misses on pages that aren't in memory
+ * yet and writes to pages mapped read-only, and it keeps PTE_WRITE up
+ * to date with what it decides. Anyone making a valid PTE invalid, or
+ * taking PTE_WRITE away, has to shoot down the old entry afterwards,
+ * as before, since the refill handler doesn't take any locks.
+ */
+
+#define VM_NASIDS	((TLBHI_PID >> TLBHI_PIDSHIFT) + 1)
+#define VM_ASIDMASK	(VM_NASIDS - 1)
+
+struct vm_cpu {
+	struct cpu *vc_cpu;		/* Set once this cpu activates */
+	struct addrspace *vc_as;	/* Active address space, or NULL */
+	uint32_t vc_asid;		/* Its ASID, loaded in c0_entryhi */
+	uint64_t vc_asidlast;		/* Generation and last ASID given */
+};
+
+static struct vm_cpu vm_cpus[MAXCPUS];
+
+/* Shared with mips_utlb_refill. */
+struct vm_refill vm_refill[MAXCPUS];
+
+static struct pcounter vm_cowcopies = PCOUNTER_INITIALIZER("vm_cowcopies");
+static struct pcounter vm_shootdowns =
+	PCOUNTER_INITIALIZER("vm_shootdowns");
+static struct pcounter vm_tlbmisses = PCOUNTER_INITIALIZER("vm_tlbmisses");
+static struct pcounter vm_tlbmodfaults =
+	PCOUNTER_INITIALIZER("vm_tlbmodfaults");
+static struct pcounter vm_asidrollovers =
+	PCOUNTER_INITIALIZER("vm_asidrollovers");
+static struct pcounter vm_refills = PCOUNTER_INITIALIZER("vm_refills");
+static struct pcounter vm_refillcycles =
+	PCOUNTER_INITIALIZER("vm_refillcycles");
+
+void
+vm_bootstrap(void)
+{
+	unsigned i;
+
+	coremap_bootstrap();
+	as_bootstrap();
+	swap_bootstrap();
+	pcounter_register(&vm_cowcopies);
+	pcounter_register(&vm_shootdowns);
+	pcounter_register(&vm_tlbmisses);
+	pcounter_register(&vm_tlbmodfaults);
+	pcounter_register(&vm_asidrollovers);
+	pcounter_register(&vm_refills);
+	pcounter_register(&vm_refillcycles);
+
+	/* The refill handler indexes vm_refill[] by shifting. */
+	KASSERT(sizeof(struct vm_refill) == 32);
+
+	/* Generation 0 is what a new address space's as_asid[] says. */
+	for (i=0; i<MAXCPUS; i++) {
+		vm_cpus[i].vc_asidlast = VM_NASIDS;
+	}
+}
+
+/*
+ * Check if we're in a context that can sleep. vm_fault takes the
+ * address space's lock, and allocating a page may mean paging another
+ * one out.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+
+	vm_can_sleep();
+	pa = npages == 1 ? swap_getpage() : coremap_alloc(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
+}
+
+/*
+ * Move this cpu's refill handler statistics into the counters. Done
+ * whenever we're here anyway (faults and switches), so they lag a
+ * little. Call at splhigh.
+ */
+static
+void
+vm_refillstats(void)
+{
+	struct vm_refill *vr;
+
+	vr = &vm_refill[curcpu->c_number];
+	if (vr->vr_refills != 0) {
+		pcounter_add(&vm_refills, vr->vr_refills);
+		pcounter_add(&vm_refillcycles, vr->vr_cycles);
+		vr->vr_refills = 0;
+		vr->vr_cycles = 0;
+	}
+}
+
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	/* That left ASID 0 in c0_entryhi. */
+	tlb_setasid(vm_cpus[curcpu->c_number].vc_asid);
+
+	splx(spl);
+}
+
+/*
+ * Give AS a new ASID on this cpu, starting a new generation if they've
+ * run out. Call at splhigh.
+ */
+static
+void
+vm_newasid(struct vm_cpu *vc, struct addrspace *as)
+{
+	vc->vc_asidlast++;
+	if ((vc->vc_asidlast & VM_ASIDMASK) == 0) {
+		vc->vc_asid = 0;
+		vm_tlbflush();
+		vc->vc_asidlast++;
+		pcounter_inc(&vm_asidrollovers);
+	}
+	as->as_asid[curcpu->c_number] = vc->vc_asidlast;
+}
+
+void
+vm_tlbactivate(struct addrspace *as)
+{
+	struct vm_cpu *vc;
+	unsigned me;
+	int spl;
+
+	spl = splhigh();
+	me = curcpu->c_number;
+	vc = &vm_cpus[me];
+	vc->vc_cpu = curcpu;
+	vc->vc_as = as;
+	vm_refillstats();
+	vm_refill[me].vr_dir = as == NULL ? NULL : as->as_pt->pt_dir;
+	if (as == NULL) {
+		vc->vc_asid = 0;
+	}
+	else {
+		/*
+		 * Be visible to shootdowns before deciding our ASID for
+		 * AS is still good.
+		 */
+		membar_any_any();
+		if ((as->as_asid[me] ^ vc->vc_asidlast) & ~(uint64_t)VM_ASIDMASK) {
+			vm_newasid(vc, as);
+		}
+		vc->vc_asid = as->as_asid[me] & VM_ASIDMASK;
+	}
+	tlb_setasid(vc->vc_asid);
+	splx(spl);
+}
+
+/*
+ * Make this cpu forget AS's ASID. If AS is active here, it needs
+ * another one right away. Call at splhigh.
+ */
+static
+void
+vm_forgetasid(struct addrspace *as)
+{
+	struct vm_cpu *vc;
+	unsigned me;
+
+	me = curcpu->c_number;
+	vc = &vm_cpus[me];
+	if (vc->vc_as == as) {
+		vm_newasid(vc, as);
+		vc->vc_asid = as->as_asid[me] & VM_ASIDMASK;
+		tlb_setasid(vc->vc_asid);
+	}
+	else {
+		as->as_asid[me] = 0;
+	}
+}
+
+/*
+ * Called from the IPI handler.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_forgetasid(ts->ts_as);
+	V(ts->ts_done);
+}
+
+/*
+ * Get rid of AS's entries here and on every other cpu that might have
+ * some, and wait for them all to finish. Call with AS's lock held, so
+ * no new entries can be loaded from its page table meanwhile.
+ */
+void
+vm_tlbshootdown_as(struct addrspace *as)
+{
+	struct tlbshootdown ts;
+	unsigned i, me, sent;
+	int spl;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	/* The lock also makes the semaphore ours alone. */
+	ts.ts_as = as;
+	ts.ts_done = as->as_tlbdone;
+
+	spl = splhigh();
+	me = curcpu->c_number;
+	vm_forgetasid(as);
+	splx(spl);
+
+	membar_any_any();
+	sent = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if (i != me && vm_cpus[i].vc_cpu != NULL &&
+		    as->as_asid[i] != 0) {
+			ipi_tlbshootdown(vm_cpus[i].vc_cpu, &ts);
+			sent++;
+		}
+	}
+	pcounter_add(&vm_shootdowns, sent);
+
+	for (i=0; i<sent; i++) {
+		P(ts.ts_done);
+	}
+}
+
+/*
+ * Load a translation, replacing any entry already there for the same
+ * page (there can't be two).
+ */
+static
+void
+vm_tlbload(vaddr_t va, paddr_t pa, bool writeable)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	elo = pa | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+	ehi = va | (vm_cpus[curcpu->c_number].vc_asid << TLBHI_PIDSHIFT);
+	KASSERT((ehi & TLBHI_PID) != 0);
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	paddr_t pa;
+	bool writeable, shared;
+	int result, spl;
+
+	faultaddress &= PAGE_FRAME;
+
+	spl = splhigh();
+	vm_refillstats();
+	splx(spl);
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		pcounter_inc(&vm_tlbmodfaults);
+		break;
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		pcounter_inc(&vm_tlbmisses);
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	vm_can_sleep();
+	lock_acquire(as->as_lock);
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+	writeable = (rg->rg_perms & RG_WRITE) != 0 || as->as_loading;
+	shared = (rg->rg_flags & RGF_SHARED) != 0;
+	if (faulttype != VM_FAULT_READ && !writeable) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+ again:
+	if (*pte & PTE_SWAPPED) {
+		result = swap_pagein(as, faultaddress, pte);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+	else if ((*pte & PTE_VALID) == 0) {
+		result = as_fillpage(rg, faultaddress, &pa);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+		*pte = pa | PTE_VALID;
+	}
+	pa = *pte & PTE_FRAME;
+
+	/*
+	 * Copy-on-write. A page that's still shared with another address
+	 * space is mapped read-only; writing to it gets a private copy.
+	 * If the others have all gone (or copied) we're the only owner,
+	 * and nothing can share it again without our lock, so it can
+	 * just be made writeable. Pages of shared mappings are meant to
+	 * be shared, and are written in place.
+	 */
+	if (writeable && !shared && coremap_refcount(pa) > 1) {
+		if (faulttype == VM_FAULT_READ) {
+			writeable = false;
+		}
+		else {
+			paddr_t newpa;
+
+			/*
+			 * Getting a page can page out our own pages, and
+			 * if the other owners go meanwhile this one is ours
+			 * alone and can be picked. Hold an extra reference
+			 * so it can't, and start over if the PTE changed
+			 * anyway.
+			 */
+			coremap_share(pa);
+			newpa = swap_getpage();
+			if (newpa == 0) {
+				coremap_free(pa);
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+			if ((*pte & (PTE_FRAME | PTE_VALID)) !=
+			    (pa | PTE_VALID)) {
+				coremap_free(newpa);
+				coremap_free(pa);
+				goto again;
+			}
+			memmove((void *)PADDR_TO_KVADDR(newpa),
+				(const void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+			*pte = newpa | PTE_VALID;
+
+			/*
+			 * Other cpus may still hold a read-only entry for
+			 * the old frame under our ASID; it has to go before
+			 * the frame can be reused.
+			 */
+			vm_tlbshootdown_as(as);
+			coremap_free(pa);	/* Our extra reference */
+			coremap_free(pa);	/* The mapping's */
+			pa = newpa;
+			pcounter_inc(&vm_cowcopies);
+		}
+	}
+
+	/*
+	 * A page of a shared mapping is only mapped writeable once it's
+	 * been written, and then it's dirty until as_msync writes it
+	 * back.
+	 */
+	if (writeable && shared) {
+		if (faulttype != VM_FAULT_READ) {
+			*pte |= PTE_DIRTY;
+		}
+		else if ((*pte & PTE_DIRTY) == 0) {
+			writeable = false;
+		}
+	}
+
+	/* Let the refill handler map it the same way next time. */
+	if (writeable) {
+		*pte |= PTE_WRITE;
+	}
+	else {
+		*pte &= ~PTE_WRITE;
+	}
+
+	/* For the pager's clock. */
+	coremap_touch(pa, as, faultaddress);
+	vm_tlbload(faultaddress, pa, writeable);
+
+	lock_release(as->as_lock);
+	return 0;
+}
@@ -52,6 +52,8 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <vm.h>
+#include <pagecache.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -499,6 +501,25 @@ emufs_reclaim(struct vnode *v)
 	 */
 	spinlock_release(&ev->ev_v.vn_countlock);
 
+	/*
+	 * Write back and forget our pages in the page cache. Writing
+	 * needs e_lock, so let go of it; the biglock is enough to keep
+	 * emufs_loadvnode from handing the vnode out again meanwhile.
+	 * As in sfs_reclaim, pages that can't be written are dropped
+	 * rather than failing the reclaim, which would leave the vnode
+	 * and its dirty pages around for good. There's no way to
+	 * reserve space on the host ahead of time, so here a full host
+	 * disk can get this far.
+	 */
+	lock_release(ef->ef_emu->e_lock);
+	result = pagecache_flush(v);
+	if (result) {
+		kprintf("emu%d: vnode %u: file data lost: %s\n",
+			ef->ef_emu->e_unit, ev->ev_handle, strerror(result));
+	}
+	pagecache_purge(v);
+	lock_acquire(ef->ef_emu->e_lock);
+
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
@@ -534,41 +555,106 @@ emufs_reclaim(struct vnode *v)
 }
 
 /*
- * VOP_READ
+ * Get the size of a file, asking the host only the first time; after
+ * that we keep it up to date ourselves, since writes sit in the page
+ * cache a while before the host sees them. Call with the biglock
+ * held, which covers ev_size.
  */
 static
 int
-emufs_read(struct vnode *v, struct uio *uio)
+emufs_getsize(struct emufs_vnode *ev, off_t *ret)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (ev->ev_size < 0) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle, &ev->ev_size);
+		if (result) {
+			ev->ev_size = -1;
+			return result;
+		}
+	}
+	*ret = ev->ev_size;
+	return 0;
+}
+
+/*
+ * Move a page of a file between the page cache and the host.
+ */
+static
+int
+emufs_pageio(struct vnode *v, off_t offset, void *page, enum uio_rw rw)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
+	struct iovec iov;
+	struct uio ku;
 	size_t oldresid;
+	off_t size;
+	uint32_t len;
 	int result;
 
-	KASSERT(uio->uio_rw==UIO_READ);
+	if (rw == UIO_WRITE) {
+		/* Known, since the page was written through us. */
+		vfs_biglock_acquire();
+		size = ev->ev_size;
+		vfs_biglock_release();
+		KASSERT(size >= 0);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		if (offset >= size) {
+			/* Truncated since it was dirtied. */
+			return 0;
 		}
+		len = PAGE_SIZE;
+		if (offset + len > size) {
+			len = size - offset;
+		}
+		uio_kinit(&iov, &ku, page, len, offset, UIO_WRITE);
+		return emu_write(ev->ev_emu, ev->ev_handle, len, &ku);
+	}
 
-		oldresid = uio->uio_resid;
+	uio_kinit(&iov, &ku, page, PAGE_SIZE, offset, UIO_READ);
+	while (ku.uio_resid > 0) {
+		oldresid = ku.uio_resid;
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
+		result = emu_read(ev->ev_emu, ev->ev_handle, ku.uio_resid,
+				  &ku);
 		if (result) {
 			return result;
 		}
 
-		if (uio->uio_resid == oldresid) {
+		if (ku.uio_resid == oldresid) {
 			/* nothing read - EOF */
 			break;
 		}
 	}
-
+	bzero((char *)page + (PAGE_SIZE - ku.uio_resid), ku.uio_resid);
 	return 0;
 }
 
+/*
+ * VOP_READ
+ */
+static
+int
+emufs_read(struct vnode *v, struct uio *uio)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	off_t size;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	vfs_biglock_acquire();
+	result = emufs_getsize(ev, &size);
+	vfs_biglock_release();
+	if (result) {
+		return result;
+	}
+
+	return pagecache_read(v, uio, size, emufs_pageio);
+}
+
 /*
  * VOP_READDIR
  */
@@ -597,32 +683,40 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
+	off_t oldsize, endpos;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
-		}
+	endpos = uio->uio_offset + uio->uio_resid;
+	if (endpos > (off_t)0xffffffff) {
+		return EFBIG;
+	}
 
-		oldresid = uio->uio_resid;
+	/* As in sfs_write, extend the file before writing the pages. */
+	vfs_biglock_acquire();
+	result = emufs_getsize(ev, &oldsize);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	if (endpos > oldsize) {
+		ev->ev_size = endpos;
+	}
+	vfs_biglock_release();
 
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
-		}
+	result = pagecache_write(v, uio, oldsize, emufs_pageio);
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
-			break;
+	if (uio->uio_offset < endpos && endpos > oldsize) {
+		vfs_biglock_acquire();
+		if (ev->ev_size == endpos) {
+			ev->ev_size = oldsize > uio->uio_offset ?
+				oldsize : uio->uio_offset;
 		}
+		vfs_biglock_release();
 	}
 
-	return 0;
+	return result;
 }
 
 /*
@@ -655,9 +749,16 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
-	if (result) {
-		return result;
+	/* Our idea of a file's size can be ahead of the host's. */
+	vfs_biglock_acquire();
+	statbuf->st_size = ev->ev_size;
+	vfs_biglock_release();
+	if (statbuf->st_size < 0) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle,
+				     &statbuf->st_size);
+		if (result) {
+			return result;
+		}
 	}
 
 	result = VOP_GETTYPE(v, &statbuf->st_mode);
@@ -713,8 +814,7 @@ static
 int
 emufs_fsync(struct vnode *v)
 {
-	(void)v;
-	return 0;
+	return pagecache_flush(v);
 }
 
 /*
@@ -725,7 +825,25 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	/*
+	 * Truncate on the host first; if that fails the file keeps its
+	 * length, so it has to keep its cached pages too. Set the new
+	 * size before dropping them, so any writeback that gets in
+	 * between is clipped to it.
+	 */
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result) {
+		return result;
+	}
+
+	vfs_biglock_acquire();
+	ev->ev_size = len;
+	vfs_biglock_release();
+
+	pagecache_truncate(v, len);
+	return 0;
 }
 
 /*
@@ -844,14 +962,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP. Files can be mapped; the VM system pages them with
+ * emufs_read and emufs_write.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -1179,6 +1298,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_size = -1;
 
 	result = vnode_init(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			    &ef->ef_fs, ev);
@@ -1221,8 +1341,23 @@ static
 int
 emufs_sync(struct fs *fs)
 {
-	(void)fs;
-	return 0;
+	struct emufs_fs *ef = fs->fs_data;
+	unsigned i, num;
+	int result, err;
+
+	/* Write back whatever the page cache has; report the first error. */
+	err = 0;
+	vfs_biglock_acquire();
+	num = vnodearray_num(ef->ef_vnodes);
+	for (i=0; i<num; i++) {
+		struct vnode *v = vnodearray_get(ef->ef_vnodes, i);
+		result = VOP_FSYNC(v);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	vfs_biglock_release();
+	return err;
 }
 
 /*
@@ -1343,6 +1478,7 @@ config_emu(struct emu_softc *sc, int emuno)
 	if (sc->e_lock == NULL) {
 		return ENOMEM;
 	}
+	lock_setclass(sc->e_lock, "e_lock");
 	sc->e_sem = sem_create("emufs-sem", 0);
 	if (sc->e_sem == NULL) {
 		lock_destroy(sc->e_lock);
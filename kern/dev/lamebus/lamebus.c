@@ -37,6 +37,7 @@
 #include <membar.h>
 #include <spinlock.h>
 #include <current.h>
+#include <trace.h>
 #include <lamebus/lamebus.h>
 
 /* Register offsets within each config region */
@@ -530,6 +531,7 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		data = lamebus->ls_devdata[slot];
 		spinlock_release(&lamebus->ls_lock);
 
+		TRACE(TRACE_INTR, slot, 0);
 		handler(data);
 
 		spinlock_acquire(&lamebus->ls_lock);
@@ -39,16 +39,25 @@
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This only zeroes its buffer; the zeros reach
+ * the disk whenever the buffer is written back, if they haven't been
+ * overwritten by then.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct sfs_buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
@@ -79,11 +88,13 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Free a block. Whatever's in the buffer cache for it is thrown away
+ * unwritten.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	sfs_buf_drop(sfs, diskblock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
 }
@@ -49,24 +49,15 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *ids;
 	daddr_t block;
 	daddr_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/*
@@ -154,38 +145,35 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* sfs_balloc cleared the new block's buffer */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Get the indirect block's buffer. It stays pinned while we
+	 * might allocate, so it can't be evicted from under us.
+	 */
+	result = sfs_buf_get(sfs, idblock, true, &idbuf);
+	if (result) {
+		return result;
 	}
+	ids = sfs_buf_data(idbuf);
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Get the block out of the indirect block */
+	block = ids[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
+			sfs_buf_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		ids[idoff] = block;
+		sfs_buf_markdirty(idbuf);
 	}
+	sfs_buf_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -197,22 +185,44 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	return 0;
 }
 
+/*
+ * Make sure every block of the file from byte START up to END is
+ * allocated, so that running out of space shows up in write() rather
+ * than when the page cache gets around to writing the data back.
+ * *RESERVED gets how far that got: END, or if allocating a block
+ * failed, the start of that block.
+ */
+int
+sfs_breserve(struct sfs_vnode *sv, off_t start, off_t end, off_t *reserved)
+{
+	uint32_t fileblock, endblock;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	endblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	for (fileblock = start / SFS_BLOCKSIZE; fileblock < endblock;
+	     fileblock++) {
+		result = sfs_bmap(sv, fileblock, true, &diskblock);
+		if (result) {
+			*reserved = (off_t)fileblock * SFS_BLOCKSIZE;
+			return result;
+		}
+	}
+	*reserved = end;
+	return 0;
+}
+
 /*
  * Called for ftruncate() and from sfs_reclaim.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *ids;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -221,9 +231,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	daddr_t block, idblock;
 	uint32_t baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	int hasnonzero;
 
 	vfs_biglock_acquire();
 
@@ -252,27 +260,28 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	if (blocklen < highblock && idblock != 0) {
 		/* We're past the proposed EOF; may need to free stuff */
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		/* Get the indirect block's buffer */
+		result = sfs_buf_get(sfs, idblock, true, &idbuf);
 		if (result) {
 			vfs_biglock_release();
 			return result;
 		}
+		ids = sfs_buf_data(idbuf);
 
 		hasnonzero = 0;
-		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
+			if (blocklen < baseblock+j && ids[j] != 0) {
+				sfs_bfree(sfs, ids[j]);
+				ids[j] = 0;
+				sfs_buf_markdirty(idbuf);
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (ids[j]!=0) {
 				hasnonzero=1;
 			}
 		}
+		sfs_buf_release(idbuf);
 
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
@@ -280,15 +289,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -0,0 +1,461 @@
+/**
+ * @file:   sfs_buf.c
+ * @brief:  buffer cache for SFS disk blocks
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <slab.h>
+#include <pcounter.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * The buffer cache keeps recently used disk blocks in memory, named by
+ * (device, block number). Everything SFS reads or writes a block at a
+ * time goes through it: the superblock, the freemap, inodes, indirect
+ * blocks, directory blocks, and the partial blocks at the ends of file
+ * I/O. Whole blocks of file data go straight to the disk instead,
+ * since the page cache already holds them, unless the block happens to
+ * be cached here too (see sfs_blockio).
+ *
+ * Buffers are found by hashing (device, block), and are also on one
+ * LRU list, oldest first. A buffer is pinned while anyone holds it
+ * (between sfs_buf_get and sfs_buf_release) and can't be evicted or
+ * dropped then. Writes only dirty the buffer. Dirty buffers are written
+ * back by sfs_buf_flush, from sfs_sync and sfs_fsync, or when they
+ * reach the old end of the list and the space is wanted; there are
+ * never more than SB_MAXBUFS buffers.
+ *
+ * Blocks that are freed (sfs_bfree) are dropped without being written
+ * back, so the metadata of a file that's created and removed between
+ * syncs never reaches the disk at all.
+ *
+ * Locking. SFS does all its block I/O with the vfs_biglock held, and
+ * the cache leans on that: the biglock covers the hash, the list, and
+ * every buffer, and is held across the I/O to fill or write back a
+ * buffer. So there's no need for a FILLING state as in the page cache.
+ */
+
+#define SB_NBUCKETS	64
+#define SB_MAXBUFS	128	/* 64K of blocks */
+
+struct sfs_buf {
+	struct sfs_fs *b_sfs;		/* For I/O and messages */
+	struct device *b_dev;
+	daddr_t b_block;
+	unsigned b_refs;		/* Pins */
+	bool b_dirty;
+	struct sfs_buf *b_hnext;	/* Hash chain */
+	struct sfs_buf *b_next;		/* LRU list */
+	struct sfs_buf *b_prev;
+	char b_data[SFS_BLOCKSIZE];
+};
+
+static struct sfs_buf *sb_hash[SB_NBUCKETS];
+static struct sfs_buf *sb_lruhead;	/* Oldest */
+static struct sfs_buf *sb_lrutail;	/* Newest */
+static unsigned sb_nbufs;
+static unsigned sb_ndirty;
+static struct kmem_cache *sb_bufcache;
+
+static struct pcounter sb_hits = PCOUNTER_INITIALIZER("sfs_buf_hits");
+static struct pcounter sb_misses = PCOUNTER_INITIALIZER("sfs_buf_misses");
+static struct pcounter sb_writebacks =
+	PCOUNTER_INITIALIZER("sfs_buf_writebacks");
+static struct pcounter sb_evictions =
+	PCOUNTER_INITIALIZER("sfs_buf_evictions");
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU list
+
+static
+inline
+unsigned
+sb_hashfn(struct device *dev, daddr_t block)
+{
+	return (((vaddr_t)dev >> 4) + block) % SB_NBUCKETS;
+}
+
+static
+struct sfs_buf *
+sb_find(struct device *dev, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sb_hash[sb_hashfn(dev, block)]; b != NULL; b = b->b_hnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sb_lruremove(struct sfs_buf *b)
+{
+	if (b->b_prev != NULL) {
+		b->b_prev->b_next = b->b_next;
+	}
+	else {
+		KASSERT(sb_lruhead == b);
+		sb_lruhead = b->b_next;
+	}
+	if (b->b_next != NULL) {
+		b->b_next->b_prev = b->b_prev;
+	}
+	else {
+		KASSERT(sb_lrutail == b);
+		sb_lrutail = b->b_prev;
+	}
+	b->b_next = b->b_prev = NULL;
+}
+
+static
+void
+sb_lruappend(struct sfs_buf *b)
+{
+	b->b_next = NULL;
+	b->b_prev = sb_lrutail;
+	if (sb_lrutail != NULL) {
+		sb_lrutail->b_next = b;
+	}
+	else {
+		sb_lruhead = b;
+	}
+	sb_lrutail = b;
+}
+
+/*
+ * Enter B, already named, in the hash and as the newest buffer.
+ */
+static
+void
+sb_enter(struct sfs_buf *b)
+{
+	unsigned h;
+
+	h = sb_hashfn(b->b_dev, b->b_block);
+	b->b_hnext = sb_hash[h];
+	sb_hash[h] = b;
+	sb_lruappend(b);
+	sb_nbufs++;
+}
+
+/*
+ * Take B out of the cache, dirty or not.
+ */
+static
+void
+sb_forget(struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	KASSERT(b->b_refs == 0);
+
+	pp = &sb_hash[sb_hashfn(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hnext;
+	}
+	*pp = b->b_hnext;
+	sb_lruremove(b);
+
+	sb_nbufs--;
+	if (b->b_dirty) {
+		sb_ndirty--;
+		b->b_dirty = false;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+static
+int
+sb_io(struct sfs_buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(&iov, &ku, b->b_data, b->b_block, rw);
+	return sfs_rwblock(b->b_sfs, &ku);
+}
+
+static
+int
+sb_writeback(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(b->b_dirty);
+
+	result = sb_io(b, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	b->b_dirty = false;
+	sb_ndirty--;
+	pcounter_inc(&sb_writebacks);
+	return 0;
+}
+
+/*
+ * Get a buffer that isn't in the cache, for reuse. Below SB_MAXBUFS,
+ * allocate one; after that, or if that fails, evict the oldest buffer
+ * nobody has pinned, writing it back first if need be. A buffer that
+ * can't be written back stays dirty and goes to the new end of the
+ * list, so that one bad block doesn't stop every later miss; fail
+ * only if nothing can be evicted.
+ */
+static
+int
+sb_getfree(struct sfs_buf **ret)
+{
+	struct sfs_buf *b, *next;
+	unsigned n;
+	int result, err;
+
+	if (sb_nbufs < SB_MAXBUFS) {
+		b = kmem_cache_alloc(sb_bufcache);
+		if (b != NULL) {
+			*ret = b;
+			return 0;
+		}
+	}
+
+	err = ENOMEM;
+	for (b = sb_lruhead, n = sb_nbufs; b != NULL && n > 0; b = next, n--) {
+		next = b->b_next;
+		if (b->b_refs > 0) {
+			continue;
+		}
+		if (b->b_dirty) {
+			result = sb_writeback(b);
+			if (result) {
+				err = result;
+				sb_lruremove(b);
+				sb_lruappend(b);
+				continue;
+			}
+		}
+
+		sb_forget(b);
+		pcounter_inc(&sb_evictions);
+		*ret = b;
+		return 0;
+	}
+	return err;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Get and pin the buffer for BLOCK. If it isn't cached and FILL is
+ * set, read it in; otherwise, the caller is going to overwrite the
+ * whole thing, and its contents start out undefined.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool fill,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sb_bufcache != NULL);
+
+	b = sb_find(sfs->sfs_device, block);
+	if (b != NULL) {
+		pcounter_inc(&sb_hits);
+		sb_lruremove(b);
+		sb_lruappend(b);
+		b->b_refs++;
+		*ret = b;
+		return 0;
+	}
+	pcounter_inc(&sb_misses);
+
+	result = sb_getfree(&b);
+	if (result) {
+		return result;
+	}
+	b->b_sfs = sfs;
+	b->b_dev = sfs->sfs_device;
+	b->b_block = block;
+	b->b_dirty = false;
+
+	if (fill) {
+		result = sb_io(b, UIO_READ);
+		if (result) {
+			kmem_cache_free(sb_bufcache, b);
+			return result;
+		}
+	}
+
+	b->b_refs = 1;
+	sb_enter(b);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get and pin the buffer for BLOCK if it's cached; otherwise return
+ * NULL, without reading anything in.
+ */
+struct sfs_buf *
+sfs_buf_find(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	b = sb_find(sfs->sfs_device, block);
+	if (b != NULL) {
+		b->b_refs++;
+	}
+	return b;
+}
+
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(b->b_refs > 0);
+	return b->b_data;
+}
+
+void
+sfs_buf_markdirty(struct sfs_buf *b)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(b->b_refs > 0);
+
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		sb_ndirty++;
+	}
+}
+
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(b->b_refs > 0);
+	b->b_refs--;
+}
+
+/*
+ * Forget BLOCK, which has just been freed, without writing it back.
+ */
+void
+sfs_buf_drop(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	b = sb_find(sfs->sfs_device, block);
+	if (b != NULL) {
+		sb_forget(b);
+		kmem_cache_free(sb_bufcache, b);
+	}
+}
+
+/*
+ * Write back all SFS's dirty buffers. They go out in block order, as
+ * they would from a disk scheduler, rather than in LRU order.
+ */
+int
+sfs_buf_flush(struct sfs_fs *sfs)
+{
+	static struct sfs_buf *dirty[SB_MAXBUFS];
+	struct sfs_buf *b, *t;
+	unsigned i, j, n;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sb_ndirty == 0) {
+		return 0;
+	}
+
+	/* Collect them and insertion-sort by block number */
+	n = 0;
+	for (b = sb_lruhead; b != NULL; b = b->b_next) {
+		if (b->b_dev != sfs->sfs_device || !b->b_dirty) {
+			continue;
+		}
+		KASSERT(n < SB_MAXBUFS);
+		for (j = n; j > 0 && dirty[j-1]->b_block > b->b_block; j--) {
+			dirty[j] = dirty[j-1];
+		}
+		dirty[j] = b;
+		n++;
+	}
+
+	/* Pin them all, so writing one back can't evict another */
+	for (i = 0; i < n; i++) {
+		dirty[i]->b_refs++;
+	}
+	result = 0;
+	for (i = 0; i < n; i++) {
+		t = dirty[i];
+		if (result == 0 && t->b_dirty) {
+			result = sb_writeback(t);
+		}
+		t->b_refs--;
+	}
+	return result;
+}
+
+/*
+ * Forget all SFS's buffers; for unmount, after sfs_buf_flush, and for
+ * a failed mount. None may be pinned.
+ */
+void
+sfs_buf_purge(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *next;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (b = sb_lruhead; b != NULL; b = next) {
+		next = b->b_next;
+		if (b->b_dev == sfs->sfs_device) {
+			sb_forget(b);
+			kmem_cache_free(sb_bufcache, b);
+		}
+	}
+}
+
+/*
+ * Set up; called from sfs_domount, and does nothing after the first
+ * time.
+ */
+int
+sfs_buf_bootstrap(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sb_bufcache != NULL) {
+		return 0;
+	}
+	sb_bufcache = kmem_cache_create("sfs_buf", sizeof(struct sfs_buf),
+					0, NULL, NULL);
+	if (sb_bufcache == NULL) {
+		return ENOMEM;
+	}
+	pcounter_register(&sb_hits);
+	pcounter_register(&sb_misses);
+	pcounter_register(&sb_writebacks);
+	pcounter_register(&sb_evictions);
+	return 0;
+}
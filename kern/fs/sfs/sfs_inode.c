@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <pagecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
+#include "opt-sfscheck.h"
 
 
 /*
@@ -60,6 +62,177 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Vnode table
+
+/*
+ * The loaded vnodes are kept in a hash table on inode number, chained
+ * through sv_hnext. The table starts at SFS_VNHASH_MINSIZE buckets and
+ * doubles whenever there are more than twice as many vnodes as
+ * buckets; if there isn't memory to double it, the chains just get
+ * longer. It never shrinks.
+ */
+
+#define SFS_VNHASH_MINSIZE	64	/* Must be a power of 2 */
+
+static
+inline
+unsigned
+sfs_vnhashfn(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+/*
+ * Set up an empty table; for sfs_fs_create.
+ */
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_MINSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_MINSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_MINSIZE;
+	sfs->sfs_nvnodes = 0;
+	return 0;
+}
+
+/*
+ * Destroy the table, which must be empty; for sfs_fs_destroy.
+ */
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+}
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhashfn(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of buckets, if we can.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **old, *sv, *next;
+	unsigned oldsize, i, b;
+
+	old = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashsize;
+
+	sfs->sfs_vnhash = kmalloc(2 * oldsize * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		sfs->sfs_vnhash = old;
+		return;
+	}
+	sfs->sfs_vnhashsize = 2 * oldsize;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+
+	for (i=0; i<oldsize; i++) {
+		for (sv = old[i]; sv != NULL; sv = next) {
+			next = sv->sv_hnext;
+			b = sfs_vnhashfn(sfs, sv->sv_ino);
+			sv->sv_hnext = sfs->sfs_vnhash[b];
+			sfs->sfs_vnhash[b] = sv;
+		}
+	}
+	kfree(old);
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
+	}
+	b = sfs_vnhashfn(sfs, sv->sv_ino);
+	sv->sv_hnext = sfs->sfs_vnhash[b];
+	sfs->sfs_vnhash[b] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	pp = &sfs->sfs_vnhash[sfs_vnhashfn(sfs, sv->sv_ino)];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		pp = &(*pp)->sv_hnext;
+	}
+	*pp = sv->sv_hnext;
+	sv->sv_hnext = NULL;
+	sfs->sfs_nvnodes--;
+}
+
+#if OPT_SFSCHECK
+/*
+ * Every inode in memory must be in an allocated block. This used to be
+ * checked for every vnode on every sfs_loadvnode, which made loading a
+ * vnode cost a bitmap probe per vnode already loaded; now it's only
+ * done with "options sfscheck".
+ */
+static
+void
+sfs_vnhash_check(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i, n;
+
+	n = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hnext) {
+			KASSERT(sfs_vnhashfn(sfs, sv->sv_ino) == i);
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: %s: Found inode %u in unallocated "
+				      "block\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino);
+			}
+			n++;
+		}
+	}
+	KASSERT(n == sfs->sfs_nvnodes);
+}
+#endif
+
+////////////////////////////////////////////////////////////
+//
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,7 +243,6 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -93,6 +265,24 @@ sfs_reclaim(struct vnode *v)
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Get the file's pages out of the page cache, which names them
+	 * by this vnode. Write them back first, unless the file is
+	 * about to be erased anyway. sfs_write allocates blocks up
+	 * front, so this shouldn't run out of space; if it fails anyway
+	 * (an I/O error), the data is lost. Failing the reclaim instead
+	 * would strand the vnode, and its dirty pages, for good.
+	 */
+	if (sv->sv_i.sfi_linkcount != 0) {
+		result = pagecache_flush(v);
+		if (result) {
+			kprintf("sfs: %s: inode %u: file data lost: %s\n",
+				sfs->sfs_sb.sb_volname, sv->sv_ino,
+				strerror(result));
+		}
+	}
+	pagecache_purge(v);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
@@ -115,21 +305,7 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
 	vnode_cleanup(&sv->sv_absvn);
 
@@ -150,36 +326,23 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+#if OPT_SFSCHECK
+	sfs_vnhash_check(sfs);
+#endif
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		VOP_INCREF(&sv->sv_absvn);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -243,12 +406,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_add(sfs, sv);
 
 	/* Hand it back */
 	*ret = sv;
@@ -37,6 +37,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <vfs.h>
+#include <vm.h>
 #include <device.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -53,9 +54,9 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read or write a block, retrying I/O errors. This goes straight to
+ * the disk; the buffer cache uses it to fill and write back buffers.
  */
-static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
@@ -102,33 +103,45 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, through the buffer cache.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. This only updates the buffer cache; the block is
+ * written to disk later (see sfs_buf.c).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_buf_data(buf), data, SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +163,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +174,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +186,27 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block's buffer, and perform the requested operation
+	 * into/out of it. If it was a write, the buffer is now dirty.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
-
-	/*
-	 * If it was a write, write back the modified block.
-	 */
+	result = uiomove((char *)sfs_buf_data(buf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_buf_markdirty(buf);
 	}
+	sfs_buf_release(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,6 +217,7 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -257,6 +247,26 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
+	/*
+	 * File data is cached by the page cache, so whole blocks of it
+	 * bypass the buffer cache; but the block may be in there anyway,
+	 * as a partial block written earlier or as the zeroed buffer of
+	 * a block sfs_bmap just allocated. A read must see that buffer,
+	 * since it may be dirty; a write makes it stale, so drop it, and
+	 * save writing it back.
+	 */
+	if (uio->uio_rw == UIO_READ) {
+		buf = sfs_buf_find(sfs, diskblock);
+		if (buf != NULL) {
+			result = uiomove(sfs_buf_data(buf), SFS_BLOCKSIZE, uio);
+			sfs_buf_release(buf);
+			return result;
+		}
+	}
+	else {
+		sfs_buf_drop(sfs, diskblock);
+	}
+
 	/*
 	 * Do the I/O directly to the uio region. Save the uio_offset,
 	 * and substitute one that makes sense to the device.
@@ -388,6 +398,46 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Move one page of a file between the page cache and the disk (the
+ * pagecache_iofn for SFS files). Reads past EOF come back as zeros;
+ * writes stop at EOF, which the cache leaves to us.
+ */
+int
+sfs_pageio(struct vnode *v, off_t offset, void *page, enum uio_rw rw)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct iovec iov;
+	struct uio ku;
+	off_t len;
+	int result;
+
+	vfs_biglock_acquire();
+
+	len = PAGE_SIZE;
+	if (rw == UIO_WRITE) {
+		if (offset >= sv->sv_i.sfi_size) {
+			/* Truncated since it was dirtied. */
+			vfs_biglock_release();
+			return 0;
+		}
+		if (offset + len > sv->sv_i.sfi_size) {
+			len = sv->sv_i.sfi_size - offset;
+		}
+	}
+
+	uio_kinit(&iov, &ku, page, len, offset, rw);
+	result = sfs_io(sv, &ku);
+
+	vfs_biglock_release();
+
+	if (result == 0 && rw == UIO_READ) {
+		bzero((char *)page + (PAGE_SIZE - ku.uio_resid),
+		      ku.uio_resid);
+	}
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // Metadata I/O
 
@@ -407,6 +457,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *blockdata;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,18 +466,6 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,26 +486,21 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block's buffer */
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
+	blockdata = sfs_buf_data(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, blockdata + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(blockdata + blockoffset, data, len);
+		sfs_buf_markdirty(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -474,6 +509,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 			sv->sv_dirty = true;
 		}
 	}
+	sfs_buf_release(buf);
 
 	/* Done */
 	return 0;
@@ -39,6 +39,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <vfs.h>
+#include <vm.h>
+#include <pagecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -98,15 +100,16 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	off_t size;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
 	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
+	size = sv->sv_i.sfi_size;
 	vfs_biglock_release();
 
-	return result;
+	/* Not holding the biglock; sfs_pageio gets it if needed. */
+	return pagecache_read(v, uio, size, sfs_pageio);
 }
 
 /*
@@ -117,14 +120,72 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t start, oldsize, endpos, resend, reserved, cutoff;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	endpos = uio->uio_offset + uio->uio_resid;
+	if (endpos > SFS_MAXFILESIZE) {
+		/* sfs_bmap would only find out at writeback */
+		return EFBIG;
+	}
+
 	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
+
+	/*
+	 * Allocate the blocks now, so a full disk fails the write
+	 * instead of the writeback. Writeback goes a page at a time, up
+	 * to EOF, so include any holes in the first and last pages. If
+	 * we run out partway, do a short write that stops before the
+	 * first page that couldn't be filled in.
+	 */
+	oldsize = sv->sv_i.sfi_size;
+	start = uio->uio_offset - uio->uio_offset % PAGE_SIZE;
+	resend = ROUNDUP(endpos, PAGE_SIZE);
+	if (resend > oldsize) {
+		resend = oldsize > endpos ? oldsize : endpos;
+	}
+	result = sfs_breserve(sv, start, resend, &reserved);
+	if (reserved < resend) {
+		reserved -= reserved % PAGE_SIZE;
+	}
+	if (reserved <= uio->uio_offset) {
+		vfs_biglock_release();
+		return result;
+	}
+	cutoff = 0;
+	if (reserved < endpos) {
+		cutoff = endpos - reserved;
+		uio->uio_resid -= cutoff;
+		endpos = reserved;
+	}
+
+	/*
+	 * Extend the file first, so the pages aren't clipped at the old
+	 * EOF if they're written back before we're done.
+	 */
+	if (endpos > oldsize) {
+		sv->sv_i.sfi_size = endpos;
+		sv->sv_dirty = true;
+	}
 	vfs_biglock_release();
 
+	result = pagecache_write(v, uio, oldsize, sfs_pageio);
+
+	/* If we didn't get that far, don't leave a tail of zeros. */
+	if (uio->uio_offset < endpos && endpos > oldsize) {
+		vfs_biglock_acquire();
+		if (sv->sv_i.sfi_size == endpos) {
+			sv->sv_i.sfi_size = oldsize > uio->uio_offset ?
+				oldsize : uio->uio_offset;
+		}
+		vfs_biglock_release();
+	}
+
+	/* Report the part we had no room for as not written. */
+	uio->uio_resid += cutoff;
+
 	return result;
 }
 
@@ -224,22 +285,33 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
+	/* Data first; writing it back can change the inode. */
+	result = pagecache_flush(v);
+	if (result) {
+		return result;
+	}
+
+	/* Then the inode and everything else in the buffer cache. */
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = sfs_buf_flush(sv->sv_absvn.vn_fs->fs_data);
+	}
 	vfs_biglock_release();
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any regular file can be mapped; the VM system
+ * pages it with sfs_read and sfs_write.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -251,6 +323,7 @@ sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
+	pagecache_truncate(v, len);
 	return sfs_itrunc(sv, len);
 }
 
@@ -41,15 +41,34 @@ extern const struct vnode_ops sfs_dirops;
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
+/* Largest file an inode can map: the direct blocks plus one indirect */
+#define SFS_MAXFILESIZE \
+    ((off_t)(SFS_NDIRECT + SFS_NINDIRECT * SFS_DBPERIDB) * SFS_BLOCKSIZE)
+
 
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_buf.c */
+struct sfs_buf;
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool fill,
+		struct sfs_buf **ret);
+struct sfs_buf *sfs_buf_find(struct sfs_fs *sfs, daddr_t block);
+void *sfs_buf_data(struct sfs_buf *b);
+void sfs_buf_markdirty(struct sfs_buf *b);
+void sfs_buf_release(struct sfs_buf *b);
+void sfs_buf_drop(struct sfs_fs *sfs, daddr_t block);
+int sfs_buf_flush(struct sfs_fs *sfs);
+void sfs_buf_purge(struct sfs_fs *sfs);
+int sfs_buf_bootstrap(void);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_breserve(struct sfs_vnode *sv, off_t start, off_t end,
+		off_t *reserved);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -63,6 +82,8 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		int *slot);
 
 /* Functions in sfs_inode.c */
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
@@ -71,9 +92,11 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_pageio(struct vnode *v, off_t offset, void *page, enum uio_rw rw);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
@@ -37,8 +37,48 @@
 
 #include <vm.h>
 #include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <platform/maxcpus.h>
+#endif
 
 struct vnode;
+struct lock;
+struct semaphore;
+struct pagetable;
+
+
+#if !OPT_DUMBVM
+/*
+ * A region is a page-aligned range of the address space with one set
+ * of permissions: a program segment or the stack. Pages within it
+ * get physical memory the first time they're touched. A region can
+ * be backed by part of a file (a program segment is backed by its
+ * part of the executable); bytes outside that part read as zero.
+ *
+ * Regions made by mmap are marked RGF_MMAP, and only they can be
+ * unmapped. An RGF_SHARED region's pages are written back to its file
+ * instead of being private copies of it; vm_fault marks each page
+ * PTE_DIRTY the first time it's written, and as_msync writes those.
+ */
+struct region {
+	vaddr_t rg_base;
+	size_t rg_npages;
+	int rg_perms;			/* RG_READ | RG_WRITE | RG_EXEC */
+	int rg_flags;			/* RGF_MMAP | RGF_SHARED */
+	struct vnode *rg_vnode;		/* Backing file, or NULL */
+	vaddr_t rg_filebase;		/* Where the file data starts... */
+	off_t rg_fileoff;		/* ...its offset in the file... */
+	size_t rg_filesize;		/* ...and length; the rest is zero */
+	struct region *rg_next;
+};
+
+#define RG_READ		4
+#define RG_WRITE	2
+#define RG_EXEC		1
+
+#define RGF_MMAP	1
+#define RGF_SHARED	2
+#endif
 
 
 /*
@@ -58,7 +98,12 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct region *as_regions;
+        struct pagetable *as_pt;
+        struct lock *as_lock;           /* Protects the page table */
+        struct semaphore *as_tlbdone;   /* For vm_tlbshootdown_as */
+        uint64_t as_asid[MAXCPUS];      /* TLB tag on each cpu (vm.c) */
+        bool as_loading;                /* Between prepare/complete_load */
 #endif
 };
 
@@ -99,6 +144,30 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_findregion - find the region containing a virtual address, or
+ *                NULL if there isn't one. (Not with dumbvm.)
+ *
+ *    as_define_backing - back FILESIZE bytes of a region, starting at
+ *                VADDR, with a file starting at OFFSET. Takes a
+ *                reference to the vnode. (Not with dumbvm.)
+ *
+ *    as_fillpage - get a frame for the page at VADDR, holding the
+ *                contents it should start with. (Not with dumbvm.)
+ *
+ *    as_mmap   - make a region of LEN bytes with permissions PERMS and
+ *                flags FLAGS (RGF_SHARED or 0), backed by V from OFFSET
+ *                on, or zero-filled if V is NULL. If *VADDR is 0 it
+ *                picks the address, below the stack; otherwise the
+ *                region goes at *VADDR, which must be free. Sets *VADDR
+ *                to where the region went. (Not with dumbvm.)
+ *
+ *    as_munmap - remove the mmap regions in LEN bytes at VADDR, after
+ *                writing back any shared ones. The range can't cut
+ *                through any of them. (Not with dumbvm.)
+ *
+ *    as_msync  - write back the written pages of shared regions in LEN
+ *                bytes at VADDR. (Not with dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +186,19 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+void              as_bootstrap(void);
+struct region    *as_findregion(struct addrspace *as, vaddr_t va);
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    size_t filesize, struct vnode *v,
+                                    off_t offset);
+int               as_fillpage(struct region *rg, vaddr_t vaddr, paddr_t *ret);
+int               as_mmap(struct addrspace *as, vaddr_t *vaddr, size_t len,
+                          int perms, int flags, struct vnode *v,
+                          off_t offset);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
 
 
 /*
@@ -59,15 +59,37 @@
  * The const qualifiers and types will help protect against mistakes
  * in this regard but are obviously not foolproof.
  *
+ * copyinv and copyoutv do COUNT copyins or copyouts at once, for
+ * calls that move several separate buffers; the fault handling is
+ * set up once for the lot instead of once per buffer. All the user
+ * addresses are checked before anything is copied.
+ *
  * These functions are machine-dependent; however, a common version
  * that can be used by a number of machine types is found in
- * vm/copyinout.c.
+ * vm/copyinout.c. That version counts calls, bytes, and cycles spent
+ * in the copyin_* and copyout_* pcounters, which
+ * copyinout_bootstrap registers.
  */
 
+struct copyinvec {
+	const_userptr_t ci_usersrc;
+	void *ci_dest;
+	size_t ci_len;
+};
+
+struct copyoutvec {
+	const void *co_src;
+	userptr_t co_userdest;
+	size_t co_len;
+};
+
 int copyin(const_userptr_t usersrc, void *dest, size_t len);
 int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
+int copyinv(const struct copyinvec *vec, unsigned count);
+int copyoutv(const struct copyoutvec *vec, unsigned count);
+void copyinout_bootstrap(void);
 
 
 #endif /* _COPYINOUT_H_ */
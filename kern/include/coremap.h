@@ -0,0 +1,91 @@
+/**
+ * @file:   coremap.h
+ * @brief:  physical page frame allocator
+ */
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * The coremap has one entry per physical page frame, built by
+ * coremap_bootstrap from ram_getsize() once the VM system starts.
+ * Frames below the first free address at that point (exception
+ * vectors, the kernel image, anything ram_stealmem handed out during
+ * early boot, and the coremap itself) are marked fixed and are never
+ * allocated or freed.
+ *
+ * Free frames are managed by a binary buddy allocator: free blocks
+ * of 2^k frames, aligned to 2^k, on one list per order k. Single
+ * pages additionally go through a small per-cpu cache.
+ *
+ * Until coremap_bootstrap runs, coremap_alloc falls back to
+ * ram_stealmem, so callers don't need to care which phase of boot
+ * they're in. Pages stolen that way can't be given back;
+ * coremap_free quietly ignores them.
+ *
+ * coremap_alloc returns the physical address of a run of NPAGES
+ * contiguous frames, or 0 if there isn't one. coremap_free takes the
+ * address of the first frame of a run and frees all of it.
+ *
+ * A single page can be shared: coremap_share adds a reference, and
+ * coremap_free only frees the page when the last one is dropped.
+ *
+ * For page replacement, vm_fault tells the coremap which address
+ * space uses each user page with coremap_touch. coremap_pickvictim
+ * chooses a page to evict by the clock algorithm and marks it busy;
+ * coremap_trybusy marks a particular page busy if it's a candidate
+ * too, and coremap_unbusy is called when the pager is done. Freeing
+ * a busy page waits until it isn't.
+ *
+ * The kernel allocator that owns a page can record one byte about it
+ * with coremap_settag and read it back from the page's address with
+ * coremap_gettag; allocation resets it to 0.
+ *
+ * Idle cpus keep a few pages zeroed ahead of time: coremap_idlezero
+ * zeroes one, if more are wanted, and coremap_getzeroed hands one out
+ * (or returns 0 if none are ready; the caller zeroes its own).
+ *
+ * coremap_nfree is a cheap, unlocked guess at the number of free
+ * frames, for callers deciding whether to hold on to memory;
+ * coremap_getstats gives the whole picture.
+ */
+
+/* Largest block is 2^(COREMAP_NORDERS-1) pages. */
+#define COREMAP_NORDERS	16
+
+/* Page tags. */
+#define CMTAG_NONE	0
+#define CMTAG_KMALLOC	1	/* kmalloc subpage page, plus block type */
+#define CMTAG_KMSITE	0x80	/* kmalloc multi-page block, plus site */
+#define CMTAG_SLAB	0xff	/* Object cache slab */
+
+struct addrspace;
+
+struct coremap_stats {
+	unsigned cs_total;		/* Frames in physical memory */
+	unsigned cs_fixed;		/* Never allocatable */
+	unsigned cs_free;		/* Free now, including cs_cached */
+	unsigned cs_cached;		/* Free, in per-cpu caches */
+	unsigned cs_used;		/* Allocated now */
+	unsigned cs_zeroed;		/* Allocated, zeroed for later */
+	unsigned cs_largestrun;		/* Largest free block, in pages */
+	unsigned cs_nblocks[COREMAP_NORDERS];	/* Free blocks per order */
+};
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned npages);
+void coremap_free(paddr_t pa);
+void coremap_share(paddr_t pa);
+unsigned coremap_refcount(paddr_t pa);
+void coremap_settag(paddr_t pa, unsigned tag);
+unsigned coremap_gettag(paddr_t pa);
+void coremap_touch(paddr_t pa, struct addrspace *as, vaddr_t va);
+int coremap_pickvictim(paddr_t *pa, struct addrspace **as, vaddr_t *va);
+bool coremap_trybusy(paddr_t pa, struct addrspace *as, vaddr_t va);
+void coremap_unbusy(paddr_t pa);
+paddr_t coremap_getzeroed(void);
+bool coremap_idlezero(void);
+unsigned coremap_nfree(void);
+void coremap_getstats(struct coremap_stats *cs);
+
+#endif /* _COREMAP_H_ */
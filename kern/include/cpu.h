@@ -61,6 +61,8 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct thread *c_idlethread;	/* Runs when nothing else can */
+	struct thread *c_migrant;	/* Thread leaving this cpu */
 
 	/*
 	 * Accessed by other cpus.
@@ -125,6 +127,13 @@ void cpu_identify(char *buf, size_t max);
 void cpu_irqoff(void);
 void cpu_irqon(void);
 
+/*
+ * Read the current CPU's cycle counter, for timing short stretches
+ * of code. It's 32 bits and wraps; subtract two readings as unsigned
+ * values to get the cycles in between.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Idle or shut down (respectively) the processor.
  *
@@ -134,6 +143,8 @@ void cpu_irqon(void);
  * be called in a loop checking some other condition.) It must be
  * called with interrupts off to avoid race conditions, although
  * interrupts may be delivered before it returns.
+ * It may also use the time for background work, such as zeroing free
+ * pages, in which case it returns once that's done.
  *
  * cpu_halt sits around (in a low-power state if possible) until the
  * external reset is pushed. Interrupts should be disabled. It does
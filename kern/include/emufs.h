@@ -45,6 +45,7 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	off_t ev_size;			/* file size, or -1 if not known yet */
 };
 
 struct emufs_fs {
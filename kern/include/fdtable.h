@@ -8,6 +8,7 @@
 
 
 struct file;
+struct vnode;
 #define MAX_FD_COUNT_PER_PROCESS 128
 #define FD_BITS (sizeof(unsigned int) * 8)
 
@@ -43,6 +44,8 @@ ssize_t do_sys_read(int fd, char* buf, size_t buf_len);
 
 ssize_t do_sys_write(int fd, const void *buf, size_t nbytes);
 
+int do_sys_getvnode(int fd, struct vnode** v, int* flags);
+
 
 int init_fd_table(struct proc* cur);
 void destroy_fd_table(struct proc* proc);
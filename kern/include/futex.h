@@ -0,0 +1,22 @@
+/**
+ * @file:   futex.h
+ * @brief:  wait/wake on user addresses, for userland locks
+ */
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <kern/futex.h>
+
+struct addrspace;
+
+/*
+ * Waiters are keyed by (address space, user virtual address), so two
+ * processes using the same address don't see each other's wakeups.
+ */
+void futex_bootstrap(void);
+int futex_wait(struct addrspace *as, userptr_t uaddr, int val);
+int futex_wake(struct addrspace *as, userptr_t uaddr, int count,
+	       int *woken);
+
+#endif /* _FUTEX_H_ */
@@ -0,0 +1,27 @@
+/**
+ * @file:   futex.h
+ * @brief:  operation codes for the futex() system call
+ */
+
+#ifndef _KERN_FUTEX_H_
+#define _KERN_FUTEX_H_
+
+/*
+ * futex(uaddr, op, val)
+ *
+ * FUTEX_WAIT: if *uaddr still equals val, sleep until a FUTEX_WAKE on
+ *             the same address. Returns 0 when woken, or fails with
+ *             EAGAIN if *uaddr had already changed. Wakeups may be
+ *             spurious; callers must recheck their condition.
+ * FUTEX_WAKE: wake up to val threads sleeping on uaddr. Returns the
+ *             number woken.
+ *
+ * uaddr must be word-aligned.
+ */
+#define FUTEX_WAIT	0
+#define FUTEX_WAKE	1
+
+/* Value for FUTEX_WAKE to wake every waiter. */
+#define FUTEX_WAKE_ALL	0x7fffffff
+
+#endif /* _KERN_FUTEX_H_ */
@@ -0,0 +1,48 @@
+/**
+ * @file:   mman.h
+ * @brief:  flags for the mmap() family of system calls
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * mmap(addr, len, prot, flags, fd, offset)
+ *
+ * Maps LEN bytes of the file open on FD, starting at OFFSET (which
+ * must be a multiple of the page size), and returns the address of
+ * the mapping. Pages are read from the file the first time they're
+ * touched; bytes past the end of the file read as zero.
+ *
+ * MAP_SHARED: writes go back to the file, on msync, munmap, or exit.
+ *             Writing needs PROT_WRITE and a file opened O_RDWR.
+ * MAP_PRIVATE: writes go to a private copy of the page.
+ * MAP_FIXED: map exactly at ADDR, which must be page-aligned and not
+ *            already in use; otherwise ADDR is ignored.
+ * MAP_ANON: map zero-filled memory instead of a file; FD and OFFSET
+ *           are ignored.
+ *
+ * munmap(addr, len) removes the mappings in the range, which must
+ * cover each of them whole.
+ *
+ * msync(addr, len, flags) writes back what's been written to the
+ * shared mappings in the range. MS_ASYNC is treated like MS_SYNC.
+ */
+#define PROT_NONE	0
+#define PROT_READ	1
+#define PROT_WRITE	2
+#define PROT_EXEC	4
+
+#define MAP_SHARED	0x0001
+#define MAP_PRIVATE	0x0002
+#define MAP_FIXED	0x0010
+#define MAP_ANON	0x1000
+
+#define MS_ASYNC	1
+#define MS_SYNC		2
+#define MS_INVALIDATE	4
+
+/* What mmap returns (as -1 with errno set) on failure. */
+#define MAP_FAILED	((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -197,6 +197,16 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Synchronization --
+#define SYS_futex        121
+
+//                              -- Scheduling --
+#define SYS_setaffinity  122
+#define SYS_getaffinity  123
+
+//                              -- Memory mapping --
+#define SYS_msync        124
+
 /*CALLEND*/
 
 
@@ -0,0 +1,71 @@
+/**
+ * @file:   trace.h
+ * @brief:  event trace record format, shared with the host-side decoder
+ */
+
+#ifndef _KERN_TRACE_H_
+#define _KERN_TRACE_H_
+
+/*
+ * One trace record. All fields are in the kernel's byte order
+ * (big-endian on System/161).
+ */
+struct trace_record {
+	uint32_t tr_sec;		/* Timestamp */
+	uint32_t tr_nsec;
+	uint16_t tr_event;		/* TRACE_* */
+	uint16_t tr_cpu;		/* cpu number */
+	uint32_t tr_thread;		/* Address of the running thread */
+	uint32_t tr_arg0;		/* Event-specific */
+	uint32_t tr_arg1;
+};
+
+/*
+ * A saved trace file is a header followed by tf_numrecs records in
+ * timestamp order.
+ */
+#define TRACE_MAGIC	0x54524331	/* "TRC1" */
+
+struct trace_filehdr {
+	uint32_t tf_magic;
+	uint32_t tf_recsize;		/* sizeof(struct trace_record) */
+	uint32_t tf_numrecs;
+	uint32_t tf_ncpus;
+};
+
+/* Events, and what their arguments are. */
+#define TRACE_SWITCH	1	/* next thread, old thread's new state */
+#define TRACE_WAKEUP	2	/* thread made runnable, cpu it went to */
+#define TRACE_SYSCALL	3	/* call number, first argument */
+#define TRACE_SYSRET	4	/* call number, error (0 on success) */
+#define TRACE_VOP	5	/* TRACEVOP_* operation, vnode */
+#define TRACE_INTR	6	/* lamebus slot, 0 */
+#define TRACE_NEVENTS	7
+
+/* Vnode operations, for TRACE_VOP. Named to match struct vnode_ops. */
+#define TRACEVOP_eachopen	0
+#define TRACEVOP_reclaim	1
+#define TRACEVOP_read		2
+#define TRACEVOP_readlink	3
+#define TRACEVOP_getdirentry	4
+#define TRACEVOP_write		5
+#define TRACEVOP_ioctl		6
+#define TRACEVOP_stat		7
+#define TRACEVOP_gettype	8
+#define TRACEVOP_isseekable	9
+#define TRACEVOP_fsync		10
+#define TRACEVOP_mmap		11
+#define TRACEVOP_truncate	12
+#define TRACEVOP_namefile	13
+#define TRACEVOP_creat		14
+#define TRACEVOP_symlink	15
+#define TRACEVOP_mkdir		16
+#define TRACEVOP_link		17
+#define TRACEVOP_remove		18
+#define TRACEVOP_rmdir		19
+#define TRACEVOP_rename		20
+#define TRACEVOP_lookup		21
+#define TRACEVOP_lookparent	22
+#define TRACEVOP_NOPS		23
+
+#endif /* _KERN_TRACE_H_ */
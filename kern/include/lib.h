@@ -123,15 +123,24 @@ uint32_t random(void);
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
+ * kheap_bootstrap starts the per-cpu caches; kmalloc works without
+ * it, just more slowly.
+ *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * Likewise kheap_printsites, which prints the MAX busiest kmalloc
+ * call sites, and kheap_resetsites, which starts a new window for
+ * their rates, need allocation site counting (SITES) enabled.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+void kheap_bootstrap(void);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_printsites(unsigned max);
+void kheap_resetsites(void);
 
 /*
  * C string functions.
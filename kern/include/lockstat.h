@@ -0,0 +1,81 @@
+/**
+ * @file:   lockstat.h
+ * @brief:  lock contention profiler hooks
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+/*
+ * Lock contention profiler. Enable with "options lockstat" in the
+ * kernel config.
+ *
+ * Spinlocks and sleep locks can be given a named class with
+ * spinlock_setclass() and lock_setclass(). Every lock with the same
+ * class name shares one set of statistics: acquisitions, contended
+ * acquisitions, and total/maximum wait and hold time. Locks without
+ * a class are not recorded, so the cost of the hooks for them is one
+ * pointer test.
+ *
+ * The hooks sit next to the hangman hooks in spinlock_acquire and
+ * lock_acquire; a "waiter" is a per-call record of when the caller
+ * first found the lock busy.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+struct lockstat_class;		/* Opaque; see lockstat.c */
+
+struct lockstat_lockable {
+	struct lockstat_class *ls_class;	/* NULL if not profiled */
+	uint64_t ls_acquired;		/* Time the holder got the lock */
+};
+
+struct lockstat_waiter {
+	uint64_t w_start;		/* Time contention began, or 0 */
+};
+
+void lockstat_bootstrap(void);
+void lockstat_setclass(struct lockstat_lockable *l, const char *name);
+void lockstat_contended(struct lockstat_waiter *w);
+void lockstat_acquire(struct lockstat_waiter *w, struct lockstat_lockable *l);
+void lockstat_release(struct lockstat_lockable *l);
+
+/* Menu interface. */
+void lockstat_printstats(unsigned maxrows);
+void lockstat_reset(void);
+
+#define LOCKSTAT_LOCKABLE(sym)	struct lockstat_lockable sym
+#define LOCKSTAT_WAITER(sym)	struct lockstat_waiter sym
+
+#define LOCKSTAT_LOCKABLEINIT(l)	((l)->ls_class = NULL)
+#define LOCKSTAT_LOCKABLE_INITIALIZER	{ NULL, 0 }
+#define LOCKSTAT_SETCLASS(l, n)		lockstat_setclass(l, n)
+
+#define LOCKSTAT_WAIT(w)	((w)->w_start = 0)
+#define LOCKSTAT_CONTENDED(w, l) \
+	((l)->ls_class != NULL ? lockstat_contended(w) : (void)0)
+#define LOCKSTAT_ACQUIRE(w, l) \
+	((l)->ls_class != NULL ? lockstat_acquire(w, l) : (void)0)
+#define LOCKSTAT_RELEASE(l) \
+	((l)->ls_class != NULL ? lockstat_release(l) : (void)0)
+
+#else
+
+#define LOCKSTAT_LOCKABLE(sym)
+#define LOCKSTAT_WAITER(sym)
+
+#define LOCKSTAT_LOCKABLEINIT(l)
+#define LOCKSTAT_LOCKABLE_INITIALIZER
+#define LOCKSTAT_SETCLASS(l, n)		((void)(n))
+
+#define LOCKSTAT_WAIT(w)
+#define LOCKSTAT_CONTENDED(w, l)
+#define LOCKSTAT_ACQUIRE(w, l)
+#define LOCKSTAT_RELEASE(l)
+
+#endif
+
+#endif /* LOCKSTAT_H */
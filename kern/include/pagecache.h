@@ -0,0 +1,74 @@
+/**
+ * @file:   pagecache.h
+ * @brief:  cache of file data pages, shared by all filesystems
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include <uio.h>
+
+/*
+ * The page cache keeps recently used pages of file data in memory,
+ * named by vnode and page-aligned file offset. A filesystem opts in
+ * by calling pagecache_read and pagecache_write from its VOP_READ and
+ * VOP_WRITE, and handing over a function that moves one page between
+ * the cache and the disk:
+ *
+ *    iofn(v, offset, page, rw) - for UIO_READ, fill PAGE with the
+ *                   page of V at OFFSET, zeroing whatever is past
+ *                   EOF. For UIO_WRITE, write PAGE back, but not past
+ *                   EOF. Called without any of the cache's locks, and
+ *                   may sleep.
+ *
+ * Writes only dirty the cached page; it's written back later, by
+ * pagecache_flush (from VOP_FSYNC), or once too many of the file's
+ * pages are dirty.
+ * The filesystem still owns the file size: it passes the size to
+ * pagecache_read and pagecache_write, and must already have extended
+ * the size to cover a write before calling pagecache_write, so that
+ * writeback never clips off newly written data.
+ *
+ *    pagecache_read     - read UIO from V, whose size is SIZE.
+ *
+ *    pagecache_write    - write UIO to V, whose size before this write
+ *                         was SIZE. Pages wholly past SIZE, or wholly
+ *                         overwritten, aren't read in first.
+ *
+ *    pagecache_flush    - write back all V's dirty pages.
+ *
+ *    pagecache_truncate - forget V's data past LEN.
+ *
+ *    pagecache_purge    - forget all V's pages, dirty or not; for
+ *                         VOP_RECLAIM (after pagecache_flush, unless
+ *                         the file is being deleted). Pages are named
+ *                         by vnode pointer, so a vnode must be purged
+ *                         before its memory is reused.
+ *
+ *    pagecache_reclaim  - give back up to NPAGES clean pages that
+ *                         nobody is using, oldest first, when memory
+ *                         runs low. Returns how many it gave back.
+ *
+ *    pagecache_printstats - print hit and dirty counts; called from
+ *                         kheap_printstats.
+ *
+ *    pagecache_bootstrap - set up. Call after kmem_bootstrap.
+ */
+
+struct vnode;
+
+typedef int (*pagecache_iofn)(struct vnode *v, off_t offset, void *page,
+			      enum uio_rw rw);
+
+int pagecache_read(struct vnode *v, struct uio *uio, off_t size,
+		   pagecache_iofn iofn);
+int pagecache_write(struct vnode *v, struct uio *uio, off_t size,
+		    pagecache_iofn iofn);
+int pagecache_flush(struct vnode *v);
+void pagecache_truncate(struct vnode *v, off_t len);
+void pagecache_purge(struct vnode *v);
+unsigned pagecache_reclaim(unsigned npages);
+void pagecache_printstats(void);
+void pagecache_bootstrap(void);
+
+#endif /* _PAGECACHE_H_ */
@@ -0,0 +1,59 @@
+/**
+ * @file:   pagetable.h
+ * @brief:  two-level page tables for user address spaces
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+#include <vm.h>
+
+/*
+ * A page table maps user virtual pages to page table entries. The top
+ * ten bits of the address index a directory of PT_DIRSIZE pointers to
+ * second-level tables; the next ten index a second-level table of
+ * PT_TABLESIZE PTEs, which is exactly one page. Second-level tables
+ * are only allocated once something in their 4M of address space is
+ * touched, so a sparse address space costs little.
+ *
+ * A PTE holds the physical frame address in the high bits and flags
+ * in the low bits. A PTE of 0 means nothing is there. A page that's
+ * been paged out has PTE_SWAPPED instead of PTE_VALID, and its swap
+ * slot number where the frame address would be.
+ *
+ * PTE_VALID and PTE_WRITE are where the MIPS TLB keeps its valid and
+ * write-enable bits, so the TLB refill handler (mips_utlb_refill)
+ * can turn a valid PTE into a TLB entry just by masking off the other
+ * bits. PTE_WRITE says the page can be mapped writeable right away;
+ * without it a write goes through vm_fault, which decides.
+ *
+ * PTE_DIRTY marks a page of a shared file mapping that's been written
+ * since it was last written back to the file. It stays set while the
+ * page is out in swap.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	0xfffff000	/* Physical frame address */
+#define PTE_VALID	0x00000200	/* Page is in memory at PTE_FRAME */
+#define PTE_WRITE	0x00000400	/* ...and may be written */
+#define PTE_SWAPPED	0x00000001	/* Page is in swap at PTE_SLOT */
+#define PTE_DIRTY	0x00000002	/* Written since written back */
+
+#define PTE_SLOT(pte)		((pte) >> 12)
+#define PTE_MKSWAPPED(slot)	(((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+#define PT_DIRSHIFT	22
+#define PT_DIRSIZE	(USERSPACETOP >> PT_DIRSHIFT)
+#define PT_TABLESIZE	(PAGE_SIZE / sizeof(pte_t))
+
+struct pagetable {
+	pte_t *pt_dir[PT_DIRSIZE];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+pte_t *pt_next(struct pagetable *pt, vaddr_t *va);
+
+#endif /* _PAGETABLE_H_ */
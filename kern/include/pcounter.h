@@ -0,0 +1,60 @@
+/**
+ * @file:   pcounter.h
+ * @brief:  per-cpu statistics counters
+ */
+
+#ifndef _PCOUNTER_H_
+#define _PCOUNTER_H_
+
+#include <platform/maxcpus.h>
+
+/*
+ * A pcounter is a 64-bit event counter with one slot per cpu. Each
+ * cpu only ever writes its own slot, so updating it takes no lock and
+ * never waits for another cpu; a read sums all the slots. Slots are
+ * padded out to PCOUNTER_SLOTSIZE so two cpus' slots never share a
+ * cache line.
+ *
+ * Counters can be static (declare with PCOUNTER_INITIALIZER and call
+ * pcounter_register from the owner's bootstrap) or dynamic
+ * (pcounter_create/pcounter_destroy). Counting works before a counter
+ * is registered; registering just makes it show up in
+ * pcounter_printall and pcounter_lookup.
+ *
+ * Counter names are not copied and must outlive the counter.
+ */
+
+#define PCOUNTER_SLOTSIZE	64
+
+struct pcounter_slot {
+	volatile uint64_t ps_count;
+	char ps_pad[PCOUNTER_SLOTSIZE - sizeof(uint64_t)];
+};
+
+struct pcounter {
+	const char *pc_name;
+	struct pcounter *pc_next;	/* Registry linkage */
+	bool pc_registered;
+	struct pcounter_slot pc_slots[MAXCPUS];
+};
+
+#define PCOUNTER_INITIALIZER(name)	{ .pc_name = (name) }
+
+void pcounter_add(struct pcounter *pc, uint64_t n);
+#define pcounter_inc(pc) pcounter_add(pc, 1)
+uint64_t pcounter_read(struct pcounter *pc);
+uint64_t pcounter_readcpu(struct pcounter *pc, unsigned cpunum);
+void pcounter_reset(struct pcounter *pc);
+
+/* Registry. */
+void pcounter_register(struct pcounter *pc);
+void pcounter_unregister(struct pcounter *pc);
+struct pcounter *pcounter_create(const char *name);
+void pcounter_destroy(struct pcounter *pc);
+struct pcounter *pcounter_lookup(const char *name);
+
+/* Menu interface. */
+void pcounter_printall(void);
+void pcounter_resetall(void);
+
+#endif /* _PCOUNTER_H_ */
@@ -0,0 +1,64 @@
+/**
+ * @file:   slab.h
+ * @brief:  object caches for fixed-size kernel objects
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * An object cache hands out objects of one type. It gets memory a
+ * page (a "slab") at a time and cuts each slab into as many objects
+ * as fit, so objects don't get rounded up to a kmalloc size.
+ *
+ * Objects are kept constructed. The constructor runs on each object
+ * when its slab is made, and the destructor runs when the slab is
+ * given back, not on every alloc and free. So whatever the
+ * constructor sets up (locks, say) is still there the next time the
+ * object is allocated. An object must be back in its constructed
+ * state when it's freed.
+ *
+ *    kmem_cache_create  - make a cache of objects of SIZE bytes,
+ *                         aligned to ALIGN (a power of two, or 0 for
+ *                         the same alignment as kmalloc). CTOR, which
+ *                         may be NULL, returns 0 or an error code; if
+ *                         it fails, the allocation that needed a new
+ *                         slab fails. DTOR may be NULL too. NAME is
+ *                         not copied. Returns NULL if out of memory.
+ *
+ *    kmem_cache_destroy - destroy a cache. All its objects must have
+ *                         been freed.
+ *
+ *    kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *
+ *    kmem_cache_free    - give an object back.
+ *
+ *    kmem_cache_shrink  - give a cache's completely free slabs back to
+ *                         the page allocator; returns how many pages
+ *                         that freed.
+ *
+ *    kmem_cache_reap    - shrink every cache. Called when memory runs
+ *                         out; returns how many pages it freed, which
+ *                         is 0 if another thread is already reaping.
+ *
+ *    kmem_cache_printstats - print each cache's usage; called from
+ *                         kheap_printstats.
+ *
+ *    kmem_bootstrap     - set up for reaping. Caches can be created
+ *                         and used before this, but aren't reaped.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_shrink(struct kmem_cache *kc);
+unsigned kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+void kmem_bootstrap(void);
+
+#endif /* _SLAB_H_ */
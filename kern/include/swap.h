@@ -0,0 +1,48 @@
+/**
+ * @file:   swap.h
+ * @brief:  paging user memory out to a swap device
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <pagetable.h>
+
+/*
+ * Swap is off until swap_on attaches a device (with vfs_swapon); the
+ * device is then divided into page-sized slots. Until then, and once
+ * swap is full, running out of memory just fails as before.
+ *
+ *    swap_bootstrap - set up; called from vm_bootstrap.
+ *
+ *    swap_on      - attach DEVNAME as the swap device. Only one device
+ *                   can be attached, and it can't be detached.
+ *
+ *    swap_getpage - allocate a page of memory, paging something out
+ *                   first if there isn't one free. Returns 0 if that
+ *                   fails too.
+ *
+ *    swap_getzeropage - the same, but the page is zeroed; if an idle
+ *                   cpu zeroed one ahead of time, that's used.
+ *
+ *    swap_pagein  - bring the page at VA in AS, whose PTE is PTE, back
+ *                   in from swap, along with any neighbours that went
+ *                   out with it. Call with AS's lock held.
+ *
+ *    swap_read    - copy the page in SLOT into the frame at PA. The
+ *                   slot stays in use.
+ *
+ *    swap_free    - release SLOT.
+ */
+
+struct addrspace;
+
+void swap_bootstrap(void);
+int swap_on(const char *devname);
+paddr_t swap_getpage(void);
+paddr_t swap_getzeropage(void);
+int swap_pagein(struct addrspace *as, vaddr_t va, pte_t *pte);
+int swap_read(unsigned slot, paddr_t pa);
+void swap_free(unsigned slot);
+
+#endif /* _SWAP_H_ */
@@ -67,5 +67,18 @@ int syscall_lseek(int fd, off_t pos, int whence, off_t* retval) ;
 int syscall_write(int fd, const_userptr_t buf, size_t nbytes, size_t* retval)   ;
 int syscall_read(int fd, userptr_t buf, size_t buflen, size_t * retval) ;
 
+/* userland lock support */
+int syscall_futex(userptr_t uaddr, int op, int val, int *retval);
+
+/* memory-mapped files */
+int syscall_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+                 off_t offset, int *retval);
+int syscall_munmap(userptr_t addr, size_t len, int *retval);
+int syscall_msync(userptr_t addr, size_t len, int flags, int *retval);
+
+/* cpu affinity */
+int syscall_setaffinity(unsigned mask, int *retval);
+int syscall_getaffinity(userptr_t maskp, int *retval);
+
 
 #endif /* _SYSCALL_H_ */
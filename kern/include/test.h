@@ -93,6 +93,8 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int kmalloctest6(int, char **);
 int nettest(int, char **);
 int file_multithread_test(int, char **);
 
@@ -56,6 +56,14 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Set of cpus, one bit per cpu number. MAXCPUS must fit.
+ */
+typedef uint32_t cpumask_t;
+#define CPUMASK_ALL		((cpumask_t)0xffffffff)
+#define CPUMASK_BIT(n)		((cpumask_t)1 << (n))
+#define CPUMASK_ISSET(m, n)	(((m) & CPUMASK_BIT(n)) != 0)
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -82,6 +90,7 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	cpumask_t t_affinity;		/* CPUs thread may run on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
@@ -145,6 +154,28 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread may only ever run on the cpus
+ * in MASK, and starts on whichever of them has the shortest run queue
+ * (the current cpu wins ties). Fails with EINVAL if MASK contains no
+ * cpu that exists. thread_fork itself starts the new thread on the
+ * current cpu, and the new thread inherits the caller's affinity.
+ */
+int thread_fork_affinity(const char *name, struct proc *proc, cpumask_t mask,
+                         void (*func)(void *, unsigned long),
+                         void *data1, unsigned long data2);
+
+/*
+ * Restrict the current thread to the cpus in MASK. If the current cpu
+ * isn't in MASK, the thread moves before this returns. Bits for cpus
+ * that don't exist are ignored; fails with EINVAL if none are left.
+ */
+int thread_setaffinity(cpumask_t mask);
+cpumask_t thread_getaffinity(void);
+
+/* The set of cpus that exist. */
+cpumask_t thread_onlinecpus(void);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -0,0 +1,49 @@
+/**
+ * @file:   trace.h
+ * @brief:  static tracepoints into per-cpu event rings
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Kernel event tracer. Enable with "options trace" in the kernel
+ * config.
+ *
+ * TRACE(event, arg0, arg1) appends a timestamped struct trace_record
+ * (see <kern/trace.h>) to the current cpu's ring buffer. Only that cpu
+ * ever writes its ring, with interrupts off, so there's no lock and
+ * nothing to wait for; when a ring is full the oldest records are
+ * overwritten. Recording is off until switched on with the "trace"
+ * menu command, and costs one flag test while off.
+ */
+
+#include <kern/trace.h>
+#include "opt-trace.h"
+
+#if OPT_TRACE
+
+extern volatile bool trace_on;
+
+void trace_bootstrap(void);
+void trace_record(unsigned event, uint32_t arg0, uint32_t arg1);
+
+/* Menu interface. */
+void trace_start(void);
+void trace_stop(void);
+void trace_dump(unsigned maxrecs);
+int trace_save(char *path);
+
+#define TRACE(ev, a0, a1) \
+	(trace_on ? trace_record(ev, (uint32_t)(a0), (uint32_t)(a1)) : (void)0)
+
+#else
+
+#define TRACE(ev, a0, a1)	((void)0)
+
+#endif
+
+/* Pointers as trace arguments. */
+#define TRACE_PTR(p)	((uint32_t)(uintptr_t)(p))
+
+#endif /* _TRACE_H_ */
@@ -58,5 +58,18 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Invalidate every entry in this cpu's TLB */
+void vm_tlbflush(void);
+
+/* Switch this cpu's TLB to an address space (NULL for none) */
+struct addrspace;
+void vm_tlbactivate(struct addrspace *as);
+
+/* Remove an address space's TLB entries on all cpus, and wait */
+void vm_tlbshootdown_as(struct addrspace *as);
+
+/* Size of the user stack region; pages are only allocated on use */
+#define VM_STACKPAGES    1024
+
 
 #endif /* _VM_H_ */
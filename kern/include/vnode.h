@@ -31,6 +31,7 @@
 #define _VNODE_H_
 
 #include <spinlock.h>
+#include <trace.h>
 struct uio;
 struct stat;
 
@@ -56,6 +57,8 @@ struct vnode {
 
 	void *vn_data;                  /* Filesystem-specific data */
 
+	unsigned vn_ndirty;             /* Dirty pages in the page cache */
+
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
 };
 
@@ -120,9 +123,10 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check that the file can be mapped into memory.
+ *                      Returns 0 if it can. The VM system reads and
+ *                      writes the pages of a mapped file with vop_read
+ *                      and vop_write.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -223,7 +227,9 @@ struct vnode_ops {
 			      char *buf, size_t len);
 };
 
-#define __VOP(vn, sym) (vnode_check(vn, #sym), (vn)->vn_ops->vop_##sym)
+#define __VOP(vn, sym) (vnode_check(vn, #sym), \
+			TRACE(TRACE_VOP, TRACEVOP_##sym, TRACE_PTR(vn)), \
+			(vn)->vn_ops->vop_##sym)
 
 #define VOP_EACHOPEN(vn, flags)         (__VOP(vn, eachopen)(vn, flags))
 #define VOP_RECLAIM(vn)                 (__VOP(vn, reclaim)(vn))
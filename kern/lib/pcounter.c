@@ -0,0 +1,206 @@
+/**
+ * @file:   pcounter.c
+ * @brief:  per-cpu statistics counters and their registry
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <pcounter.h>
+
+/*
+ * The registry is a singly linked list; it's only walked when
+ * printing or looking up by name, never on the counting path.
+ */
+static struct pcounter *pcounter_list;
+static struct spinlock pcounter_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Add N to the current cpu's slot. Interrupts are turned off for the
+ * update so we can't be preempted (and migrated) between choosing a
+ * slot and writing it; nothing else ever writes this slot, so that's
+ * all it takes.
+ */
+void
+pcounter_add(struct pcounter *pc, uint64_t n)
+{
+	unsigned num;
+	int s;
+
+	s = splhigh();
+	/* Before the first cpu structure exists we're on the boot cpu. */
+	num = CURCPU_EXISTS() ? curcpu->c_number : 0;
+	pc->pc_slots[num].ps_count += n;
+	splx(s);
+}
+
+/*
+ * Read one slot. A 64-bit load is two instructions, so a read racing
+ * with a carry into the high word on another cpu can tear; read until
+ * two loads agree.
+ */
+uint64_t
+pcounter_readcpu(struct pcounter *pc, unsigned cpunum)
+{
+	volatile uint64_t *p;
+	uint64_t a, b;
+
+	KASSERT(cpunum < MAXCPUS);
+	p = &pc->pc_slots[cpunum].ps_count;
+	do {
+		a = *p;
+		b = *p;
+	} while (a != b);
+	return a;
+}
+
+/*
+ * Sum all the slots. This isn't a snapshot: increments on other cpus
+ * during the sum may or may not be included.
+ */
+uint64_t
+pcounter_read(struct pcounter *pc)
+{
+	uint64_t total;
+	unsigned i;
+
+	total = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		total += pcounter_readcpu(pc, i);
+	}
+	return total;
+}
+
+/*
+ * Zero the counter. Increments racing with this on other cpus may
+ * survive it.
+ */
+void
+pcounter_reset(struct pcounter *pc)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		pc->pc_slots[i].ps_count = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Registry
+
+void
+pcounter_register(struct pcounter *pc)
+{
+	KASSERT(pc->pc_name != NULL);
+
+	spinlock_acquire(&pcounter_lock);
+	KASSERT(!pc->pc_registered);
+	pc->pc_next = pcounter_list;
+	pcounter_list = pc;
+	pc->pc_registered = true;
+	spinlock_release(&pcounter_lock);
+}
+
+void
+pcounter_unregister(struct pcounter *pc)
+{
+	struct pcounter **p;
+
+	spinlock_acquire(&pcounter_lock);
+	KASSERT(pc->pc_registered);
+	for (p = &pcounter_list; *p != pc; p = &(*p)->pc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = pc->pc_next;
+	pc->pc_next = NULL;
+	pc->pc_registered = false;
+	spinlock_release(&pcounter_lock);
+}
+
+struct pcounter *
+pcounter_create(const char *name)
+{
+	struct pcounter *pc;
+
+	pc = kmalloc(sizeof(*pc));
+	if (pc == NULL) {
+		return NULL;
+	}
+	bzero(pc, sizeof(*pc));
+	pc->pc_name = name;
+	pcounter_register(pc);
+	return pc;
+}
+
+void
+pcounter_destroy(struct pcounter *pc)
+{
+	pcounter_unregister(pc);
+	kfree(pc);
+}
+
+struct pcounter *
+pcounter_lookup(const char *name)
+{
+	struct pcounter *pc;
+
+	spinlock_acquire(&pcounter_lock);
+	for (pc = pcounter_list; pc != NULL; pc = pc->pc_next) {
+		if (!strcmp(pc->pc_name, name)) {
+			break;
+		}
+	}
+	spinlock_release(&pcounter_lock);
+	return pc;
+}
+
+/*
+ * Print every registered counter with its total and the per-cpu
+ * breakdown. Can't kprintf with a spinlock held, so this relies on
+ * registered counters not being destroyed while it runs.
+ */
+void
+pcounter_printall(void)
+{
+	struct pcounter *pc;
+	uint64_t v;
+	unsigned i;
+
+	spinlock_acquire(&pcounter_lock);
+	pc = pcounter_list;
+	spinlock_release(&pcounter_lock);
+
+	if (pc == NULL) {
+		kprintf("No counters registered\n");
+		return;
+	}
+
+	for (; pc != NULL; pc = pc->pc_next) {
+		kprintf("%-24s %12llu", pc->pc_name,
+			(unsigned long long)pcounter_read(pc));
+		for (i=0; i<MAXCPUS; i++) {
+			v = pcounter_readcpu(pc, i);
+			if (v != 0) {
+				kprintf("  cpu%u:%llu", i,
+					(unsigned long long)v);
+			}
+		}
+		kprintf("\n");
+	}
+}
+
+void
+pcounter_resetall(void)
+{
+	struct pcounter *pc;
+
+	spinlock_acquire(&pcounter_lock);
+	for (pc = pcounter_list; pc != NULL; pc = pc->pc_next) {
+		pcounter_reset(pc);
+	}
+	spinlock_release(&pcounter_lock);
+}
@@ -43,12 +43,18 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <copyinout.h>
+#include <slab.h>
+#include <pagecache.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <lockstat.h>
+#include <futex.h>
+#include <trace.h>
 #include "file.h"
 #include "fdtable.h"
 /* #include <file_table.h> */
@@ -113,6 +119,7 @@ boot(void)
     ram_bootstrap();
     init_kern_file_table();
     proc_bootstrap();
+    futex_bootstrap();
     thread_bootstrap();
     hardclock_bootstrap();
     vfs_bootstrap();
@@ -126,10 +133,22 @@ boot(void)
     /* Now do pseudo-devices. */
     pseudoconfig();
     kprintf("\n");
+#if OPT_LOCKSTAT
+    /* The clock is attached now, so lock timing can start. */
+    lockstat_bootstrap();
+#endif
+#if OPT_TRACE
+    /* Needs the clock, and the cpu count from the device probe. */
+    trace_bootstrap();
+#endif
     kheap_nextgeneration();
 
     /* Late phase of initialization. */
     vm_bootstrap();
+    kheap_bootstrap();
+    kmem_bootstrap();
+    pagecache_bootstrap();
+    copyinout_bootstrap();
     kprintf_bootstrap();
     thread_start_cpus();
 
@@ -43,8 +43,15 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <pcounter.h>
 #include "opt-sfs.h"
+#include "opt-dumbvm.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
+#include <trace.h>
+#if !OPT_DUMBVM
+#include <swap.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -424,6 +431,23 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+#if !OPT_DUMBVM
+/*
+ * Command to attach a swap device. Once attached it stays attached.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapon device:\n");
+		return EINVAL;
+	}
+
+	return swap_on(args[1]);
+}
+#endif
+
 /*
  * Command to set the "boot fs".
  *
@@ -494,6 +518,142 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_printsites(10);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_resetsites();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		kheap_printsites(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: khsites [count | reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_counters(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pcounter_printall();
+
+	return 0;
+}
+
+static
+int
+cmd_countersreset(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pcounter_resetall();
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	unsigned rows = 10;
+
+	if (nargs == 2) {
+		rows = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: lockstat [rows]\n");
+		return EINVAL;
+	}
+
+	lockstat_printstats(rows);
+
+	return 0;
+}
+
+static
+int
+cmd_lockstatreset(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lockstat_reset();
+
+	return 0;
+}
+#endif
+
+#if OPT_TRACE
+static
+int
+cmd_trace(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		trace_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		trace_stop();
+	}
+	else {
+		kprintf("Usage: trace on|off\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_tracedump(int nargs, char **args)
+{
+	unsigned recs = 50;
+
+	if (nargs == 2) {
+		recs = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: tracedump [records]\n");
+		return EINVAL;
+	}
+
+	trace_dump(recs);
+
+	return 0;
+}
+
+static
+int
+cmd_tracesave(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: tracesave file\n");
+		return EINVAL;
+	}
+
+	result = trace_save(args[1]);
+	if (result) {
+		kprintf("tracesave: %s\n", strerror(result));
+		return result;
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -528,6 +688,9 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+#if !OPT_DUMBVM
+	"[swapon]  Attach a swap device      ",
+#endif
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -560,6 +723,8 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Page allocator stress test    ",
+	"[km6] Object cache test             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -599,6 +764,18 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khsites] Busiest kmalloc callers   ",
+	"[ct] Event counters                 ",
+	"[ctreset] Reset event counters      ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+	"[lsreset] Reset lockstat counters   ",
+#endif
+#if OPT_TRACE
+	"[trace] Event tracing on/off        ",
+	"[tracedump] Decode trace buffers    ",
+	"[tracesave] Save trace for host     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -634,6 +811,9 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+#if !OPT_DUMBVM
+	{ "swapon",	cmd_swapon },
+#endif
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -650,6 +830,18 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khsites",    cmd_kheapsites },
+	{ "ct",		cmd_counters },
+	{ "ctreset",	cmd_countersreset },
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+	{ "lsreset",	cmd_lockstatreset },
+#endif
+#if OPT_TRACE
+	{ "trace",	cmd_trace },
+	{ "tracedump",	cmd_tracedump },
+	{ "tracesave",	cmd_tracesave },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -660,6 +852,8 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -0,0 +1,38 @@
+/**
+ * @file:   affinity.c
+ * @brief:  setaffinity/getaffinity syscalls
+ */
+#include <types.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <thread.h>
+
+/*
+ * Processes are single-threaded, so these act on the calling thread.
+ * The mask has one bit per cpu number; bits for cpus that don't exist
+ * are dropped, and getaffinity reports what's left.
+ */
+int syscall_setaffinity(unsigned mask, int *retval)
+{
+    int result = thread_setaffinity((cpumask_t)mask);
+    if (result != 0)
+    {
+        *retval = result;
+        return -1;
+    }
+    *retval = 0;
+    return 0;
+}
+
+int syscall_getaffinity(userptr_t maskp, int *retval)
+{
+    unsigned mask = thread_getaffinity();
+    int result = copyout(&mask, maskp, sizeof(mask));
+    if (result != 0)
+    {
+        *retval = result;
+        return -1;
+    }
+    *retval = 0;
+    return 0;
+}
@@ -332,6 +332,31 @@ int do_sys_read(int fd, char* buf, size_t buf_len)
     return read_len;
 
 }
+/*
+ * for mmap: hand back the vnode behind fd with a reference on it, and
+ * the flags the file was opened with.
+ */
+int do_sys_getvnode(int fd, struct vnode** v, int* flags)
+{
+    struct files_struct* fst = get_current_proc()->fs_struct;
+    if (is_valid_fd(fst, fd) == 0)
+    {
+        return -EBADF;
+    }
+
+    spinlock_acquire(&(fst->file_lock));
+    struct file* f = __fd_check(fst, fd);
+    if (f == NULL)
+    {
+        spinlock_release(&(fst->file_lock));
+        return -EBADF;
+    }
+    VOP_INCREF(f->v_ptr);
+    *v = f->v_ptr;
+    *flags = f->f_flags;
+    spinlock_release(&(fst->file_lock));
+    return 0;
+}
 ssize_t do_sys_write(int fd, const void *buf, size_t buf_len)
 {
 
@@ -443,6 +468,7 @@ int init_fd_table(struct proc* cur)
         return ENOMEM;
     }
     spinlock_init(&(cur->fs_struct->file_lock));
+    spinlock_setclass(&(cur->fs_struct->file_lock), "file_lock");
     cur->fs_struct->fdt = kmalloc(sizeof((*cur->fs_struct->fdt)));
     if (cur->fs_struct->fdt == NULL)
     {
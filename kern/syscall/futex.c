@@ -0,0 +1,272 @@
+/**
+ * @file:   futex.c
+ * @brief:  futex() system call: sleep/wake keyed on a user address
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <syscall.h>
+#include <futex.h>
+#include <pcounter.h>
+
+/*
+ * Userland keeps lock state in an ordinary word of its own memory and
+ * only calls into the kernel to sleep when it finds the lock busy, or
+ * to wake someone when it knows there are sleepers. The kernel side
+ * is a hash table of buckets; each bucket has a spinlock and a short
+ * list of queues, one per address that currently has sleepers. Each
+ * queue owns a wchan, so a wakeup only ever reaches threads waiting
+ * on that exact address.
+ *
+ * Lost wakeups. FUTEX_WAIT has to compare *uaddr against the caller's
+ * expected value, but copyin can fault and sleep, so it can't be done
+ * with the bucket spinlock held. Instead every FUTEX_WAKE bumps the
+ * bucket's sequence number. A waiter samples the sequence number,
+ * reads *uaddr with no lock held, then relocks and sleeps only if the
+ * sequence number hasn't moved. Userland always changes *uaddr before
+ * calling FUTEX_WAKE, so either the waiter sees the new value, or the
+ * wake comes after the waiter's read and either moves the sequence
+ * number or finds the waiter already on the wchan.
+ */
+
+#define FUTEX_BUCKETS	64
+
+struct futex_queue {
+	struct addrspace *fq_as;	/* Key: address space */
+	userptr_t fq_uaddr;		/* Key: user address */
+	struct wchan *fq_wchan;
+	unsigned fq_refs;		/* Threads in futex_wait on this queue */
+	struct futex_queue *fq_next;
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	unsigned fb_seq;		/* Bumped by every wake */
+	struct futex_queue *fb_queues;
+};
+
+static struct futex_bucket futex_table[FUTEX_BUCKETS];
+
+static struct pcounter futex_sleeps = PCOUNTER_INITIALIZER("futex_sleeps");
+static struct pcounter futex_wakes = PCOUNTER_INITIALIZER("futex_wakes");
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, userptr_t uaddr)
+{
+	uint32_t h;
+
+	h = (uint32_t)(uintptr_t)as ^ ((uint32_t)(uintptr_t)uaddr >> 2);
+	/* Fibonacci hashing; spreads nearby addresses across buckets. */
+	h *= 0x9e3779b1;
+	return &futex_table[(h >> 16) % FUTEX_BUCKETS];
+}
+
+/* Call with the bucket lock held. */
+static
+struct futex_queue *
+futex_findqueue(struct futex_bucket *fb, struct addrspace *as,
+		userptr_t uaddr)
+{
+	struct futex_queue *fq;
+
+	for (fq = fb->fb_queues; fq != NULL; fq = fq->fq_next) {
+		if (fq->fq_as == as && fq->fq_uaddr == uaddr) {
+			return fq;
+		}
+	}
+	return NULL;
+}
+
+static
+struct futex_queue *
+futex_queue_create(struct addrspace *as, userptr_t uaddr)
+{
+	struct futex_queue *fq;
+
+	fq = kmalloc(sizeof(*fq));
+	if (fq == NULL) {
+		return NULL;
+	}
+	fq->fq_wchan = wchan_create("futex");
+	if (fq->fq_wchan == NULL) {
+		kfree(fq);
+		return NULL;
+	}
+	fq->fq_as = as;
+	fq->fq_uaddr = uaddr;
+	fq->fq_refs = 0;
+	fq->fq_next = NULL;
+	return fq;
+}
+
+static
+void
+futex_queue_destroy(struct futex_queue *fq)
+{
+	wchan_destroy(fq->fq_wchan);
+	kfree(fq);
+}
+
+/* Call with the bucket lock held. */
+static
+void
+futex_unlinkqueue(struct futex_bucket *fb, struct futex_queue *fq)
+{
+	struct futex_queue **p;
+
+	for (p = &fb->fb_queues; *p != fq; p = &(*p)->fq_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = fq->fq_next;
+}
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_BUCKETS; i++) {
+		spinlock_init(&futex_table[i].fb_lock);
+		futex_table[i].fb_seq = 0;
+		futex_table[i].fb_queues = NULL;
+	}
+	pcounter_register(&futex_sleeps);
+	pcounter_register(&futex_wakes);
+}
+
+int
+futex_wait(struct addrspace *as, userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_queue *fq, *newfq, *deadfq;
+	unsigned seq;
+	int cur, result;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	fb = futex_hash(as, uaddr);
+	newfq = NULL;
+
+	/*
+	 * Find or create the queue and take a reference to it, so it
+	 * can't go away while we're off reading user memory. The queue
+	 * can't be allocated with the spinlock held, so if there isn't
+	 * one, allocate and look again.
+	 */
+	spinlock_acquire(&fb->fb_lock);
+	while ((fq = futex_findqueue(fb, as, uaddr)) == NULL && newfq == NULL) {
+		spinlock_release(&fb->fb_lock);
+		newfq = futex_queue_create(as, uaddr);
+		if (newfq == NULL) {
+			return ENOMEM;
+		}
+		spinlock_acquire(&fb->fb_lock);
+	}
+	if (fq == NULL) {
+		fq = newfq;
+		fq->fq_next = fb->fb_queues;
+		fb->fb_queues = fq;
+		newfq = NULL;
+	}
+	fq->fq_refs++;
+	seq = fb->fb_seq;
+	spinlock_release(&fb->fb_lock);
+
+	if (newfq != NULL) {
+		/* someone else created it first */
+		futex_queue_destroy(newfq);
+	}
+
+	result = copyin(uaddr, &cur, sizeof(cur));
+
+	spinlock_acquire(&fb->fb_lock);
+	if (result == 0) {
+		if (cur != val) {
+			result = EAGAIN;
+		}
+		else if (fb->fb_seq == seq) {
+			pcounter_inc(&futex_sleeps);
+			wchan_sleep(fq->fq_wchan, &fb->fb_lock);
+		}
+		/* else a wake raced with the read; treat it as ours */
+	}
+	deadfq = NULL;
+	KASSERT(fq->fq_refs > 0);
+	fq->fq_refs--;
+	if (fq->fq_refs == 0) {
+		futex_unlinkqueue(fb, fq);
+		deadfq = fq;
+	}
+	spinlock_release(&fb->fb_lock);
+
+	if (deadfq != NULL) {
+		futex_queue_destroy(deadfq);
+	}
+	return result;
+}
+
+int
+futex_wake(struct addrspace *as, userptr_t uaddr, int count, int *woken)
+{
+	struct futex_bucket *fb;
+	struct futex_queue *fq;
+	int n;
+
+	if ((uintptr_t)uaddr % sizeof(int) != 0 || count < 0) {
+		return EINVAL;
+	}
+
+	fb = futex_hash(as, uaddr);
+	n = 0;
+
+	spinlock_acquire(&fb->fb_lock);
+	fb->fb_seq++;
+	fq = futex_findqueue(fb, as, uaddr);
+	if (fq != NULL) {
+		while (n < count && !wchan_isempty(fq->fq_wchan, &fb->fb_lock)) {
+			wchan_wakeone(fq->fq_wchan, &fb->fb_lock);
+			n++;
+		}
+	}
+	spinlock_release(&fb->fb_lock);
+
+	pcounter_add(&futex_wakes, n);
+	*woken = n;
+	return 0;
+}
+
+int syscall_futex(userptr_t uaddr, int op, int val, int *retval)
+{
+    struct addrspace *as = proc_getas();
+    int result = 0;
+
+    *retval = 0;
+    switch (op)
+    {
+        case FUTEX_WAIT:
+        result = futex_wait(as, uaddr, val);
+        break;
+        case FUTEX_WAKE:
+        result = futex_wake(as, uaddr, val, retval);
+        break;
+        default:
+        result = EINVAL;
+        break;
+    }
+    if (result != 0)
+    {
+        *retval = result;
+        return -1;
+    }
+    return 0;
+}
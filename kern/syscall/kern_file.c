@@ -29,12 +29,46 @@
 #include "mips/atomic.h"
 #include "list.h"
 #include "debug_print.h"
+#include <slab.h>
 
 static struct files_table g_ftb;
 
+/*
+ * struct file comes from an object cache, which keeps each file's
+ * lock around between uses instead of creating it on every open.
+ */
+static struct kmem_cache* file_cache;
+
+static int file_ctor(void* obj)
+{
+    struct file* node = obj;
+
+    node->file_op_lock = lock_create(" a file lock");
+    if (node->file_op_lock == NULL)
+    {
+        return ENOMEM;
+    }
+    lock_setclass(node->file_op_lock, "file_op_lock");
+    return 0;
+}
+
+static void file_dtor(void* obj)
+{
+    struct file* node = obj;
+
+    lock_destroy(node->file_op_lock);
+}
+
 void init_kern_file_table(void)
 {
+    file_cache = kmem_cache_create("file", sizeof(struct file), 0,
+                                   file_ctor, file_dtor);
+    if (file_cache == NULL)
+    {
+        panic("init kern file cache error");
+    }
     spinlock_init(&(g_ftb.files_table_lock));
+    spinlock_setclass(&(g_ftb.files_table_lock), "files_table_lock");
     g_ftb.list_obj = init_list(offsetof(struct file, link_obj));
     if (g_ftb.list_obj == NULL)
     {
@@ -48,6 +82,8 @@ void destroy_kern_file_table(void)
     KASSERT(is_list_empty(g_ftb.list_obj) == 1);
     destroy_list(g_ftb.list_obj);
     spinlock_cleanup(&(g_ftb.files_table_lock) );
+    kmem_cache_destroy(file_cache);
+    file_cache = NULL;
     return;
 }
 
@@ -83,7 +119,9 @@ static void __destroy_kern_file(struct file* fs)
         vfs_close(fs->v_ptr);
         fs->v_ptr = NULL;
     }
-    kfree (fs);
+    /* file_op_lock stays constructed for the next user */
+    KASSERT(!lock_do_i_hold(fs->file_op_lock));
+    kmem_cache_free(file_cache, fs);
 
     return;
 }
@@ -136,17 +174,12 @@ static int __init_kern_file(struct file** retval, struct vnode* v, struct fs* f,
 {
 
     (void)f;
-    struct file *node = kmalloc(sizeof(struct file));
+    struct file *node = kmem_cache_alloc(file_cache);
     if (node == NULL)
     {
         return -ENOMEM;
     }
-    node->file_op_lock =lock_create(" a file lock");
-    if ( node->file_op_lock == NULL)
-    {
-        kfree(node);
-        return -ENOMEM;
-    }
+    KASSERT(node->file_op_lock != NULL);
     (void) mode;
     KASSERT(node != NULL);
     link_init(&node->link_obj);
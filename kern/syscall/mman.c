@@ -0,0 +1,142 @@
+/**
+ * @file:   mman.c
+ * @brief:  mmap/munmap/msync syscalls
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <syscall.h>
+#include "fdtable.h"
+
+/*
+ * The work is done by as_mmap and friends in vm/addrspace.c; this is
+ * just checking the arguments, and the file's open mode against the
+ * protection asked for. MIPS can't map a page write-only or
+ * unreadable, so PROT_WRITE is the only protection bit that counts.
+ */
+int syscall_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+                 off_t offset, int *retval)
+{
+    struct addrspace* as = proc_getas();
+    struct vnode* v = NULL;
+    vaddr_t va = 0;
+    int perms = 0;
+    int rgflags = 0;
+    int openflags = 0;
+    int result = 0;
+
+    int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (len == 0 || (type != MAP_SHARED && type != MAP_PRIVATE)
+        || (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) != 0
+        || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+    {
+        *retval = EINVAL;
+        return -1;
+    }
+    if (flags & MAP_FIXED)
+    {
+        va = (vaddr_t)addr;
+        if (va == 0 || va % PAGE_SIZE != 0)
+        {
+            *retval = EINVAL;
+            return -1;
+        }
+    }
+
+    perms = RG_READ;
+    if (prot & PROT_WRITE)
+    {
+        perms |= RG_WRITE;
+    }
+    if (prot & PROT_EXEC)
+    {
+        perms |= RG_EXEC;
+    }
+    if (type == MAP_SHARED)
+    {
+        rgflags = RGF_SHARED;
+    }
+
+    if ((flags & MAP_ANON) == 0)
+    {
+        if (offset < 0 || offset % PAGE_SIZE != 0)
+        {
+            *retval = EINVAL;
+            return -1;
+        }
+        result = do_sys_getvnode(fd, &v, &openflags);
+        if (result < 0)
+        {
+            *retval = -result;
+            return -1;
+        }
+        result = VOP_MMAP(v);
+        if (result == 0 && (openflags & O_ACCMODE) == O_WRONLY)
+        {
+            result = EACCES;
+        }
+        if (result == 0 && type == MAP_SHARED && (prot & PROT_WRITE)
+            && (openflags & O_ACCMODE) != O_RDWR)
+        {
+            result = EACCES;
+        }
+        if (result != 0)
+        {
+            VOP_DECREF(v);
+            *retval = result;
+            return -1;
+        }
+    }
+    else
+    {
+        offset = 0;
+    }
+
+    result = as_mmap(as, &va, len, perms, rgflags, v, offset);
+    if (v != NULL)
+    {
+        VOP_DECREF(v);
+    }
+    if (result != 0)
+    {
+        *retval = result;
+        return -1;
+    }
+    *retval = (int)va;
+    return 0;
+}
+
+int syscall_munmap(userptr_t addr, size_t len, int *retval)
+{
+    int result = as_munmap(proc_getas(), (vaddr_t)addr, len);
+    if (result != 0)
+    {
+        *retval = result;
+        return -1;
+    }
+    *retval = 0;
+    return 0;
+}
+
+int syscall_msync(userptr_t addr, size_t len, int flags, int *retval)
+{
+    if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0
+        || (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC))
+    {
+        *retval = EINVAL;
+        return -1;
+    }
+    int result = as_msync(proc_getas(), (vaddr_t)addr, len);
+    if (result != 0)
+    {
+        *retval = result;
+        return -1;
+    }
+    *retval = 0;
+    return 0;
+}
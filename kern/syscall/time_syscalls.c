@@ -39,20 +39,25 @@ int
 sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 {
 	struct timespec ts;
-	int result;
+	struct copyoutvec vec[2];
 
 	gettime(&ts);
 
-	result = copyout(&ts.tv_sec, user_seconds_ptr, sizeof(ts.tv_sec));
-	if (result) {
-		return result;
-	}
+	vec[0].co_src = &ts.tv_sec;
+	vec[0].co_userdest = user_seconds_ptr;
+	vec[0].co_len = sizeof(ts.tv_sec);
+	vec[1].co_src = &ts.tv_nsec;
+	vec[1].co_userdest = user_nanoseconds_ptr;
+	vec[1].co_len = sizeof(ts.tv_nsec);
 
-	result = copyout(&ts.tv_nsec, user_nanoseconds_ptr,
-			 sizeof(ts.tv_nsec));
-	if (result) {
-		return result;
+	/* time() passes NULL for the nanoseconds; skip null pointers. */
+	if (user_seconds_ptr == NULL) {
+		vec[0].co_len = 0;
+	}
+	if (user_nanoseconds_ptr == NULL) {
+		vec[1].co_len = 0;
 	}
 
-	return 0;
+	/* Both halves in one trip across the user/kernel boundary. */
+	return copyoutv(vec, 2);
 }
@@ -33,13 +33,16 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <clock.h>
+#include <coremap.h>
+#include <slab.h>
+#include <pcounter.h>
 #include <test.h>
 
-#include "opt-dumbvm.h"
-
 ////////////////////////////////////////////////////////////
 // km1/km2
 
@@ -168,13 +171,25 @@ kmallocstress(int nargs, char **args)
  *
  * Having set this up, the test just allocates and then frees all the
  * pointers in order, setting and checking the contents.
+ *
+ * An optional second argument runs that many copies at once, each in
+ * its own thread with its own objects, to see how kmalloc holds up
+ * with every cpu using it. Either way the test reports how many
+ * kmalloc/kfree pairs it managed per second, and how many of the
+ * kmallocs were served from the per-cpu magazines.
  */
-int
-kmalloctest3(int nargs, char **args)
+
+static unsigned km3_numptrs;
+static struct timespec km3_start;
+static uint64_t km3_maxns;
+static struct spinlock km3_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+kmalloctest3_run(unsigned numptrs, bool verbose)
 {
 #define NUM_KM3_SIZES 5
 	static const unsigned sizes[NUM_KM3_SIZES] = { 32, 41, 109, 86, 9 };
-	unsigned numptrs;
 	size_t ptrspace;
 	size_t blocksize;
 	unsigned numptrblocks;
@@ -184,21 +199,17 @@ kmalloctest3(int nargs, char **args)
 	unsigned i, j;
 	unsigned char *ptr;
 
-	if (nargs != 2) {
-		kprintf("kmalloctest3: usage: km3 numobjects\n");
-		return EINVAL;
-	}
-
 	/* Figure out how many pointers we'll get and the space they need. */
-	numptrs = atoi(args[1]);
 	ptrspace = numptrs * sizeof(void *);
 
 	/* Figure out how many blocks in the lower tier. */
 	blocksize = PAGE_SIZE / 4;
 	numptrblocks = DIVROUNDUP(ptrspace, blocksize);
 
-	kprintf("kmalloctest3: %u objects, %u pointer blocks\n",
-		numptrs, numptrblocks);
+	if (verbose) {
+		kprintf("kmalloctest3: %u objects, %u pointer blocks\n",
+			numptrs, numptrblocks);
+	}
 
 	/* Allocate the upper tier. */
 	ptrblocks = kmalloc(numptrblocks * sizeof(ptrblocks[0]));
@@ -245,7 +256,9 @@ kmalloctest3(int nargs, char **args)
 		cursizeindex = (cursizeindex + 1) % NUM_KM3_SIZES;
 	}
 
-	kprintf("kmalloctest3: %zu bytes allocated\n", totalsize);
+	if (verbose) {
+		kprintf("kmalloctest3: %zu bytes allocated\n", totalsize);
+	}
 
 	/* Free the objects. */
 	curblock = 0;
@@ -287,6 +300,118 @@ kmalloctest3(int nargs, char **args)
 	}
 	/* Free the upper tier. */
 	kfree(ptrblocks);
+}
+
+static
+uint64_t
+km3_counter(const char *name)
+{
+	struct pcounter *pc;
+
+	pc = pcounter_lookup(name);
+	return pc == NULL ? 0 : pcounter_read(pc);
+}
+
+static
+void
+kmalloctest3thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	struct timespec now, diff;
+	uint64_t ns;
+
+	(void)num;
+
+	kmalloctest3_run(km3_numptrs, false);
+
+	/* The slowest thread's time is the test's time. */
+	gettime(&now);
+	timespec_sub(&now, &km3_start, &diff);
+	ns = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	spinlock_acquire(&km3_lock);
+	if (ns > km3_maxns) {
+		km3_maxns = ns;
+	}
+	spinlock_release(&km3_lock);
+	V(sem);
+}
+
+int
+kmalloctest3(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec now, diff;
+	unsigned numptrs, nthreads, i;
+	uint64_t ns, pairs, hits, misses;
+	int result;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("kmalloctest3: usage: km3 numobjects [nthreads]\n");
+		return EINVAL;
+	}
+
+	numptrs = atoi(args[1]);
+	nthreads = nargs == 3 ? atoi(args[2]) : 1;
+	if (nthreads == 0) {
+		kprintf("kmalloctest3: need at least one thread\n");
+		return EINVAL;
+	}
+
+	hits = km3_counter("kmalloc_maghits");
+	misses = km3_counter("kmalloc_magmisses");
+
+	if (nthreads == 1) {
+		gettime(&km3_start);
+		kmalloctest3_run(numptrs, true);
+		gettime(&now);
+		timespec_sub(&now, &km3_start, &diff);
+		ns = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	}
+	else {
+		kprintf("kmalloctest3: %u threads, %u objects each\n",
+			nthreads, numptrs);
+
+		sem = sem_create("kmalloctest3", 0);
+		if (sem == NULL) {
+			panic("kmalloctest3: sem_create failed\n");
+		}
+		km3_numptrs = numptrs;
+		km3_maxns = 0;
+		gettime(&km3_start);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("kmalloctest3", NULL,
+					     kmalloctest3thread, sem, i);
+			if (result) {
+				panic("kmalloctest3: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(sem);
+		}
+		sem_destroy(sem);
+		ns = km3_maxns;
+	}
+
+	hits = km3_counter("kmalloc_maghits") - hits;
+	misses = km3_counter("kmalloc_magmisses") - misses;
+
+	/* Each object, plus the pointer blocks, which we don't count. */
+	pairs = (uint64_t)numptrs * nthreads;
+	kprintf("kmalloctest3: %llu kmalloc/kfree pairs in %llu.%03llu ms",
+		(unsigned long long)pairs,
+		(unsigned long long)(ns / 1000000),
+		(unsigned long long)(ns / 1000 % 1000));
+	if (ns > 0) {
+		kprintf(", %llu per second",
+			(unsigned long long)(pairs * 1000000000 / ns));
+	}
+	kprintf("\n");
+	if (hits + misses > 0) {
+		kprintf("kmalloctest3: %llu%% of subpage kmallocs from "
+			"magazines\n",
+			(unsigned long long)(hits * 100 / (hits + misses)));
+	}
 
 	kprintf("kmalloctest3: passed\n");
 	return 0;
@@ -349,9 +474,6 @@ kmalloctest4(int nargs, char **args)
 	(void)args;
 
 	kprintf("Starting multipage kmalloc test...\n");
-#if OPT_DUMBVM
-	kprintf("(This test will not work with dumbvm)\n");
-#endif
 
 	sem = sem_create("kmalloctest4", 0);
 	if (sem == NULL) {
@@ -378,3 +500,348 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Page allocator stress test. Each thread keeps KM5_WINDOW runs of
+ * 1 to KM5_MAXPAGES pages, and on each step frees a random one and
+ * allocates a new run of random size in its place, timing every
+ * alloc_kpages and free_kpages call. Each run's first word holds a tag
+ * that's checked when it's freed.
+ *
+ * When all the threads are done, with their last windows still
+ * allocated, we print how free memory is broken up: the free blocks
+ * at each order and how much of the free memory is in the largest
+ * block. Then everything is freed and we check that the free page
+ * count is back where it started.
+ */
+
+#define KM5_WINDOW	16
+#define KM5_MAXPAGES	16
+
+struct km5stats {
+	unsigned allocs;
+	unsigned failures;
+	uint64_t allocns, allocmax;
+	uint64_t freens, freemax;
+};
+
+static vaddr_t km5runs[NTHREADS][KM5_WINDOW];
+static struct km5stats km5stats[NTHREADS];
+
+static
+uint64_t
+km5_elapsed(const struct timespec *before)
+{
+	struct timespec after, diff;
+
+	gettime(&after);
+	timespec_sub(&after, before, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
+static
+void
+km5_free(vaddr_t va, uint32_t tag, struct km5stats *ks)
+{
+	struct timespec before;
+	uint64_t ns;
+
+	if (*(uint32_t *)va != tag) {
+		panic("kmalloctest5: run at 0x%x has tag 0x%x, expected 0x%x\n",
+		      va, *(uint32_t *)va, tag);
+	}
+	gettime(&before);
+	free_kpages(va);
+	ns = km5_elapsed(&before);
+	ks->freens += ns;
+	if (ns > ks->freemax) {
+		ks->freemax = ns;
+	}
+}
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	struct km5stats *ks = &km5stats[num];
+	vaddr_t *runs = km5runs[num];
+	struct timespec before;
+	unsigned i, slot, npages;
+	uint64_t ns;
+
+	bzero(ks, sizeof(*ks));
+	for (i=0; i<KM5_WINDOW; i++) {
+		runs[i] = 0;
+	}
+
+	for (i=0; i<NTRIES; i++) {
+		slot = random() % KM5_WINDOW;
+		if (runs[slot] != 0) {
+			km5_free(runs[slot], num << 16 | slot, ks);
+			runs[slot] = 0;
+		}
+
+		npages = 1 + random() % KM5_MAXPAGES;
+		gettime(&before);
+		runs[slot] = alloc_kpages(npages);
+		ns = km5_elapsed(&before);
+		if (runs[slot] == 0) {
+			ks->failures++;
+			continue;
+		}
+		ks->allocs++;
+		ks->allocns += ns;
+		if (ns > ks->allocmax) {
+			ks->allocmax = ns;
+		}
+		*(uint32_t *)runs[slot] = num << 16 | slot;
+	}
+
+	V(sem);
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct coremap_stats before, during, after;
+	struct km5stats total;
+	unsigned i, j;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator stress test...\n");
+
+	sem = sem_create("kmalloctest5", 0);
+	if (sem == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	coremap_getstats(&before);
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("kmalloctest5", NULL,
+				     kmalloctest5thread, sem, i);
+		if (result) {
+			panic("kmalloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	sem_destroy(sem);
+
+	coremap_getstats(&during);
+
+	bzero(&total, sizeof(total));
+	for (i=0; i<NTHREADS; i++) {
+		total.allocs += km5stats[i].allocs;
+		total.failures += km5stats[i].failures;
+		total.allocns += km5stats[i].allocns;
+		total.freens += km5stats[i].freens;
+		if (km5stats[i].allocmax > total.allocmax) {
+			total.allocmax = km5stats[i].allocmax;
+		}
+		if (km5stats[i].freemax > total.freemax) {
+			total.freemax = km5stats[i].freemax;
+		}
+		for (j=0; j<KM5_WINDOW; j++) {
+			if (km5runs[i][j] != 0) {
+				km5_free(km5runs[i][j], i << 16 | j, &total);
+				km5runs[i][j] = 0;
+			}
+		}
+	}
+
+	coremap_getstats(&after);
+
+	kprintf("kmalloctest5: %u allocations, %u failed\n",
+		total.allocs, total.failures);
+	if (total.allocs > 0) {
+		kprintf("kmalloctest5: alloc_kpages avg %llu ns, max %llu ns\n",
+			(unsigned long long)(total.allocns / total.allocs),
+			(unsigned long long)total.allocmax);
+		kprintf("kmalloctest5: free_kpages avg %llu ns, max %llu ns\n",
+			(unsigned long long)(total.freens / total.allocs),
+			(unsigned long long)total.freemax);
+	}
+	kprintf("kmalloctest5: with windows held: %u pages free, "
+		"largest block %u (%u%%)\n", during.cs_free,
+		during.cs_largestrun, during.cs_free == 0 ? 0 :
+		during.cs_largestrun * 100 / during.cs_free);
+	kprintf("kmalloctest5: free blocks by order:");
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		kprintf(" %u", during.cs_nblocks[i]);
+	}
+	kprintf("\n");
+	kprintf("kmalloctest5: after: %u pages free (%u before), "
+		"largest block %u\n", after.cs_free, before.cs_free,
+		after.cs_largestrun);
+
+	/* Other threads may be allocating too, so this is only a hint. */
+	if (after.cs_free < before.cs_free) {
+		kprintf("kmalloctest5: warning: %u fewer pages free\n",
+			before.cs_free - after.cs_free);
+	}
+
+	kprintf("Page allocator stress test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Object cache test. The constructor stamps each object and marks it
+ * unowned; each thread allocates KM6_NOBJS objects, checks that they
+ * come out constructed, claims and scribbles on them, checks them
+ * again, puts them back the way the constructor left them, and frees
+ * them. Then the cache is shrunk and destroyed, at which point every
+ * object constructed must have been destroyed.
+ */
+
+#define KM6_NOBJS	300
+#define KM6_MAGIC	0x6b6d3600
+#define KM6_NOOWNER	0xffffffffUL
+
+struct km6obj {
+	uint32_t magic;
+	unsigned long owner;
+	unsigned char payload[49];	/* Not a kmalloc size */
+};
+
+static struct kmem_cache *km6_cache;
+static unsigned km6_ctors, km6_dtors;
+static struct spinlock km6_lock = SPINLOCK_INITIALIZER;
+
+static
+int
+km6_ctor(void *obj)
+{
+	struct km6obj *ko = obj;
+
+	ko->magic = KM6_MAGIC;
+	ko->owner = KM6_NOOWNER;
+	spinlock_acquire(&km6_lock);
+	km6_ctors++;
+	spinlock_release(&km6_lock);
+	return 0;
+}
+
+static
+void
+km6_dtor(void *obj)
+{
+	struct km6obj *ko = obj;
+
+	KASSERT(ko->magic == KM6_MAGIC);
+	KASSERT(ko->owner == KM6_NOOWNER);
+	ko->magic = 0;
+	spinlock_acquire(&km6_lock);
+	km6_dtors++;
+	spinlock_release(&km6_lock);
+}
+
+static
+void
+kmalloctest6thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	struct km6obj **objs;
+	unsigned i, j;
+
+	objs = kmalloc(KM6_NOBJS * sizeof(objs[0]));
+	if (objs == NULL) {
+		panic("kmalloctest6: thread %lu: no memory\n", num);
+	}
+	for (i=0; i<KM6_NOBJS; i++) {
+		objs[i] = kmem_cache_alloc(km6_cache);
+		if (objs[i] == NULL) {
+			panic("kmalloctest6: thread %lu: "
+			      "kmem_cache_alloc failed\n", num);
+		}
+		if (objs[i]->magic != KM6_MAGIC ||
+		    objs[i]->owner != KM6_NOOWNER) {
+			panic("kmalloctest6: object %p not constructed\n",
+			      objs[i]);
+		}
+		objs[i]->owner = num;
+		for (j=0; j<sizeof(objs[i]->payload); j++) {
+			objs[i]->payload[j] = (unsigned char)(num + i);
+		}
+	}
+	for (i=0; i<KM6_NOBJS; i++) {
+		KASSERT(objs[i]->magic == KM6_MAGIC);
+		if (objs[i]->owner != num) {
+			panic("kmalloctest6: object %p claimed twice\n",
+			      objs[i]);
+		}
+		for (j=0; j<sizeof(objs[i]->payload); j++) {
+			KASSERT(objs[i]->payload[j] ==
+				(unsigned char)(num + i));
+		}
+		objs[i]->owner = KM6_NOOWNER;
+		kmem_cache_free(km6_cache, objs[i]);
+	}
+	kfree(objs);
+	V(sem);
+}
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned i, pages;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	km6_ctors = km6_dtors = 0;
+	km6_cache = kmem_cache_create("km6", sizeof(struct km6obj), 0,
+				      km6_ctor, km6_dtor);
+	if (km6_cache == NULL) {
+		panic("kmalloctest6: kmem_cache_create failed\n");
+	}
+	sem = sem_create("kmalloctest6", 0);
+	if (sem == NULL) {
+		panic("kmalloctest6: sem_create failed\n");
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("kmalloctest6", NULL,
+				     kmalloctest6thread, sem, i);
+		if (result) {
+			panic("kmalloctest6: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	sem_destroy(sem);
+
+	kmem_cache_printstats();
+	pages = kmem_cache_shrink(km6_cache);
+	kprintf("kmalloctest6: shrinking freed %u pages\n", pages);
+	kmem_cache_destroy(km6_cache);
+	km6_cache = NULL;
+
+	kprintf("kmalloctest6: %u objects constructed, %u destroyed\n",
+		km6_ctors, km6_dtors);
+	if (km6_ctors != km6_dtors) {
+		panic("kmalloctest6: constructors and destructors "
+		      "don't match\n");
+	}
+	kprintf("Object cache test done\n");
+	return 0;
+}
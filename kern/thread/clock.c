@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <pcounter.h>
 
 /*
  * Time handling.
@@ -59,6 +60,8 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+static struct pcounter hardclock_count = PCOUNTER_INITIALIZER("hardclocks");
+
 /*
  * Setup.
  */
@@ -70,6 +73,7 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	pcounter_register(&hardclock_count);
 }
 
 /*
@@ -96,6 +100,7 @@ hardclock(void)
 	 * Collect statistics here as desired.
 	 */
 
+	pcounter_inc(&hardclock_count);
 	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
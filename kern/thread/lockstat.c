@@ -0,0 +1,324 @@
+/**
+ * @file:   lockstat.c
+ * @brief:  lock contention profiler, keyed by lock class
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <membar.h>
+#include <spinlock.h>
+#include <current.h>
+#include <lockstat.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Statistics are kept per cpu so that recording never takes a lock
+ * and never bounces a cache line between processors. Each hook runs
+ * with interrupts off (inside spinlock_acquire/release, or while a
+ * sleep lock's internal spinlock is held) so curcpu's slot cannot be
+ * touched by anyone else while it's being updated. The slots are only
+ * summed when the table is printed.
+ */
+struct lockstat_cpu {
+	unsigned lc_acquires;		/* Number of acquisitions */
+	unsigned lc_contended;		/* ...that had to wait */
+	uint64_t lc_waittotal;		/* Nanoseconds spent waiting */
+	uint64_t lc_waitmax;
+	uint64_t lc_holdtotal;		/* Nanoseconds spent holding */
+	uint64_t lc_holdmax;
+};
+
+struct lockstat_class {
+	const char *lc_name;
+	struct lockstat_class *lc_next;
+	struct lockstat_cpu lc_cpu[MAXCPUS];
+};
+
+/*
+ * Classes are never destroyed, and are only ever pushed on the front
+ * of the list, so the list can be walked without the lock once the
+ * head has been read.
+ */
+static struct lockstat_class *lockstat_classes;
+static unsigned lockstat_numclasses;
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Timing needs the realtime clock, which isn't attached until the
+ * device probe. Until lockstat_bootstrap runs nothing is recorded.
+ */
+static volatile bool lockstat_enabled;
+
+static
+uint64_t
+lockstat_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+struct lockstat_class *
+lockstat_findclass(const char *name)
+{
+	struct lockstat_class *lc;
+
+	for (lc = lockstat_classes; lc != NULL; lc = lc->lc_next) {
+		if (!strcmp(lc->lc_name, name)) {
+			return lc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Look up a class by name, creating it if needed. Can't call kmalloc
+ * while holding lockstat_lock, so allocate first and recheck.
+ */
+static
+struct lockstat_class *
+lockstat_getclass(const char *name)
+{
+	struct lockstat_class *lc, *newlc;
+
+	spinlock_acquire(&lockstat_lock);
+	lc = lockstat_findclass(name);
+	spinlock_release(&lockstat_lock);
+	if (lc != NULL) {
+		return lc;
+	}
+
+	newlc = kmalloc(sizeof(*newlc));
+	if (newlc == NULL) {
+		return NULL;
+	}
+	bzero(newlc, sizeof(*newlc));
+	newlc->lc_name = kstrdup(name);
+	if (newlc->lc_name == NULL) {
+		kfree(newlc);
+		return NULL;
+	}
+
+	spinlock_acquire(&lockstat_lock);
+	lc = lockstat_findclass(name);
+	if (lc == NULL) {
+		newlc->lc_next = lockstat_classes;
+		membar_store_store();
+		lockstat_classes = newlc;
+		lockstat_numclasses++;
+		lc = newlc;
+		newlc = NULL;
+	}
+	spinlock_release(&lockstat_lock);
+
+	if (newlc != NULL) {
+		kfree((char *)newlc->lc_name);
+		kfree(newlc);
+	}
+	return lc;
+}
+
+/*
+ * Called from boot() once the clock exists.
+ */
+void
+lockstat_bootstrap(void)
+{
+	lockstat_enabled = true;
+}
+
+/*
+ * Attach a lock to a class. If we run out of memory the lock just
+ * doesn't get profiled.
+ */
+void
+lockstat_setclass(struct lockstat_lockable *l, const char *name)
+{
+	l->ls_class = lockstat_getclass(name);
+	l->ls_acquired = 0;
+}
+
+/*
+ * The caller found the lock busy. Only the first call per
+ * acquisition counts.
+ */
+void
+lockstat_contended(struct lockstat_waiter *w)
+{
+	if (!lockstat_enabled || w->w_start != 0) {
+		return;
+	}
+	w->w_start = lockstat_now();
+}
+
+void
+lockstat_acquire(struct lockstat_waiter *w, struct lockstat_lockable *l)
+{
+	struct lockstat_cpu *lc;
+	uint64_t now, waited;
+
+	if (!lockstat_enabled || !CURCPU_EXISTS()) {
+		l->ls_acquired = 0;
+		return;
+	}
+
+	now = lockstat_now();
+	lc = &l->ls_class->lc_cpu[curcpu->c_number];
+	lc->lc_acquires++;
+	if (w->w_start != 0) {
+		waited = now - w->w_start;
+		lc->lc_contended++;
+		lc->lc_waittotal += waited;
+		if (waited > lc->lc_waitmax) {
+			lc->lc_waitmax = waited;
+		}
+	}
+	l->ls_acquired = now;
+}
+
+void
+lockstat_release(struct lockstat_lockable *l)
+{
+	struct lockstat_cpu *lc;
+	uint64_t held;
+
+	if (l->ls_acquired == 0 || !CURCPU_EXISTS()) {
+		/* acquired before profiling was turned on */
+		return;
+	}
+
+	held = lockstat_now() - l->ls_acquired;
+	l->ls_acquired = 0;
+
+	lc = &l->ls_class->lc_cpu[curcpu->c_number];
+	lc->lc_holdtotal += held;
+	if (held > lc->lc_holdmax) {
+		lc->lc_holdmax = held;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reporting
+
+/*
+ * Per-class totals, summed over cpus. The sum isn't atomic with
+ * respect to ongoing updates, but each field is only ever increased
+ * so the worst that happens is a slightly stale row.
+ */
+struct lockstat_row {
+	const char *r_name;
+	struct lockstat_cpu r_sum;
+};
+
+static
+void
+lockstat_sum(struct lockstat_class *lc, struct lockstat_row *r)
+{
+	struct lockstat_cpu *c;
+	unsigned i;
+
+	r->r_name = lc->lc_name;
+	bzero(&r->r_sum, sizeof(r->r_sum));
+	for (i=0; i<MAXCPUS; i++) {
+		c = &lc->lc_cpu[i];
+		r->r_sum.lc_acquires += c->lc_acquires;
+		r->r_sum.lc_contended += c->lc_contended;
+		r->r_sum.lc_waittotal += c->lc_waittotal;
+		r->r_sum.lc_holdtotal += c->lc_holdtotal;
+		if (c->lc_waitmax > r->r_sum.lc_waitmax) {
+			r->r_sum.lc_waitmax = c->lc_waitmax;
+		}
+		if (c->lc_holdmax > r->r_sum.lc_holdmax) {
+			r->r_sum.lc_holdmax = c->lc_holdmax;
+		}
+	}
+}
+
+/*
+ * Print the MAXROWS classes with the most total wait time. (Sorting
+ * by wait time rather than contention count keeps a lock that's
+ * contended rarely but for a long time near the top.)
+ */
+void
+lockstat_printstats(unsigned maxrows)
+{
+	struct lockstat_class *lc;
+	struct lockstat_row *rows, tmp;
+	unsigned num, i, j;
+
+	spinlock_acquire(&lockstat_lock);
+	num = lockstat_numclasses;
+	lc = lockstat_classes;
+	spinlock_release(&lockstat_lock);
+
+	if (num == 0) {
+		kprintf("lockstat: no lock classes registered\n");
+		return;
+	}
+
+	rows = kmalloc(num * sizeof(*rows));
+	if (rows == NULL) {
+		kprintf("lockstat: out of memory\n");
+		return;
+	}
+
+	for (i=0; i<num && lc != NULL; i++, lc = lc->lc_next) {
+		lockstat_sum(lc, &rows[i]);
+	}
+	num = i;
+
+	/* Insertion sort; there are only a handful of classes. */
+	for (i=1; i<num; i++) {
+		tmp = rows[i];
+		for (j=i; j>0 && rows[j-1].r_sum.lc_waittotal <
+			     tmp.r_sum.lc_waittotal; j--) {
+			rows[j] = rows[j-1];
+		}
+		rows[j] = tmp;
+	}
+
+	if (maxrows > num) {
+		maxrows = num;
+	}
+
+	kprintf("lockstat: top %u of %u lock classes by wait time "
+		"(times in ns)\n", maxrows, num);
+	kprintf("%-20s %8s %8s %12s %10s %12s %10s\n", "class",
+		"acq", "contend", "wait-total", "wait-max",
+		"hold-total", "hold-max");
+	for (i=0; i<maxrows; i++) {
+		kprintf("%-20s %8u %8u %12llu %10llu %12llu %10llu\n",
+			rows[i].r_name,
+			rows[i].r_sum.lc_acquires,
+			rows[i].r_sum.lc_contended,
+			(unsigned long long)rows[i].r_sum.lc_waittotal,
+			(unsigned long long)rows[i].r_sum.lc_waitmax,
+			(unsigned long long)rows[i].r_sum.lc_holdtotal,
+			(unsigned long long)rows[i].r_sum.lc_holdmax);
+	}
+
+	kfree(rows);
+}
+
+/*
+ * Zero all the counters, for A/B comparisons. Updates racing with
+ * this on other cpus may survive it; run it on an idle system.
+ */
+void
+lockstat_reset(void)
+{
+	struct lockstat_class *lc;
+
+	spinlock_acquire(&lockstat_lock);
+	lc = lockstat_classes;
+	spinlock_release(&lockstat_lock);
+
+	for (; lc != NULL; lc = lc->lc_next) {
+		bzero(lc->lc_cpu, sizeof(lc->lc_cpu));
+	}
+}
@@ -53,6 +53,7 @@ spinlock_init(struct spinlock *splk)
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+	LOCKSTAT_LOCKABLEINIT(&splk->splk_lockstat);
 }
 
 /*
@@ -76,8 +77,10 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	LOCKSTAT_WAITER(lsw);
 
 	splraise(IPL_NONE, IPL_HIGH);
+	LOCKSTAT_WAIT(&lsw);
 
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
@@ -105,9 +108,11 @@ spinlock_acquire(struct spinlock *splk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
+			LOCKSTAT_CONTENDED(&lsw, &splk->splk_lockstat);
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+			LOCKSTAT_CONTENDED(&lsw, &splk->splk_lockstat);
 			continue;
 		}
 		break;
@@ -119,6 +124,7 @@ spinlock_acquire(struct spinlock *splk)
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
+	LOCKSTAT_ACQUIRE(&lsw, &splk->splk_lockstat);
 }
 
 /*
@@ -134,6 +140,7 @@ spinlock_release(struct spinlock *splk)
 		curcpu->c_spinlocks--;
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
+	LOCKSTAT_RELEASE(&splk->splk_lockstat);
 
 	splk->splk_holder = NULL;
 	membar_any_store();
@@ -154,3 +161,12 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Give the lock a class name for the contention profiler.
+ */
+void
+spinlock_setclass(struct spinlock *splk, const char *name)
+{
+	LOCKSTAT_SETCLASS(&splk->splk_lockstat, name);
+}
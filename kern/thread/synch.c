@@ -155,6 +155,7 @@ lock_create(const char *name)
 	}
 
 	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
+	LOCKSTAT_LOCKABLEINIT(&lock->lk_lockstat);
 
 	lock->lk_wchan = wchan_create(lock->lk_name);
 	if (lock->lk_wchan == NULL) {
@@ -184,6 +185,8 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
+	LOCKSTAT_WAITER(lsw);
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -191,9 +194,11 @@ lock_acquire(struct lock *lock)
 
 	/* Call this (atomically) before waiting for a lock */
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+	LOCKSTAT_WAIT(&lsw);
 
 	KASSERT(lock->lk_holder != curthread);
 	while (lock->lk_holder != NULL) {
+		LOCKSTAT_CONTENDED(&lsw, &lock->lk_lockstat);
 		/* As in the semaphore. */
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
@@ -201,10 +206,40 @@ lock_acquire(struct lock *lock)
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+	LOCKSTAT_ACQUIRE(&lsw, &lock->lk_lockstat);
 
 	spinlock_release(&lock->lk_lock);
 }
 
+/*
+ * Like lock_acquire, but give up instead of waiting. Returns true if
+ * we got the lock.
+ */
+bool
+lock_tryacquire(struct lock *lock)
+{
+	LOCKSTAT_WAITER(lsw);
+	bool got;
+
+	DEBUGASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lock->lk_lock);
+
+	KASSERT(lock->lk_holder != curthread);
+	got = (lock->lk_holder == NULL);
+	if (got) {
+		HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+		LOCKSTAT_WAIT(&lsw);
+		lock->lk_holder = curthread;
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+		LOCKSTAT_ACQUIRE(&lsw, &lock->lk_lockstat);
+	}
+
+	spinlock_release(&lock->lk_lock);
+	return got;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -218,6 +253,7 @@ lock_release(struct lock *lock)
 
 	/* Call this (atomically) when the lock is released */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
+	LOCKSTAT_RELEASE(&lock->lk_lockstat);
 
 	spinlock_release(&lock->lk_lock);
 }
@@ -236,6 +272,14 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+void
+lock_setclass(struct lock *lock, const char *name)
+{
+	DEBUGASSERT(lock != NULL);
+
+	LOCKSTAT_SETCLASS(&lock->lk_lockstat, name);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
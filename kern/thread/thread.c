@@ -50,6 +50,9 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <pcounter.h>
+#include <trace.h>
+#include <platform/maxcpus.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -69,6 +72,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Number of context switches, for the ct menu command. */
+static struct pcounter switch_count = PCOUNTER_INITIALIZER("thread_switches");
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -139,6 +145,7 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_affinity = CPUMASK_ALL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
@@ -179,6 +186,8 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_idlethread = NULL;
+	c->c_migrant = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -391,6 +400,10 @@ thread_bootstrap(void)
 	KASSERT(curthread->t_proc != NULL);
 	KASSERT(curthread->t_proc == kproc);
 
+	COMPILE_ASSERT(MAXCPUS <= sizeof(cpumask_t) * 8);
+
+	pcounter_register(&switch_count);
+
 	/* Done */
 }
 
@@ -420,6 +433,56 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Body of the per-cpu idle thread. The idle thread is never on a run
+ * queue; thread_switch only runs it when the current thread has to
+ * leave this cpu and there's nothing else to switch to. It gives the
+ * cpu a stack to idle on that no other cpu will ever try to run.
+ */
+static
+void
+thread_idle(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		thread_yield();
+	}
+}
+
+static
+void
+thread_create_idle(struct cpu *c)
+{
+	struct thread *t;
+	char namebuf[16];
+	int result;
+
+	snprintf(namebuf, sizeof(namebuf), "<idle #%u>", c->c_number);
+	t = thread_create(namebuf);
+	if (t == NULL) {
+		panic("thread_create_idle: Out of memory\n");
+	}
+	t->t_stack = kmalloc(STACK_SIZE);
+	if (t->t_stack == NULL) {
+		panic("thread_create_idle: Out of memory\n");
+	}
+	thread_checkstack_init(t);
+	t->t_cpu = c;
+	t->t_affinity = CPUMASK_BIT(c->c_number);
+	result = proc_addthread(kproc, t);
+	if (result) {
+		panic("thread_create_idle: proc_addthread: %s\n",
+		      strerror(result));
+	}
+	/* See thread_fork. */
+	t->t_iplhigh_count++;
+	switchframe_init(t, thread_idle, NULL, 0);
+
+	c->c_idlethread = t;
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -429,6 +492,10 @@ thread_start_cpus(void)
 	char buf[64];
 	unsigned i;
 
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		thread_create_idle(cpuarray_get(&allcpus, i));
+	}
+
 	cpu_identify(buf, sizeof(buf));
 	kprintf("cpu0: %s\n", buf);
 
@@ -442,6 +509,59 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * The set of cpus that exist. (Not all of them have necessarily been
+ * started yet.) allcpus doesn't change after the device probe.
+ */
+cpumask_t
+thread_onlinecpus(void)
+{
+	cpumask_t mask;
+	unsigned i, numcpus;
+
+	mask = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		mask |= CPUMASK_BIT(cpuarray_get(&allcpus, i)->c_number);
+	}
+	return mask;
+}
+
+/*
+ * Choose a cpu from MASK for a thread to be placed on: the one with
+ * the shortest run queue, or PREFER if it's allowed and no worse. The
+ * queue lengths are read without locking, so this is only a hint.
+ */
+static
+struct cpu *
+thread_pickcpu(cpumask_t mask, struct cpu *prefer)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, count, bestcount;
+
+	best = NULL;
+	bestcount = 0;
+	if (prefer != NULL && CPUMASK_ISSET(mask, prefer->c_number)) {
+		best = prefer;
+		bestcount = prefer->c_runqueue.tl_count;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!CPUMASK_ISSET(mask, c->c_number)) {
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (best == NULL || count < bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -462,6 +582,25 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		/*
+		 * If the thread may no longer run on its cpu, send it
+		 * somewhere it may run instead -- unless that cpu is
+		 * still idling on the thread's stack (see the note
+		 * about curthread in thread_consider_migration), in
+		 * which case it has to go back there this once.
+		 */
+		if (!CPUMASK_ISSET(target->t_affinity, targetcpu->c_number) &&
+		    targetcpu->c_curthread != target) {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = thread_pickcpu(target->t_affinity, NULL);
+			target->t_cpu = targetcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
+	}
+
+	if (!already_have_lock) {
+		TRACE(TRACE_WAKEUP, TRACE_PTR(target), targetcpu->c_number);
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
@@ -481,6 +620,25 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * If the previous thread on this cpu left it because of its affinity
+ * (see thread_switch), it's safe to queue it elsewhere now that we're
+ * off its stack. Must be called on every path out of thread_switch.
+ */
+static
+void
+thread_dispatchmigrant(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_migrant;
+	if (t != NULL) {
+		curcpu->c_migrant = NULL;
+		KASSERT(t != curthread);
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -488,18 +646,22 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
  * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * process is inherited from the caller. It will only run on the cpus
+ * in MASK, and starts on CPU, unless the scheduler intervenes first.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_on(const char *name,
+	       struct proc *proc,
+	       cpumask_t mask, struct cpu *cpu,
+	       void (*entrypoint)(void *data1, unsigned long data2),
+	       void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
 
+	KASSERT(CPUMASK_ISSET(mask, cpu->c_number));
+
 	newthread = thread_create(name);
 	if (newthread == NULL) {
 		return ENOMEM;
@@ -518,7 +680,8 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = cpu;
+	newthread->t_affinity = mask;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -541,12 +704,55 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the target cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * Create a new thread based on the current one, starting on the same
+ * cpu as the caller (if its affinity allows) and with the same
+ * affinity.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	struct cpu *cpu;
+	cpumask_t mask;
+
+	mask = curthread->t_affinity;
+	cpu = curthread->t_cpu;
+	if (!CPUMASK_ISSET(mask, cpu->c_number)) {
+		/* we're on our way off this cpu */
+		cpu = thread_pickcpu(mask, NULL);
+	}
+	return thread_fork_on(name, proc, mask, cpu, entrypoint, data1, data2);
+}
+
+/*
+ * Create a new thread restricted to the cpus in MASK, placed on the
+ * least loaded of them.
+ */
+int
+thread_fork_affinity(const char *name,
+		     struct proc *proc,
+		     cpumask_t mask,
+		     void (*entrypoint)(void *data1, unsigned long data2),
+		     void *data1, unsigned long data2)
+{
+	mask &= thread_onlinecpus();
+	if (mask == 0) {
+		return EINVAL;
+	}
+	return thread_fork_on(name, proc, mask,
+			      thread_pickcpu(mask, curthread->t_cpu),
+			      entrypoint, data1, data2);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -587,8 +793,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. (The idle
+	 * thread and a thread that has to leave this cpu always have
+	 * something to do.)
+	 */
+	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue) &&
+	    cur != curcpu->c_idlethread &&
+	    CPUMASK_ISSET(cur->t_affinity, curcpu->c_number)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -599,7 +811,24 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (cur == curcpu->c_idlethread) {
+			/* The idle thread is never queued. */
+		}
+		else if (!CPUMASK_ISSET(cur->t_affinity, curcpu->c_number) &&
+			 curcpu->c_idlethread != NULL) {
+			/*
+			 * We may not run here any more, but we can't
+			 * go on another cpu's run queue while we're
+			 * still running here, or that cpu might try
+			 * to run us too. Whoever runs next on this
+			 * cpu queues us in thread_dispatchmigrant.
+			 */
+			KASSERT(curcpu->c_migrant == NULL);
+			curcpu->c_migrant = cur;
+		}
+		else {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -642,6 +871,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
+		if (next == NULL && curcpu->c_migrant == cur) {
+			/* Need to get off cur's stack; idle elsewhere. */
+			next = curcpu->c_idlethread;
+		}
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
@@ -650,6 +883,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	if (next != cur) {
+		pcounter_inc(&switch_count);
+		TRACE(TRACE_SWITCH, TRACE_PTR(next), newstate);
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -717,6 +955,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send the previous thread on its way, if it's leaving. */
+	thread_dispatchmigrant();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -750,6 +991,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send the previous thread on its way, if it's leaving. */
+	thread_dispatchmigrant();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -800,6 +1044,31 @@ thread_exit(void)
 	panic("braaaaaaaiiiiiiiiiiinssssss\n");
 }
 
+/*
+ * Set the current thread's affinity. If we aren't allowed on this cpu
+ * any more, yielding gets us moved; see thread_switch.
+ */
+int
+thread_setaffinity(cpumask_t mask)
+{
+	mask &= thread_onlinecpus();
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	curthread->t_affinity = mask;
+	if (!CPUMASK_ISSET(mask, curcpu->c_number)) {
+		thread_yield();
+	}
+	return 0;
+}
+
+cpumask_t
+thread_getaffinity(void)
+{
+	return curthread->t_affinity;
+}
+
 /*
  * Yield the cpu to another process, but stay runnable.
  */
@@ -915,6 +1184,13 @@ thread_consider_migration(void)
 				continue;
 			}
 
+			/* Likewise skip threads not allowed on c. */
+			if (!CPUMASK_ISSET(t->t_affinity, c->c_number)) {
+				threadlist_addtail(&victims, t);
+				to_send--;
+				continue;
+			}
+
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
 			DEBUG(DB_THREADS,
@@ -1166,8 +1442,9 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 void
 interprocessor_interrupt(void)
 {
+	struct tlbshootdown shootdowns[TLBSHOOTDOWN_MAX];
 	uint32_t bits;
-	unsigned i;
+	unsigned i, numshootdown;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1195,18 +1472,25 @@ interprocessor_interrupt(void)
 		 * interrupt; don't need to do anything else.
 		 */
 	}
+	numshootdown = 0;
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * vm_tlbshootdown wakes up the sender, which means
+		 * taking a runqueue lock, and thread_make_runnable
+		 * takes those before ipi locks. So take a copy of the
+		 * requests and handle them after releasing the ipi lock.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		numshootdown = curcpu->c_numshootdown;
+		for (i=0; i<numshootdown; i++) {
+			shootdowns[i] = curcpu->c_shootdown[i];
 		}
 		curcpu->c_numshootdown = 0;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	for (i=0; i<numshootdown; i++) {
+		vm_tlbshootdown(&shootdowns[i]);
+	}
 }
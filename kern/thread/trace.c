@@ -0,0 +1,351 @@
+/**
+ * @file:   trace.c
+ * @brief:  kernel event tracer: per-cpu rings, snapshot, decode, save
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <membar.h>
+#include <thread.h>
+#include <current.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <trace.h>
+#include <platform/maxcpus.h>
+
+/* Records per cpu. */
+#define TRACE_RINGSIZE	1024
+
+/*
+ * A ring is written only by its own cpu, with interrupts off, so the
+ * writer never needs a lock. tr_head counts every record ever written;
+ * the slot for record N is N % TRACE_RINGSIZE. The writer fills in a
+ * record before advancing tr_head, so a reader on another cpu can tell
+ * which records it copied might have been overwritten underneath it
+ * by looking at tr_head again afterwards.
+ */
+struct trace_ring {
+	struct trace_record *tr_recs;
+	volatile uint32_t tr_head;
+};
+
+static struct trace_ring trace_rings[MAXCPUS];
+static unsigned trace_ncpus;
+
+volatile bool trace_on;
+
+static const char *const trace_eventnames[TRACE_NEVENTS] = {
+	"?",
+	"switch",
+	"wakeup",
+	"syscall",
+	"sysret",
+	"vop",
+	"intr",
+};
+
+static const char *const trace_vopnames[TRACEVOP_NOPS] = {
+	"eachopen", "reclaim", "read", "readlink", "getdirentry", "write",
+	"ioctl", "stat", "gettype", "isseekable", "fsync", "mmap",
+	"truncate", "namefile", "creat", "symlink", "mkdir", "link",
+	"remove", "rmdir", "rename", "lookup", "lookparent",
+};
+
+/*
+ * Called from boot() once the cpus have been found and the clock is
+ * attached. Recording still waits for trace_start().
+ */
+void
+trace_bootstrap(void)
+{
+	cpumask_t cpus;
+	unsigned i;
+
+	cpus = thread_onlinecpus();
+	for (i=0; i<MAXCPUS; i++) {
+		if (!CPUMASK_ISSET(cpus, i)) {
+			continue;
+		}
+		trace_rings[i].tr_recs =
+			kmalloc(TRACE_RINGSIZE * sizeof(struct trace_record));
+		if (trace_rings[i].tr_recs == NULL) {
+			kprintf("trace: no memory for cpu%u's buffer\n", i);
+			continue;
+		}
+		trace_rings[i].tr_head = 0;
+		trace_ncpus = i + 1;
+	}
+}
+
+void
+trace_record(unsigned event, uint32_t arg0, uint32_t arg1)
+{
+	struct trace_ring *ring;
+	struct trace_record *r;
+	struct timespec ts;
+	uint32_t idx;
+	unsigned num;
+	int s;
+
+	s = splhigh();
+	num = curcpu->c_number;
+	ring = &trace_rings[num];
+	if (ring->tr_recs == NULL) {
+		splx(s);
+		return;
+	}
+
+	gettime(&ts);
+	idx = ring->tr_head;
+	r = &ring->tr_recs[idx % TRACE_RINGSIZE];
+	r->tr_sec = ts.tv_sec;
+	r->tr_nsec = ts.tv_nsec;
+	r->tr_event = event;
+	r->tr_cpu = num;
+	r->tr_thread = TRACE_PTR(curthread);
+	r->tr_arg0 = arg0;
+	r->tr_arg1 = arg1;
+	membar_store_store();
+	ring->tr_head = idx + 1;
+
+	splx(s);
+}
+
+void
+trace_start(void)
+{
+	trace_on = true;
+}
+
+void
+trace_stop(void)
+{
+	trace_on = false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Snapshots
+
+/*
+ * Copy out whatever RING holds into OUT, oldest first. Returns the
+ * number of records copied.
+ */
+static
+unsigned
+trace_snapring(struct trace_ring *ring, struct trace_record *out)
+{
+	uint32_t head, first, i, safe, skip;
+
+	head = ring->tr_head;
+	membar_load_load();
+	first = head > TRACE_RINGSIZE ? head - TRACE_RINGSIZE : 0;
+	for (i=first; i<head; i++) {
+		out[i - first] = ring->tr_recs[i % TRACE_RINGSIZE];
+	}
+	membar_load_load();
+
+	/*
+	 * While we copied, the writer may have gone on to fill records
+	 * up to the new head, plus be partway through the next one.
+	 * Those reuse the slots of the oldest records we copied; drop
+	 * any of ours that might have been hit.
+	 */
+	safe = ring->tr_head + 1;
+	skip = 0;
+	if (safe > first + TRACE_RINGSIZE) {
+		skip = safe - (first + TRACE_RINGSIZE);
+	}
+	if (skip > head - first) {
+		skip = head - first;
+	}
+	if (skip > 0) {
+		memmove(out, out + skip, (head - first - skip) * sizeof(*out));
+	}
+	return head - first - skip;
+}
+
+static
+bool
+trace_before(const struct trace_record *a, const struct trace_record *b)
+{
+	if (a->tr_sec != b->tr_sec) {
+		return a->tr_sec < b->tr_sec;
+	}
+	return a->tr_nsec < b->tr_nsec;
+}
+
+/*
+ * Snapshot every ring and merge them into one array in time order.
+ * Each ring is already in time order, so this is a plain k-way merge.
+ * The caller frees *RET.
+ */
+static
+int
+trace_snapshot(struct trace_record **ret, unsigned *retnum)
+{
+	struct trace_record *percpu, *merged, *best;
+	unsigned count[MAXCPUS], pos[MAXCPUS];
+	unsigned i, n, total, bestcpu;
+
+	percpu = kmalloc(trace_ncpus * TRACE_RINGSIZE * sizeof(*percpu));
+	if (percpu == NULL) {
+		return ENOMEM;
+	}
+
+	total = 0;
+	for (i=0; i<trace_ncpus; i++) {
+		count[i] = 0;
+		pos[i] = 0;
+		if (trace_rings[i].tr_recs != NULL) {
+			count[i] = trace_snapring(&trace_rings[i],
+						  percpu + i*TRACE_RINGSIZE);
+		}
+		total += count[i];
+	}
+
+	merged = kmalloc((total > 0 ? total : 1) * sizeof(*merged));
+	if (merged == NULL) {
+		kfree(percpu);
+		return ENOMEM;
+	}
+
+	for (n=0; n<total; n++) {
+		best = NULL;
+		bestcpu = 0;
+		for (i=0; i<trace_ncpus; i++) {
+			if (pos[i] < count[i]) {
+				struct trace_record *r;
+
+				r = &percpu[i*TRACE_RINGSIZE + pos[i]];
+				if (best == NULL || trace_before(r, best)) {
+					best = r;
+					bestcpu = i;
+				}
+			}
+		}
+		KASSERT(best != NULL);
+		merged[n] = *best;
+		pos[bestcpu]++;
+	}
+
+	kfree(percpu);
+	*ret = merged;
+	*retnum = total;
+	return 0;
+}
+
+static
+void
+trace_print(const struct trace_record *r, const struct trace_record *base)
+{
+	uint64_t t;
+	const char *name;
+
+	t = (uint64_t)(r->tr_sec - base->tr_sec) * 1000000000ULL
+		+ r->tr_nsec - base->tr_nsec;
+	name = r->tr_event < TRACE_NEVENTS ?
+		trace_eventnames[r->tr_event] : "?";
+
+	kprintf("%12llu cpu%-2u %08x %-8s ", (unsigned long long)t,
+		r->tr_cpu, r->tr_thread, name);
+	switch (r->tr_event) {
+	    case TRACE_VOP:
+		kprintf("%s vn %08x\n", r->tr_arg0 < TRACEVOP_NOPS ?
+			trace_vopnames[r->tr_arg0] : "?", r->tr_arg1);
+		break;
+	    case TRACE_SYSCALL:
+	    case TRACE_SYSRET:
+	    case TRACE_INTR:
+		kprintf("%u %u\n", r->tr_arg0, r->tr_arg1);
+		break;
+	    default:
+		kprintf("%08x %u\n", r->tr_arg0, r->tr_arg1);
+		break;
+	}
+}
+
+/*
+ * Print the last MAXRECS records, all cpus merged, with times in
+ * nanoseconds since the first one printed.
+ */
+void
+trace_dump(unsigned maxrecs)
+{
+	struct trace_record *recs;
+	unsigned num, first, i;
+	int result;
+
+	result = trace_snapshot(&recs, &num);
+	if (result) {
+		kprintf("trace: %s\n", strerror(result));
+		return;
+	}
+	if (num == 0) {
+		kprintf("trace: no records\n");
+		kfree(recs);
+		return;
+	}
+
+	first = num > maxrecs ? num - maxrecs : 0;
+	kprintf("trace: %u of %u records\n", num - first, num);
+	kprintf("%12s %-5s %-8s %-8s %s\n", "ns", "cpu", "thread", "event",
+		"args");
+	for (i=first; i<num; i++) {
+		trace_print(&recs[i], &recs[first]);
+	}
+	kfree(recs);
+}
+
+/*
+ * Write a snapshot to PATH for the host-side decoder. (PATH is
+ * destroyed, as with vfs_open.)
+ */
+int
+trace_save(char *path)
+{
+	struct trace_filehdr hdr;
+	struct trace_record *recs;
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	unsigned num;
+	int result;
+
+	result = trace_snapshot(&recs, &num);
+	if (result) {
+		return result;
+	}
+
+	result = vfs_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result) {
+		kfree(recs);
+		return result;
+	}
+
+	hdr.tf_magic = TRACE_MAGIC;
+	hdr.tf_recsize = sizeof(struct trace_record);
+	hdr.tf_numrecs = num;
+	hdr.tf_ncpus = trace_ncpus;
+
+	uio_kinit(&iov, &ku, &hdr, sizeof(hdr), 0, UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+	if (result == 0 && num > 0) {
+		uio_kinit(&iov, &ku, recs, num * sizeof(*recs), sizeof(hdr),
+			  UIO_WRITE);
+		result = VOP_WRITE(vn, &ku);
+	}
+	if (result == 0 && ku.uio_resid > 0) {
+		result = ENOSPC;
+	}
+
+	vfs_close(vn);
+	kfree(recs);
+	return result;
+}
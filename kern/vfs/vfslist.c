@@ -110,6 +110,7 @@ vfs_bootstrap(void)
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
 	}
+	lock_setclass(vfs_biglock, "vfs_biglock");
 	vfs_biglock_depth = 0;
 
 	devnull_create();
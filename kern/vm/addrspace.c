@@ -29,9 +29,17 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pcounter.h>
 #include <proc.h>
 
 /*
@@ -40,6 +48,34 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * An address space is a list of regions, which say what addresses
+ * are legal and with what permissions, and a page table, which says
+ * which of those pages have memory behind them. Nothing is allocated
+ * up front: the first time a page is touched, vm_fault has as_fillpage
+ * give it a frame, filled in from the backing file if the region has
+ * one and with zeros otherwise (pre-zeroed by an idle cpu, if one got
+ * to it). The page table belongs to the
+ * address space, and as_lock must be held to look at or change it.
+ * The pager (swap.c) takes it too before paging out one of our pages,
+ * so a page can't go to swap out from under anyone holding the lock.
+ */
+
+static struct pcounter as_pageins = PCOUNTER_INITIALIZER("vm_pageins");
+static struct pcounter as_zerofills = PCOUNTER_INITIALIZER("vm_zerofills");
+static struct pcounter as_writebacks = PCOUNTER_INITIALIZER("vm_writebacks");
+
+static int as_syncrange(struct addrspace *as, struct region *rg,
+			vaddr_t start, vaddr_t end);
+
+void
+as_bootstrap(void)
+{
+	pcounter_register(&as_pageins);
+	pcounter_register(&as_zerofills);
+	pcounter_register(&as_writebacks);
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -50,40 +86,221 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
 	/*
-	 * Initialize as needed.
+	 * Made up front because the pager shoots down TLB entries when
+	 * memory is short, which is no time to be allocating.
 	 */
+	as->as_tlbdone = sem_create("tlbshootdown", 0);
+	if (as->as_tlbdone == NULL) {
+		lock_destroy(as->as_lock);
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	as->as_loading = false;
+	bzero(as->as_asid, sizeof(as->as_asid));
 
 	return as;
 }
 
+static
+struct region *
+as_addregion(struct addrspace *as, vaddr_t base, size_t npages, int perms)
+{
+	struct region *rg;
+
+	rg = kmalloc(sizeof(*rg));
+	if (rg == NULL) {
+		return NULL;
+	}
+	rg->rg_base = base;
+	rg->rg_npages = npages;
+	rg->rg_perms = perms;
+	rg->rg_flags = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_filebase = 0;
+	rg->rg_fileoff = 0;
+	rg->rg_filesize = 0;
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+	return rg;
+}
+
+/*
+ * Find a region that overlaps [BASE, TOP), or return NULL.
+ */
+static
+struct region *
+as_overlap(struct addrspace *as, vaddr_t base, vaddr_t top)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (base < rg->rg_base + rg->rg_npages * PAGE_SIZE &&
+		    rg->rg_base < top) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct region *rg, *newrg;
+	pte_t *oldpte, *newpte;
+	paddr_t pa;
+	vaddr_t va;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		newrg = as_addregion(newas, rg->rg_base, rg->rg_npages,
+				     rg->rg_perms);
+		if (newrg == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		newrg->rg_flags = rg->rg_flags;
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_filebase = rg->rg_filebase;
+			newrg->rg_fileoff = rg->rg_fileoff;
+			newrg->rg_filesize = rg->rg_filesize;
+		}
+	}
+
 	/*
-	 * Write this.
+	 * Share every page copy-on-write: both page tables point at the
+	 * same frame, with one more reference on it, and vm_fault makes
+	 * a private copy when either side writes to it. The old address
+	 * space may have writeable TLB entries for these pages, on this
+	 * cpu or another, so those have to go before we return.
+	 *
+	 * Pages that are out in swap are read into a private copy for
+	 * the new address space instead. Pages of shared mappings stay
+	 * shared: vm_fault doesn't copy them, and both sides write back
+	 * whatever was written. Allocating memory can page out
+	 * more of the old one's pages, so look at each PTE only once the
+	 * allocations for it are done. Nobody else knows about the new
+	 * address space yet, but the pager does once it has pages, hence
+	 * its lock.
 	 */
+	lock_acquire(old->as_lock);
+	lock_acquire(newas->as_lock);
+	va = 0;
+	while ((oldpte = pt_next(old->as_pt, &va)) != NULL) {
+		newpte = pt_lookup(newas->as_pt, va, true);
+		if (newpte == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		if (*oldpte & PTE_SWAPPED) {
+			pa = swap_getpage();
+			if (pa == 0) {
+				result = ENOMEM;
+				goto fail;
+			}
+			result = swap_read(PTE_SLOT(*oldpte), pa);
+			if (result) {
+				coremap_free(pa);
+				goto fail;
+			}
+		}
+		else {
+			KASSERT(*oldpte & PTE_VALID);
+			pa = *oldpte & PTE_FRAME;
+			coremap_share(pa);
+			*oldpte &= ~PTE_WRITE;
+		}
+		*newpte = pa | PTE_VALID | (*oldpte & PTE_DIRTY);
 
-	(void)old;
+		va += PAGE_SIZE;
+		if (va == 0 || va >= USERSPACETOP) {
+			break;
+		}
+	}
+	vm_tlbshootdown_as(old);
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
 
 	*ret = newas;
 	return 0;
+
+ fail:
+	/* Pages already shared need their write permission taken too. */
+	vm_tlbshootdown_as(old);
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
+	as_destroy(newas);
+	return result;
 }
 
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct region *rg;
+	pte_t *pte;
+	vaddr_t va;
+
+	/* Keep the pager off our pages while we free them. */
+	lock_acquire(as->as_lock);
 
+	/* What was written to shared mappings has to reach the files. */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_flags & RGF_SHARED) {
+			(void)as_syncrange(as, rg, rg->rg_base,
+					   rg->rg_base + rg->rg_npages * PAGE_SIZE);
+		}
+	}
+
+	va = 0;
+	while ((pte = pt_next(as->as_pt, &va)) != NULL) {
+		if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		else {
+			KASSERT(*pte & PTE_VALID);
+			coremap_free(*pte & PTE_FRAME);
+		}
+		*pte = 0;
+		va += PAGE_SIZE;
+		if (va == 0 || va >= USERSPACETOP) {
+			break;
+		}
+	}
+	lock_release(as->as_lock);
+	pt_destroy(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+
+	sem_destroy(as->as_tlbdone);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -101,19 +318,14 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	vm_tlbactivate(as);
 }
 
 void
 as_deactivate(void)
 {
-	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
-	 */
+	/* Drop our TLB entries before the address space goes away. */
+	vm_tlbactivate(NULL);
 }
 
 /*
@@ -122,57 +334,212 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * to a segment without WRITEABLE fault. The MIPS can't refuse reads
+ * or instruction fetches from a mapped page, so the other two are
+ * only recorded.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	struct region *rg;
+	vaddr_t top;
+	size_t npages;
+
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+	npages = memsize / PAGE_SIZE;
+	top = vaddr + memsize;
+
+	if (npages == 0 || top < vaddr || top > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	if (as_overlap(as, vaddr, top) != NULL) {
+		return EINVAL;
+	}
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+	rg = as_addregion(as, vaddr, npages,
+			  (readable ? RG_READ : 0) |
+			  (writeable ? RG_WRITE : 0) |
+			  (executable ? RG_EXEC : 0));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	return 0;
 }
 
+struct region *
+as_findregion(struct addrspace *as, vaddr_t va)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (va >= rg->rg_base &&
+		    va - rg->rg_base < rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Back the FILESIZE bytes at VADDR with V from OFFSET on. They must
+ * all be in one region, and in the file.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_backing(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+		  struct vnode *v, off_t offset)
 {
-	/*
-	 * Write this.
-	 */
+	struct region *rg;
+	struct stat st;
+	int result;
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_vnode != NULL) {
+		return EINVAL;
+	}
+	if (filesize > rg->rg_base + rg->rg_npages * PAGE_SIZE - vaddr) {
+		return EINVAL;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset < 0 || offset + filesize > st.st_size) {
+		/* problem with executable? */
+		kprintf("ELF: segment past end of file - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_filebase = vaddr;
+	rg->rg_fileoff = offset;
+	rg->rg_filesize = filesize;
+	return 0;
+}
 
-	(void)as;
+/*
+ * Get a frame for the page at VADDR in region RG, and fill it in: the
+ * part covered by the backing file is read from it, and the rest is
+ * zeroed. Returns the frame in *RET.
+ */
+int
+as_fillpage(struct region *rg, vaddr_t vaddr, paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kva;
+	paddr_t pa;
+	vaddr_t start, end;
+	int result;
+
+	KASSERT(vaddr % PAGE_SIZE == 0);
+
+	start = end = vaddr;
+	if (rg->rg_vnode != NULL && rg->rg_filesize > 0) {
+		start = rg->rg_filebase > vaddr ? rg->rg_filebase : vaddr;
+		end = rg->rg_filebase + rg->rg_filesize;
+		if (end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if (end < start) {
+			end = start;
+		}
+	}
+	if (start == end) {
+		pa = swap_getzeropage();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		pcounter_inc(&as_zerofills);
+		*ret = pa;
+		return 0;
+	}
+
+	pa = swap_getpage();
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	kva = (char *)PADDR_TO_KVADDR(pa);
+
+	bzero(kva, start - vaddr);
+	bzero(kva + (end - vaddr), vaddr + PAGE_SIZE - end);
+
+	uio_kinit(&iov, &ku, kva + (start - vaddr), end - start,
+		  rg->rg_fileoff + (start - rg->rg_filebase), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		/* The file shrank since we checked it. */
+		result = EIO;
+	}
+	if (result) {
+		coremap_free(pa);
+		return result;
+	}
+	pcounter_inc(&as_pageins);
+	*ret = pa;
+	return 0;
+}
+
+/*
+ * While loading, every region is writeable, so load_elf can fill in
+ * the text segment.
+ */
+int
+as_prepare_load(struct addrspace *as)
+{
+	as->as_loading = true;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
+	struct region *rg;
+	pte_t *pte;
+	vaddr_t va;
+
 	/*
-	 * Write this.
+	 * Drop any writeable mappings of now read-only pages, wherever
+	 * we ran while loading.
 	 */
-
-	(void)as;
+	lock_acquire(as->as_lock);
+	as->as_loading = false;
+	va = 0;
+	while ((pte = pt_next(as->as_pt, &va)) != NULL) {
+		rg = as_findregion(as, va);
+		KASSERT(rg != NULL);
+		if ((rg->rg_perms & RG_WRITE) == 0) {
+			*pte &= ~PTE_WRITE;
+		}
+		va += PAGE_SIZE;
+		if (va == 0 || va >= USERSPACETOP) {
+			break;
+		}
+	}
+	vm_tlbshootdown_as(as);
+	lock_release(as->as_lock);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -180,3 +547,344 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// mmap
+
+/*
+ * Find the end of the LEN bytes at VADDR, rounded up to a page, and
+ * check they're all in user space.
+ */
+static
+int
+as_rangetop(vaddr_t vaddr, size_t len, vaddr_t *top)
+{
+	if (vaddr % PAGE_SIZE != 0 || len == 0 || vaddr >= USERSPACETOP ||
+	    len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	*top = vaddr + ROUNDUP(len, PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * Find room for NPAGES of mapping, as high as possible below the
+ * stack. An unmapped page is left above it, so running off the end
+ * faults, and page 0 stays unmapped. Returns 0 if there's no room.
+ */
+static
+vaddr_t
+as_findgap(struct addrspace *as, size_t npages)
+{
+	struct region *rg;
+	vaddr_t top;
+	size_t len;
+
+	len = npages * PAGE_SIZE;
+	top = USERSTACK - VM_STACKPAGES * PAGE_SIZE - PAGE_SIZE;
+	while (top >= len + PAGE_SIZE) {
+		rg = as_overlap(as, top - len, top);
+		if (rg == NULL) {
+			return top - len;
+		}
+		if (rg->rg_base < PAGE_SIZE) {
+			break;
+		}
+		top = rg->rg_base - PAGE_SIZE;
+	}
+	return 0;
+}
+
+/*
+ * Write the page at VA of shared region RG, in the frame at PA, back
+ * to the file. Only what was in the file when it was mapped is
+ * written; mapping a file doesn't make it longer.
+ */
+static
+int
+as_writepage(struct region *rg, vaddr_t va, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t end;
+	int result;
+
+	end = rg->rg_filebase + rg->rg_filesize;
+	if (end > va + PAGE_SIZE) {
+		end = va + PAGE_SIZE;
+	}
+	if (end <= va) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), end - va,
+		  rg->rg_fileoff + (va - rg->rg_filebase), UIO_WRITE);
+	result = VOP_WRITE(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	pcounter_inc(&as_writebacks);
+	return 0;
+}
+
+/*
+ * Write back the dirty pages of shared region RG in [START, END).
+ * Call with AS's lock held.
+ *
+ * The pages are made read-only first, so anything written to them
+ * from then on faults and marks them dirty again. While a page is
+ * being written it has an extra reference, which keeps the pager off
+ * it; the pager may be running for us, with our lock, if the write
+ * needs memory.
+ */
+static
+int
+as_syncrange(struct addrspace *as, struct region *rg,
+	     vaddr_t start, vaddr_t end)
+{
+	pte_t *pte;
+	paddr_t pa;
+	vaddr_t va;
+	bool shootdown;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT(rg->rg_flags & RGF_SHARED);
+
+	if (rg->rg_vnode == NULL) {
+		/* Shared anonymous memory; nowhere to write it. */
+		return 0;
+	}
+
+	shootdown = false;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_WRITE)) {
+			*pte &= ~PTE_WRITE;
+			shootdown = true;
+		}
+	}
+	if (shootdown) {
+		vm_tlbshootdown_as(as);
+	}
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || (*pte & PTE_DIRTY) == 0) {
+			continue;
+		}
+		if (*pte & PTE_SWAPPED) {
+			result = swap_pagein(as, va, pte);
+			if (result) {
+				return result;
+			}
+		}
+		*pte &= ~PTE_DIRTY;
+		pa = *pte & PTE_FRAME;
+
+		coremap_share(pa);
+		result = as_writepage(rg, va, pa);
+		coremap_free(pa);
+		/* Sharing forgot the owner; the pager needs it back. */
+		coremap_touch(pa, as, va);
+
+		if (result) {
+			*pte |= PTE_DIRTY;
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Throw away the pages in [START, END). Call with AS's lock held.
+ */
+static
+void
+as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	pte_t *pte;
+	vaddr_t va;
+
+	/* Out of every TLB before any frame can be reused. */
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_VALID)) {
+			*pte &= ~(PTE_VALID | PTE_WRITE);
+		}
+	}
+	vm_tlbshootdown_as(as);
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		else {
+			coremap_free(*pte & PTE_FRAME);
+		}
+		*pte = 0;
+	}
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t *vaddr, size_t len, int perms,
+	int flags, struct vnode *v, off_t offset)
+{
+	struct region *rg;
+	struct stat st;
+	vaddr_t base, top;
+	size_t npages, filesize;
+	int result;
+
+	KASSERT((flags & ~RGF_SHARED) == 0);
+
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	/* Bytes past what's in the file now read as zero. */
+	filesize = 0;
+	if (v != NULL) {
+		KASSERT(offset >= 0 && offset % PAGE_SIZE == 0);
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (offset < st.st_size) {
+			filesize = npages * PAGE_SIZE;
+			if (st.st_size - offset < (off_t)filesize) {
+				filesize = st.st_size - offset;
+			}
+		}
+	}
+
+	lock_acquire(as->as_lock);
+	base = *vaddr;
+	if (base != 0) {
+		result = as_rangetop(base, len, &top);
+		if (result == 0 && as_overlap(as, base, top) != NULL) {
+			result = EINVAL;
+		}
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+	else {
+		base = as_findgap(as, npages);
+		if (base == 0) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+	}
+
+	rg = as_addregion(as, base, npages, perms);
+	if (rg == NULL) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	rg->rg_flags = RGF_MMAP | flags;
+	if (v != NULL) {
+		VOP_INCREF(v);
+		rg->rg_vnode = v;
+		rg->rg_filebase = base;
+		rg->rg_fileoff = offset;
+		rg->rg_filesize = filesize;
+	}
+	lock_release(as->as_lock);
+
+	*vaddr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg, **prev;
+	vaddr_t top, rgtop;
+	int result;
+
+	result = as_rangetop(vaddr, len, &top);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(as->as_lock);
+
+	/* Check everything first, so it's all or nothing. */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		rgtop = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_base >= top || rgtop <= vaddr) {
+			continue;
+		}
+		if ((rg->rg_flags & RGF_MMAP) == 0 ||
+		    rg->rg_base < vaddr || rgtop > top) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+	}
+
+	prev = &as->as_regions;
+	while ((rg = *prev) != NULL) {
+		rgtop = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_base >= top || rgtop <= vaddr) {
+			prev = &rg->rg_next;
+			continue;
+		}
+		if (rg->rg_flags & RGF_SHARED) {
+			result = as_syncrange(as, rg, rg->rg_base, rgtop);
+			if (result) {
+				lock_release(as->as_lock);
+				return result;
+			}
+		}
+		as_freerange(as, rg->rg_base, rgtop);
+		*prev = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+
+	lock_release(as->as_lock);
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	vaddr_t top, start, end;
+	int result;
+
+	result = as_rangetop(vaddr, len, &top);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(as->as_lock);
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if ((rg->rg_flags & RGF_SHARED) == 0) {
+			continue;
+		}
+		start = rg->rg_base > vaddr ? rg->rg_base : vaddr;
+		end = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		if (end > top) {
+			end = top;
+		}
+		if (start >= end) {
+			continue;
+		}
+		result = as_syncrange(as, rg, start, end);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(as->as_lock);
+	return result;
+}
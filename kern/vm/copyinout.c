@@ -33,7 +33,9 @@
 #include <setjmp.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <vm.h>
+#include <pcounter.h>
 #include <copyinout.h>
 
 /*
@@ -84,8 +86,58 @@
  * To make use of this code, in addition to tm_badfaultfunc the
  * thread_machdep structure should contain a jmp_buf called
  * "tm_copyjmp".
+ *
+ * Every call is counted, with the bytes it moved and the cpu cycles
+ * it took from start to finish, in the copyin_* and copyout_*
+ * counters. (The string functions count as copyin and copyout.) The
+ * cycles divided by the calls is the average cost of crossing the
+ * user/kernel boundary, which is what copyinv and copyoutv are for
+ * cutting down when there are several buffers to move at once.
  */
 
+static struct pcounter copyin_calls = PCOUNTER_INITIALIZER("copyin_calls");
+static struct pcounter copyin_bytes = PCOUNTER_INITIALIZER("copyin_bytes");
+static struct pcounter copyin_cycles = PCOUNTER_INITIALIZER("copyin_cycles");
+static struct pcounter copyout_calls = PCOUNTER_INITIALIZER("copyout_calls");
+static struct pcounter copyout_bytes = PCOUNTER_INITIALIZER("copyout_bytes");
+static struct pcounter copyout_cycles =
+	PCOUNTER_INITIALIZER("copyout_cycles");
+
+void
+copyinout_bootstrap(void)
+{
+	pcounter_register(&copyin_calls);
+	pcounter_register(&copyin_bytes);
+	pcounter_register(&copyin_cycles);
+	pcounter_register(&copyout_calls);
+	pcounter_register(&copyout_bytes);
+	pcounter_register(&copyout_cycles);
+}
+
+/*
+ * Count a call that started at cycle START and moved LEN bytes. The
+ * cycle counter is 32 bits and wraps, but unsigned subtraction copes
+ * as long as one call doesn't take a whole lap.
+ */
+static
+void
+copy_account(bool in, size_t len, uint32_t start)
+{
+	uint32_t cycles;
+
+	cycles = cpu_cycles() - start;
+	if (in) {
+		pcounter_inc(&copyin_calls);
+		pcounter_add(&copyin_bytes, len);
+		pcounter_add(&copyin_cycles, cycles);
+	}
+	else {
+		pcounter_inc(&copyout_calls);
+		pcounter_add(&copyout_bytes, len);
+		pcounter_add(&copyout_cycles, cycles);
+	}
+}
+
 /*
  * Recovery function. If a fatal fault occurs during copyin, copyout,
  * copyinstr, or copyoutstr, execution resumes here. (This behavior is
@@ -154,6 +206,9 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 {
 	int result;
 	size_t stoplen;
+	uint32_t start;
+
+	start = cpu_cycles();
 
 	result = copycheck(usersrc, len, &stoplen);
 	if (result) {
@@ -169,12 +224,14 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 	result = setjmp(curthread->t_machdep.tm_copyjmp);
 	if (result) {
 		curthread->t_machdep.tm_badfaultfunc = NULL;
+		copy_account(true, 0, start);
 		return EFAULT;
 	}
 
 	memcpy(dest, (const void *)usersrc, len);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
+	copy_account(true, len, start);
 	return 0;
 }
 
@@ -190,6 +247,9 @@ copyout(const void *src, userptr_t userdest, size_t len)
 {
 	int result;
 	size_t stoplen;
+	uint32_t start;
+
+	start = cpu_cycles();
 
 	result = copycheck(userdest, len, &stoplen);
 	if (result) {
@@ -205,15 +265,131 @@ copyout(const void *src, userptr_t userdest, size_t len)
 	result = setjmp(curthread->t_machdep.tm_copyjmp);
 	if (result) {
 		curthread->t_machdep.tm_badfaultfunc = NULL;
+		copy_account(false, 0, start);
 		return EFAULT;
 	}
 
 	memcpy((void *)userdest, src, len);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
+	copy_account(false, len, start);
 	return 0;
 }
 
+/*
+ * copyinv
+ *
+ * Do COUNT copyins, as described by VEC, under one setup of the
+ * tm_badfaultfunc/copyfail logic. Every block is checked before any
+ * is copied, so a bad address anywhere means nothing is copied;
+ * but a fault partway through leaves the blocks before it copied.
+ * Empty blocks are skipped.
+ */
+int
+copyinv(const struct copyinvec *vec, unsigned count)
+{
+	int result;
+	size_t stoplen, total;
+	unsigned i;
+	uint32_t start;
+
+	start = cpu_cycles();
+
+	total = 0;
+	for (i=0; i<count; i++) {
+		if (vec[i].ci_len == 0) {
+			continue;
+		}
+		result = copycheck(vec[i].ci_usersrc, vec[i].ci_len, &stoplen);
+		if (result) {
+			return result;
+		}
+		if (stoplen != vec[i].ci_len) {
+			return EFAULT;
+		}
+		total += vec[i].ci_len;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		copy_account(true, 0, start);
+		return EFAULT;
+	}
+
+	for (i=0; i<count; i++) {
+		memcpy(vec[i].ci_dest, (const void *)vec[i].ci_usersrc,
+		       vec[i].ci_len);
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	copy_account(true, total, start);
+	return 0;
+}
+
+/*
+ * copyoutv
+ *
+ * Do COUNT copyouts, as described by VEC, the same way copyinv does
+ * copyins.
+ */
+int
+copyoutv(const struct copyoutvec *vec, unsigned count)
+{
+	int result;
+	size_t stoplen, total;
+	unsigned i;
+	uint32_t start;
+
+	start = cpu_cycles();
+
+	total = 0;
+	for (i=0; i<count; i++) {
+		if (vec[i].co_len == 0) {
+			continue;
+		}
+		result = copycheck(vec[i].co_userdest, vec[i].co_len,
+				   &stoplen);
+		if (result) {
+			return result;
+		}
+		if (stoplen != vec[i].co_len) {
+			return EFAULT;
+		}
+		total += vec[i].co_len;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		copy_account(false, 0, start);
+		return EFAULT;
+	}
+
+	for (i=0; i<count; i++) {
+		memcpy((void *)vec[i].co_userdest, vec[i].co_src,
+		       vec[i].co_len);
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	copy_account(false, total, start);
+	return 0;
+}
+
+/*
+ * Word-at-a-time string scanning. STR_HASZERO(w) is nonzero if any
+ * byte of W is 0. (It can't tell which, and it can be wrong about
+ * bytes after the first 0, but whether there is one is all we ask.)
+ */
+#define STR_ONES	((unsigned long)-1 / 0xff)
+#define STR_HIGHS	(STR_ONES << 7)
+#define STR_HASZERO(w)	(((w) - STR_ONES) & ~(w) & STR_HIGHS)
+#define STR_WORDMASK	(sizeof(unsigned long) - 1)
+
 /*
  * Common string copying function that behaves the way that's desired
  * for copyinstr and copyoutstr.
@@ -229,15 +405,41 @@ copyout(const void *src, userptr_t userdest, size_t len)
  * hit STOPLEN it's because the string has run into the end of
  * userspace. Thus in the latter case we return EFAULT, not
  * ENAMETOOLONG.
+ *
+ * Once SRC is word-aligned, it's read a word at a time, and words
+ * with no 0 in them are stored whole (or bytewise, if DEST isn't
+ * aligned the same way). The word with the terminator in it, and any
+ * word that would run past MAXLEN or STOPLEN, is done by bytes. An
+ * aligned word never straddles a page, so this never touches a page
+ * the byte-at-a-time copy wouldn't have.
  */
 static
 int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
-
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	size_t i, lim;
+	unsigned long w;
+
+	lim = maxlen < stoplen ? maxlen : stoplen;
+
+	i = 0;
+	while (i < lim) {
+		if (((uintptr_t)(src + i) & STR_WORDMASK) == 0 &&
+		    lim - i >= sizeof(w)) {
+			w = *(const unsigned long *)(src + i);
+			if (!STR_HASZERO(w)) {
+				if (((uintptr_t)(dest + i) & STR_WORDMASK)
+				    == 0) {
+					*(unsigned long *)(dest + i) = w;
+				}
+				else {
+					memcpy(dest + i, &w, sizeof(w));
+				}
+				i += sizeof(w);
+				continue;
+			}
+		}
 		dest[i] = src[i];
 		if (src[i] == 0) {
 			if (gotlen != NULL) {
@@ -245,6 +447,7 @@ copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 			}
 			return 0;
 		}
+		i++;
 	}
 	if (stoplen < maxlen) {
 		/* ran into user-kernel boundary */
@@ -267,6 +470,9 @@ copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *actual)
 {
 	int result;
 	size_t stoplen;
+	uint32_t start;
+
+	start = cpu_cycles();
 
 	result = copycheck(usersrc, len, &stoplen);
 	if (result) {
@@ -278,12 +484,15 @@ copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *actual)
 	result = setjmp(curthread->t_machdep.tm_copyjmp);
 	if (result) {
 		curthread->t_machdep.tm_badfaultfunc = NULL;
+		copy_account(true, 0, start);
 		return EFAULT;
 	}
 
 	result = copystr(dest, (const char *)usersrc, len, stoplen, actual);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
+	copy_account(true, (result == 0 && actual != NULL) ? *actual : 0,
+		     start);
 	return result;
 }
 
@@ -300,6 +509,9 @@ copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
 {
 	int result;
 	size_t stoplen;
+	uint32_t start;
+
+	start = cpu_cycles();
 
 	result = copycheck(userdest, len, &stoplen);
 	if (result) {
@@ -311,11 +523,14 @@ copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
 	result = setjmp(curthread->t_machdep.tm_copyjmp);
 	if (result) {
 		curthread->t_machdep.tm_badfaultfunc = NULL;
+		copy_account(false, 0, start);
 		return EFAULT;
 	}
 
 	result = copystr((char *)userdest, src, len, stoplen, actual);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
+	copy_account(false, (result == 0 && actual != NULL) ? *actual : 0,
+		     start);
 	return result;
 }
@@ -0,0 +1,990 @@
+/**
+ * @file:   coremap.c
+ * @brief:  physical page frame allocator
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pcounter.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Buddy allocator. A free block of order k is 2^k frames starting at
+ * a frame number that's a multiple of 2^k; its buddy is the block of
+ * the same size it was split from, at frame number f ^ 2^k. Only the
+ * first frame of a free block is marked CME_FREE, and carries the
+ * order; the other frames are CME_INTERIOR. Each order has a doubly
+ * linked free list threaded through the coremap by frame number, so
+ * a block can be pulled off its list in O(1) when its buddy is freed.
+ *
+ * Allocating NPAGES takes a block of the smallest order that fits,
+ * splitting larger blocks as needed, then gives back the unused tail
+ * as smaller blocks. If no block is big enough, adjacent free blocks
+ * are combined instead (slowly; this is for the odd huge request).
+ * Freeing a run breaks it into aligned blocks and frees each, merging
+ * with its buddy for as long as the buddy is free and whole.
+ *
+ * The managed range starts wherever the fixed frames end, so blocks
+ * at its edges may have a buddy that doesn't exist; those just never
+ * merge.
+ *
+ * Per-cpu caches. Single pages are by far the most common request
+ * (kmalloc's subpage allocator, page tables, user pages), so each cpu
+ * keeps a few free pages of its own. The cache is refilled from and
+ * drained to the buddy lists CM_PCPU_BATCH pages at a time, so most
+ * single-page allocations and frees never touch the global lock.
+ * Cached pages are CME_CACHED, which keeps their buddies from merging
+ * with them. If a multi-page allocation fails, all the caches are
+ * drained and it's tried once more.
+ *
+ * Sharing. A single page can have more than one owner (copy-on-write
+ * pages shared between address spaces after a fork). Each allocated
+ * run has a reference count; coremap_free drops one and only frees
+ * the page when it reaches zero. The counts are protected by a small
+ * array of spinlocks hashed by frame number, so unrelated frees don't
+ * fight over one lock.
+ *
+ * Page replacement. A user page that only one address space maps
+ * records that address space and the page's virtual address, so the
+ * pager (swap.c) can find the PTE to change when it evicts the page.
+ * vm_fault sets the owner and the referenced bit each time it loads
+ * the page into the TLB, and coremap_pickvictim runs a clock over the
+ * frames: a referenced page has its bit cleared and gets a second
+ * chance, an unreferenced one is chosen. A chosen page is marked busy
+ * until the pager is done with it; freeing a busy page waits. Shared
+ * pages have no owner and are never chosen. The owner and flags are
+ * protected by the refcount locks, like the reference count.
+ *
+ * Tags. The kernel allocator that owns a page can leave a byte on it
+ * with coremap_settag, to tell later, from nothing but an address on
+ * the page, what the page is for (kmalloc records the block size of
+ * its subpage pages this way). Allocating a page clears its tag. Only
+ * the page's owner sets the tag, so it's read without a lock.
+ *
+ * Pre-zeroed pages. A cpu with nothing to run calls coremap_idlezero
+ * from cpu_idle, which takes a free page, zeroes it, and keeps it in
+ * a small pool, so pages that must start out zeroed (new user pages,
+ * page tables) can skip the bzero while someone waits for them. The
+ * pool only fills while memory is plentiful. Its pages count as
+ * allocated, so when nothing else is free, coremap_alloc takes them
+ * like any other page.
+ *
+ * Lock order: a per-cpu cache lock, then cm_lock. The refcount locks
+ * and cm_zerolock are leaves.
+ */
+
+#define CM_NONE		0xffffffff	/* End of free list */
+
+#define CME_FIXED	0		/* Never allocatable */
+#define CME_FREE	1		/* First frame of a free block */
+#define CME_INTERIOR	2		/* Rest of a free block */
+#define CME_CACHED	3		/* Free, in a per-cpu cache */
+#define CME_USED	4		/* Allocated, not the first of its run */
+#define CME_HEAD	5		/* Allocated, first of its run */
+
+#define CMF_REF		0x01		/* Used since the clock last passed */
+#define CMF_BUSY	0x02		/* Being paged out */
+
+struct coremap_entry {
+	union {
+		struct {			/* On CME_FREE frames */
+			uint32_t f_next;	/* Free list linkage */
+			uint32_t f_prev;
+		} u_free;
+		struct {			/* On CME_HEAD frames */
+			struct addrspace *o_as;	/* Sole owner, or NULL */
+			vaddr_t o_va;		/* Where it maps the page */
+		} u_owner;
+	} cme_u;
+	uint32_t cme_npages;		/* Run length, on CME_HEAD frames */
+	uint16_t cme_refs;		/* References, on CME_HEAD frames */
+	uint8_t cme_state;
+	uint8_t cme_order;		/* Block order, on CME_FREE frames */
+	uint8_t cme_flags;		/* CMF_*, on CME_HEAD frames */
+	uint8_t cme_tag;		/* Owner's tag, on CME_HEAD frames */
+};
+
+#define cme_next	cme_u.u_free.f_next
+#define cme_prev	cme_u.u_free.f_prev
+#define cme_as		cme_u.u_owner.o_as
+#define cme_va		cme_u.u_owner.o_va
+
+static struct coremap_entry *coremap;
+static uint32_t cm_nframes;		/* Frames in the map */
+static uint32_t cm_firstframe;		/* First non-fixed frame */
+static uint32_t cm_freelist[COREMAP_NORDERS];
+static unsigned cm_nblocks[COREMAP_NORDERS];
+static unsigned cm_nfree;		/* Pages on the free lists */
+static bool cm_ready;
+
+/* Also covers ram_stealmem before the map exists. */
+static struct spinlock cm_lock = SPINLOCK_INITIALIZER;
+
+#define CM_NREFLOCKS	16
+static struct spinlock cm_reflocks[CM_NREFLOCKS];
+#define CM_REFLOCK(f)	(&cm_reflocks[(f) % CM_NREFLOCKS])
+
+/* For waiting for busy pages; each goes with the refcount lock. */
+static struct wchan *cm_busywchans[CM_NREFLOCKS];
+#define CM_BUSYWCHAN(f)	(cm_busywchans[(f) % CM_NREFLOCKS])
+
+/* Clock hand. Only one thread evicts at a time, so it has no lock. */
+static uint32_t cm_hand;
+
+#define CM_PCPU_SIZE	32
+#define CM_PCPU_BATCH	16
+
+struct cm_pcpu {
+	struct spinlock cp_lock;
+	unsigned cp_count;
+	uint32_t cp_frames[CM_PCPU_SIZE];
+};
+
+static struct cm_pcpu cm_pcpu[MAXCPUS];
+
+static struct pcounter cm_cachehits =
+	PCOUNTER_INITIALIZER("coremap_cachehits");
+static struct pcounter cm_cachemisses =
+	PCOUNTER_INITIALIZER("coremap_cachemisses");
+
+#define CM_ZEROPOOL	32		/* Most pre-zeroed pages kept */
+#define CM_ZEROMINFREE	(4 * CM_ZEROPOOL)	/* Free pages to fill it */
+
+static uint32_t cm_zeroframes[CM_ZEROPOOL];
+static unsigned cm_nzero;
+static struct spinlock cm_zerolock = SPINLOCK_INITIALIZER;
+
+static struct pcounter cm_zerohits = PCOUNTER_INITIALIZER("zeropool_hits");
+static struct pcounter cm_zerofills =
+	PCOUNTER_INITIALIZER("zeropool_fills");
+
+////////////////////////////////////////////////////////////
+//
+// Buddy lists (all called with cm_lock held)
+
+static
+void
+buddy_insert(uint32_t f, unsigned order)
+{
+	struct coremap_entry *e = &coremap[f];
+
+	e->cme_state = CME_FREE;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = cm_freelist[order];
+	if (cm_freelist[order] != CM_NONE) {
+		coremap[cm_freelist[order]].cme_prev = f;
+	}
+	cm_freelist[order] = f;
+	cm_nblocks[order]++;
+	cm_nfree += 1U << order;
+}
+
+static
+void
+buddy_remove(uint32_t f)
+{
+	struct coremap_entry *e = &coremap[f];
+	unsigned order = e->cme_order;
+
+	KASSERT(e->cme_state == CME_FREE);
+	if (e->cme_prev == CM_NONE) {
+		KASSERT(cm_freelist[order] == f);
+		cm_freelist[order] = e->cme_next;
+	}
+	else {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_next = e->cme_prev = CM_NONE;
+	e->cme_state = CME_INTERIOR;
+	cm_nblocks[order]--;
+	cm_nfree -= 1U << order;
+}
+
+/*
+ * Free the block of order ORDER at F, merging upward.
+ */
+static
+void
+buddy_free(uint32_t f, unsigned order)
+{
+	uint32_t b;
+
+	KASSERT(f % (1U << order) == 0);
+
+	while (order < COREMAP_NORDERS - 1) {
+		b = f ^ (1U << order);
+		if (b < cm_firstframe || b + (1U << order) > cm_nframes) {
+			break;
+		}
+		if (coremap[b].cme_state != CME_FREE ||
+		    coremap[b].cme_order != order) {
+			break;
+		}
+		buddy_remove(b);
+		if (b < f) {
+			f = b;
+		}
+		order++;
+	}
+	buddy_insert(f, order);
+}
+
+/*
+ * Take a block of order ORDER, splitting a bigger one if need be.
+ */
+static
+uint32_t
+buddy_alloc(unsigned order)
+{
+	unsigned k;
+	uint32_t f;
+
+	for (k=order; k<COREMAP_NORDERS; k++) {
+		if (cm_freelist[k] != CM_NONE) {
+			break;
+		}
+	}
+	if (k == COREMAP_NORDERS) {
+		return CM_NONE;
+	}
+
+	f = cm_freelist[k];
+	buddy_remove(f);
+	while (k > order) {
+		k--;
+		buddy_insert(f + (1U << k), k);
+	}
+	return f;
+}
+
+/*
+ * Free N frames starting at F, as the largest aligned blocks that
+ * fit.
+ */
+static
+void
+buddy_freerange(uint32_t f, uint32_t n)
+{
+	unsigned order;
+
+	while (n > 0) {
+		order = 0;
+		while (order < COREMAP_NORDERS - 1 &&
+		       f % (2U << order) == 0 && (2U << order) <= n) {
+			order++;
+		}
+		buddy_free(f, order);
+		f += 1U << order;
+		n -= 1U << order;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+/*
+ * Build the map. The map itself is allocated with ram_stealmem, after
+ * which ram_getfirstfree tells us where the fixed frames end.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t lastpaddr, firstpaddr;
+	size_t mapsize;
+	uint32_t f;
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&cm_pcpu[i].cp_lock);
+		cm_pcpu[i].cp_count = 0;
+	}
+	for (i=0; i<CM_NREFLOCKS; i++) {
+		spinlock_init(&cm_reflocks[i]);
+		cm_busywchans[i] = wchan_create("coremap");
+		if (cm_busywchans[i] == NULL) {
+			panic("coremap: no memory for wait channels\n");
+		}
+	}
+	pcounter_register(&cm_cachehits);
+	pcounter_register(&cm_cachemisses);
+	pcounter_register(&cm_zerohits);
+	pcounter_register(&cm_zerofills);
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(!cm_ready);
+
+	lastpaddr = ram_getsize();
+	cm_nframes = lastpaddr / PAGE_SIZE;
+	mapsize = cm_nframes * sizeof(struct coremap_entry);
+	mapsize = (mapsize + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	firstpaddr = ram_stealmem(mapsize);
+	if (firstpaddr == 0) {
+		panic("coremap: no memory for %u frames\n", cm_nframes);
+	}
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(firstpaddr);
+
+	firstpaddr = ram_getfirstfree();
+	KASSERT(firstpaddr % PAGE_SIZE == 0);
+	cm_firstframe = firstpaddr / PAGE_SIZE;
+
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		cm_freelist[i] = CM_NONE;
+		cm_nblocks[i] = 0;
+	}
+	cm_nfree = 0;
+	for (f=0; f<cm_nframes; f++) {
+		coremap[f].cme_state = f < cm_firstframe ?
+			CME_FIXED : CME_INTERIOR;
+		coremap[f].cme_order = 0;
+		coremap[f].cme_npages = 0;
+		coremap[f].cme_refs = 0;
+		coremap[f].cme_flags = 0;
+		coremap[f].cme_tag = 0;
+		coremap[f].cme_next = coremap[f].cme_prev = CM_NONE;
+	}
+	buddy_freerange(cm_firstframe, cm_nframes - cm_firstframe);
+	cm_hand = cm_firstframe;
+
+	cm_ready = true;
+	spinlock_release(&cm_lock);
+
+	kprintf("coremap: %u frames, %u free\n", cm_nframes, cm_nfree);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu caches
+
+/*
+ * Give a cache's pages back to the buddy lists, keeping KEEP. Call
+ * with the cache lock held.
+ */
+static
+void
+cm_pcpu_drain(struct cm_pcpu *cp, unsigned keep)
+{
+	spinlock_acquire(&cm_lock);
+	while (cp->cp_count > keep) {
+		cp->cp_count--;
+		buddy_free(cp->cp_frames[cp->cp_count], 0);
+	}
+	spinlock_release(&cm_lock);
+}
+
+static
+void
+cm_pcpu_drainall(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_acquire(&cm_pcpu[i].cp_lock);
+		if (cm_pcpu[i].cp_count > 0) {
+			cm_pcpu_drain(&cm_pcpu[i], 0);
+		}
+		spinlock_release(&cm_pcpu[i].cp_lock);
+	}
+}
+
+static
+uint32_t
+cm_pcpu_alloc(void)
+{
+	struct cm_pcpu *cp;
+	uint32_t f;
+	int s;
+
+	/* Stay on this cpu until we've chosen its cache. */
+	s = splhigh();
+	cp = &cm_pcpu[curcpu->c_number];
+	spinlock_acquire(&cp->cp_lock);
+	splx(s);
+
+	if (cp->cp_count > 0) {
+		pcounter_inc(&cm_cachehits);
+	}
+	else {
+		pcounter_inc(&cm_cachemisses);
+		spinlock_acquire(&cm_lock);
+		while (cp->cp_count < CM_PCPU_BATCH) {
+			f = buddy_alloc(0);
+			if (f == CM_NONE) {
+				break;
+			}
+			coremap[f].cme_state = CME_CACHED;
+			cp->cp_frames[cp->cp_count++] = f;
+		}
+		spinlock_release(&cm_lock);
+	}
+
+	f = CM_NONE;
+	if (cp->cp_count > 0) {
+		f = cp->cp_frames[--cp->cp_count];
+		KASSERT(coremap[f].cme_state == CME_CACHED);
+		/* The clock looks at allocated pages under this lock. */
+		spinlock_acquire(CM_REFLOCK(f));
+		coremap[f].cme_state = CME_HEAD;
+		coremap[f].cme_npages = 1;
+		coremap[f].cme_refs = 1;
+		coremap[f].cme_flags = 0;
+		coremap[f].cme_tag = 0;
+		coremap[f].cme_as = NULL;
+		coremap[f].cme_va = 0;
+		spinlock_release(CM_REFLOCK(f));
+	}
+	spinlock_release(&cp->cp_lock);
+	return f;
+}
+
+static
+void
+cm_pcpu_free(uint32_t f)
+{
+	struct cm_pcpu *cp;
+	int s;
+
+	s = splhigh();
+	cp = &cm_pcpu[curcpu->c_number];
+	spinlock_acquire(&cp->cp_lock);
+	splx(s);
+
+	if (cp->cp_count == CM_PCPU_SIZE) {
+		cm_pcpu_drain(cp, CM_PCPU_SIZE - CM_PCPU_BATCH);
+	}
+	coremap[f].cme_state = CME_CACHED;
+	coremap[f].cme_npages = 0;
+	cp->cp_frames[cp->cp_count++] = f;
+
+	spinlock_release(&cp->cp_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pre-zeroed pages
+
+/*
+ * Take a page out of the pool, or return CM_NONE if it's empty.
+ */
+static
+uint32_t
+cm_zeropop(void)
+{
+	uint32_t f;
+
+	f = CM_NONE;
+	spinlock_acquire(&cm_zerolock);
+	if (cm_nzero > 0) {
+		f = cm_zeroframes[--cm_nzero];
+	}
+	spinlock_release(&cm_zerolock);
+	return f;
+}
+
+/*
+ * Give the whole pool back.
+ */
+static
+void
+cm_zerodrain(void)
+{
+	uint32_t f;
+
+	while ((f = cm_zeropop()) != CM_NONE) {
+		coremap_free((paddr_t)f * PAGE_SIZE);
+	}
+}
+
+/*
+ * Get a page that's already zeroed, or 0 if there isn't one ready.
+ */
+paddr_t
+coremap_getzeroed(void)
+{
+	uint32_t f;
+
+	f = cm_zeropop();
+	if (f == CM_NONE) {
+		return 0;
+	}
+	pcounter_inc(&cm_zerohits);
+	return (paddr_t)f * PAGE_SIZE;
+}
+
+/*
+ * Zero one free page into the pool, if it's short of pages and memory
+ * isn't. Returns true if it did, in which case an idle cpu should
+ * check for work before going to sleep.
+ */
+bool
+coremap_idlezero(void)
+{
+	paddr_t pa;
+
+	/* Unlocked looks; it's only a guess whether to bother. */
+	if (!cm_ready || cm_nzero >= CM_ZEROPOOL || cm_nfree < CM_ZEROMINFREE) {
+		return false;
+	}
+
+	pa = coremap_alloc(1);
+	if (pa == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&cm_zerolock);
+	if (cm_nzero < CM_ZEROPOOL) {
+		cm_zeroframes[cm_nzero++] = pa / PAGE_SIZE;
+		pa = 0;
+	}
+	spinlock_release(&cm_zerolock);
+
+	if (pa != 0) {
+		/* Another cpu filled it first. */
+		coremap_free(pa);
+		return false;
+	}
+	pcounter_inc(&cm_zerofills);
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation
+
+/*
+ * Fallback for when no single block is big enough: look for a run of
+ * adjacent free blocks that together cover NPAGES, and take them off
+ * their lists. Linear in the size of memory. Returns the first frame,
+ * with any excess past NPAGES already given back.
+ */
+static
+uint32_t
+cm_findrun(unsigned npages)
+{
+	uint32_t f, start, len;
+
+	start = CM_NONE;
+	len = 0;
+	f = cm_firstframe;
+	while (f < cm_nframes && len < npages) {
+		if (coremap[f].cme_state == CME_FREE) {
+			if (start == CM_NONE) {
+				start = f;
+			}
+			len += 1U << coremap[f].cme_order;
+			f += 1U << coremap[f].cme_order;
+		}
+		else {
+			start = CM_NONE;
+			len = 0;
+			f += coremap[f].cme_state == CME_HEAD ?
+				coremap[f].cme_npages : 1;
+		}
+	}
+	if (len < npages) {
+		return CM_NONE;
+	}
+
+	for (f=start; f<start+len; f += 1U << coremap[f].cme_order) {
+		buddy_remove(f);
+	}
+	if (len > npages) {
+		buddy_freerange(start + npages, len - npages);
+	}
+	return start;
+}
+
+static
+uint32_t
+cm_allocrun(unsigned npages)
+{
+	unsigned order;
+	uint32_t first, f;
+
+	order = 0;
+	while (order < COREMAP_NORDERS && (1U << order) < npages) {
+		order++;
+	}
+
+	spinlock_acquire(&cm_lock);
+	first = CM_NONE;
+	if (order < COREMAP_NORDERS) {
+		first = buddy_alloc(order);
+		if (first != CM_NONE && (1U << order) > npages) {
+			buddy_freerange(first + npages, (1U << order) - npages);
+		}
+	}
+	if (first == CM_NONE) {
+		first = cm_findrun(npages);
+	}
+	if (first == CM_NONE) {
+		spinlock_release(&cm_lock);
+		return CM_NONE;
+	}
+	for (f=first; f<first+npages; f++) {
+		coremap[f].cme_state = CME_USED;
+	}
+	spinlock_acquire(CM_REFLOCK(first));
+	coremap[first].cme_state = CME_HEAD;
+	coremap[first].cme_npages = npages;
+	coremap[first].cme_refs = 1;
+	coremap[first].cme_flags = 0;
+	coremap[first].cme_tag = 0;
+	coremap[first].cme_as = NULL;
+	coremap[first].cme_va = 0;
+	spinlock_release(CM_REFLOCK(first));
+	spinlock_release(&cm_lock);
+
+	return first;
+}
+
+paddr_t
+coremap_alloc(unsigned npages)
+{
+	uint32_t first;
+	paddr_t pa;
+
+	KASSERT(npages > 0);
+
+	if (!cm_ready) {
+		spinlock_acquire(&cm_lock);
+		if (!cm_ready) {
+			pa = ram_stealmem(npages);
+			spinlock_release(&cm_lock);
+			return pa;
+		}
+		spinlock_release(&cm_lock);
+	}
+
+	if (npages == 1) {
+		first = cm_pcpu_alloc();
+		if (first == CM_NONE) {
+			/* Zeroed or not, it's a page. */
+			first = cm_zeropop();
+		}
+		if (first == CM_NONE) {
+			/* Other cpus' caches may still hold some. */
+			cm_pcpu_drainall();
+			first = cm_allocrun(1);
+		}
+	}
+	else {
+		first = cm_allocrun(npages);
+		if (first == CM_NONE) {
+			cm_pcpu_drainall();
+			cm_zerodrain();
+			first = cm_allocrun(npages);
+		}
+	}
+	if (first == CM_NONE) {
+		return 0;
+	}
+	return (paddr_t)first * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t pa)
+{
+	uint32_t first, f, npages;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	first = pa / PAGE_SIZE;
+
+	if (!cm_ready || first < cm_firstframe) {
+		/* Stolen before the coremap existed; we can't take it back. */
+		return;
+	}
+
+	KASSERT(first < cm_nframes);
+	if (coremap[first].cme_state != CME_HEAD) {
+		panic("coremap_free: 0x%x is not an allocated run\n", pa);
+	}
+
+	spinlock_acquire(CM_REFLOCK(first));
+	while (coremap[first].cme_flags & CMF_BUSY) {
+		/* Only user pages get busy, and their owners can sleep. */
+		wchan_sleep(CM_BUSYWCHAN(first), CM_REFLOCK(first));
+	}
+	KASSERT(coremap[first].cme_refs > 0);
+	coremap[first].cme_refs--;
+	if (coremap[first].cme_refs > 0) {
+		spinlock_release(CM_REFLOCK(first));
+		return;
+	}
+	coremap[first].cme_as = NULL;
+	coremap[first].cme_flags = 0;
+	spinlock_release(CM_REFLOCK(first));
+
+	npages = coremap[first].cme_npages;
+	if (npages == 1) {
+		cm_pcpu_free(first);
+		return;
+	}
+
+	KASSERT(first + npages <= cm_nframes);
+	spinlock_acquire(&cm_lock);
+	for (f=first; f<first+npages; f++) {
+		KASSERT(f == first || coremap[f].cme_state == CME_USED);
+		coremap[f].cme_state = CME_INTERIOR;
+	}
+	coremap[first].cme_npages = 0;
+	buddy_freerange(first, npages);
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Add a reference to the single page at PA, which must already be
+ * allocated. Each reference needs its own coremap_free.
+ */
+void
+coremap_share(paddr_t pa)
+{
+	uint32_t f;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	f = pa / PAGE_SIZE;
+	KASSERT(cm_ready && f >= cm_firstframe && f < cm_nframes);
+
+	spinlock_acquire(CM_REFLOCK(f));
+	KASSERT(coremap[f].cme_state == CME_HEAD);
+	KASSERT(coremap[f].cme_npages == 1);
+	KASSERT(coremap[f].cme_refs > 0 && coremap[f].cme_refs < 0xffff);
+	coremap[f].cme_refs++;
+	/* Nobody owns it alone any more. */
+	coremap[f].cme_as = NULL;
+	spinlock_release(CM_REFLOCK(f));
+}
+
+/*
+ * How many references PA has. Only a hint unless the caller holds
+ * something that keeps the count from changing; in particular, a
+ * count of 1 seen by the only owner stays 1.
+ */
+unsigned
+coremap_refcount(paddr_t pa)
+{
+	uint32_t f;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	f = pa / PAGE_SIZE;
+	KASSERT(cm_ready && f >= cm_firstframe && f < cm_nframes);
+	return coremap[f].cme_refs;
+}
+
+/*
+ * Set the tag on the page at PA, which the caller must have allocated.
+ * Pages that came from ram_stealmem have nowhere to keep one, so for
+ * them this does nothing and coremap_gettag always returns 0.
+ */
+void
+coremap_settag(paddr_t pa, unsigned tag)
+{
+	uint32_t f;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	KASSERT(tag <= 0xff);
+	f = pa / PAGE_SIZE;
+	if (!cm_ready || f < cm_firstframe) {
+		return;
+	}
+	KASSERT(f < cm_nframes && coremap[f].cme_state == CME_HEAD);
+	coremap[f].cme_tag = tag;
+}
+
+/*
+ * Return the tag of the page PA is on. For any page but an allocated
+ * one that the caller knows the owner tagged, this is only good for
+ * telling that the page isn't one of the caller's (a 0).
+ */
+unsigned
+coremap_gettag(paddr_t pa)
+{
+	uint32_t f;
+
+	f = pa / PAGE_SIZE;
+	if (!cm_ready || f < cm_firstframe || f >= cm_nframes) {
+		return 0;
+	}
+	if (coremap[f].cme_state != CME_HEAD) {
+		return 0;
+	}
+	return coremap[f].cme_tag;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Page replacement
+
+/*
+ * AS has just used the page at PA, which it maps at VA. Sets the
+ * referenced bit, and if AS is the only one with the page, makes it
+ * the owner.
+ */
+void
+coremap_touch(paddr_t pa, struct addrspace *as, vaddr_t va)
+{
+	struct coremap_entry *e;
+	uint32_t f;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	f = pa / PAGE_SIZE;
+	KASSERT(cm_ready && f >= cm_firstframe && f < cm_nframes);
+	e = &coremap[f];
+
+	spinlock_acquire(CM_REFLOCK(f));
+	KASSERT(e->cme_state == CME_HEAD && e->cme_npages == 1);
+	e->cme_flags |= CMF_REF;
+	if (e->cme_refs == 1 && e->cme_as == NULL) {
+		e->cme_as = as;
+		e->cme_va = va;
+	}
+	spinlock_release(CM_REFLOCK(f));
+}
+
+/*
+ * Advance the clock to an owned page that hasn't been used since it
+ * last came by, mark it busy, and return it and its owner. Gives up
+ * after going round twice (the first time may just clear bits).
+ * Called by the pager only.
+ */
+int
+coremap_pickvictim(paddr_t *pa, struct addrspace **as, vaddr_t *va)
+{
+	struct coremap_entry *e;
+	uint32_t f, n;
+
+	for (n = 0; n < 2 * (cm_nframes - cm_firstframe); n++) {
+		f = cm_hand++;
+		if (cm_hand == cm_nframes) {
+			cm_hand = cm_firstframe;
+		}
+		e = &coremap[f];
+
+		spinlock_acquire(CM_REFLOCK(f));
+		if (e->cme_state != CME_HEAD || e->cme_npages != 1 ||
+		    e->cme_refs != 1 || e->cme_as == NULL ||
+		    (e->cme_flags & CMF_BUSY)) {
+			spinlock_release(CM_REFLOCK(f));
+			continue;
+		}
+		if (e->cme_flags & CMF_REF) {
+			e->cme_flags &= ~CMF_REF;
+			spinlock_release(CM_REFLOCK(f));
+			continue;
+		}
+		e->cme_flags |= CMF_BUSY;
+		*pa = (paddr_t)f * PAGE_SIZE;
+		*as = e->cme_as;
+		*va = e->cme_va;
+		spinlock_release(CM_REFLOCK(f));
+		return 0;
+	}
+	return ENOMEM;
+}
+
+/*
+ * Mark the page at PA busy if AS owns it at VA and it isn't in use,
+ * for paging out alongside a chosen victim. Returns true if it did.
+ */
+bool
+coremap_trybusy(paddr_t pa, struct addrspace *as, vaddr_t va)
+{
+	struct coremap_entry *e;
+	uint32_t f;
+	bool ret;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	f = pa / PAGE_SIZE;
+	KASSERT(cm_ready && f >= cm_firstframe && f < cm_nframes);
+	e = &coremap[f];
+
+	spinlock_acquire(CM_REFLOCK(f));
+	ret = e->cme_state == CME_HEAD && e->cme_npages == 1 &&
+		e->cme_refs == 1 && e->cme_as == as && e->cme_va == va &&
+		(e->cme_flags & (CMF_BUSY | CMF_REF)) == 0;
+	if (ret) {
+		e->cme_flags |= CMF_BUSY;
+	}
+	spinlock_release(CM_REFLOCK(f));
+	return ret;
+}
+
+void
+coremap_unbusy(paddr_t pa)
+{
+	uint32_t f;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+	f = pa / PAGE_SIZE;
+	KASSERT(cm_ready && f >= cm_firstframe && f < cm_nframes);
+
+	spinlock_acquire(CM_REFLOCK(f));
+	KASSERT(coremap[f].cme_flags & CMF_BUSY);
+	coremap[f].cme_flags &= ~CMF_BUSY;
+	wchan_wakeall(CM_BUSYWCHAN(f), CM_REFLOCK(f));
+	spinlock_release(CM_REFLOCK(f));
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+/*
+ * Roughly how many frames are free, without taking any locks. Pages
+ * in the per-cpu caches aren't counted, so this errs low.
+ */
+unsigned
+coremap_nfree(void)
+{
+	return cm_ready ? cm_nfree : 0;
+}
+
+void
+coremap_getstats(struct coremap_stats *cs)
+{
+	unsigned i;
+
+	bzero(cs, sizeof(*cs));
+	if (!cm_ready) {
+		return;
+	}
+
+	spinlock_acquire(&cm_lock);
+	/*
+	 * Holding cm_lock keeps pages from moving between the caches
+	 * and the buddy lists, but not in and out of the caches, so
+	 * the cache counts are only a guide.
+	 */
+	for (i=0; i<MAXCPUS; i++) {
+		cs->cs_cached += cm_pcpu[i].cp_count;
+	}
+	cs->cs_total = cm_nframes;
+	cs->cs_fixed = cm_firstframe;
+	cs->cs_free = cm_nfree + cs->cs_cached;
+	if (cs->cs_free > cm_nframes - cm_firstframe) {
+		cs->cs_free = cm_nframes - cm_firstframe;
+	}
+	cs->cs_used = cm_nframes - cm_firstframe - cs->cs_free;
+	cs->cs_zeroed = cm_nzero;
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		cs->cs_nblocks[i] = cm_nblocks[i];
+		if (cm_nblocks[i] > 0) {
+			cs->cs_largestrun = 1U << i;
+		}
+	}
+	spinlock_release(&cm_lock);
+}
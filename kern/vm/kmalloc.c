@@ -29,8 +29,17 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
+#include <slab.h>
+#include <pagecache.h>
+#include <pcounter.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -102,6 +111,12 @@ fill_deadbeef(void *vptr, size_t len)
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
  *
+ * SITES counts allocations, bytes, and live objects for each place
+ * kmalloc is called from; khsites prints the busiest. It costs an
+ * 8-byte header on each subpage block, an unlocked hash lookup per
+ * kmalloc, and a few counter updates with interrupts off, so it's
+ * cheap enough to leave on in a staging kernel.
+ *
  * On top of these one can enable the following:
  *
  * CHECKBEEF checks that free blocks still contain 0xdeadbeef when
@@ -117,6 +132,7 @@ fill_deadbeef(void *vptr, size_t len)
 #undef SLOWER
 #undef GUARDS
 #undef LABELS
+#undef SITES
 
 #undef CHECKBEEF
 #undef CHECKGUARDS
@@ -160,10 +176,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the heap pages and their accounting. Most
+ * kmalloc and kfree calls don't need it; they're handled by the
+ * per-cpu magazines below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -347,6 +362,59 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each block size, a small stack (a "magazine")
+ * of free blocks that it hands out and takes back without touching
+ * kmalloc_spinlock. An empty magazine is refilled from the pages of
+ * that size, and a full one drained back to them, half a magazine at
+ * a time, so the global lock is taken once per batch instead of once
+ * per block.
+ *
+ * Blocks in a magazine still count as allocated on their pages, so a
+ * page with blocks cached anywhere is never released. To keep that
+ * from tying up much memory, magazines for the bigger sizes hold
+ * fewer blocks (at most half a page's worth), and when memory runs
+ * out all the magazines are emptied.
+ *
+ * kfree needs the size of a block to pick the magazine; for this,
+ * subpage pages are tagged in the coremap with CMTAG_KMALLOC plus
+ * their block type. Pages kmalloc got before the coremap existed
+ * have no tag, and blocks on them go straight back to their page,
+ * found by searching.
+ *
+ * Magazines are off until kheap_bootstrap, which runs once the
+ * coremap is up. CHECKGUARDS expects every block that isn't on its
+ * page's free list to have guard bands, which blocks in a magazine
+ * don't, so with CHECKGUARDS the magazines stay off.
+ *
+ * Lock order: a magazine lock, then kmalloc_spinlock.
+ */
+
+#define KM_MAGSIZE	16	/* Most blocks in any magazine */
+
+struct km_magazine {
+	unsigned km_count;
+	void *km_blocks[KM_MAGSIZE];
+};
+
+struct km_pcpu {
+	struct spinlock kp_lock;
+	struct km_magazine kp_mags[NSIZES];
+};
+
+static struct km_pcpu km_pcpu[MAXCPUS];
+static bool km_ready;
+
+static struct pcounter km_maghits = PCOUNTER_INITIALIZER("kmalloc_maghits");
+static struct pcounter km_magmisses =
+	PCOUNTER_INITIALIZER("kmalloc_magmisses");
+static struct pcounter km_magdrains =
+	PCOUNTER_INITIALIZER("kmalloc_magdrains");
+
+////////////////////////////////////////
+
 #ifdef GUARDS
 
 /* Space returned to the client is filled with GUARD_RETBYTE */
@@ -697,6 +765,310 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+////////////////////////////////////////
+
+#ifdef SITES
+
+/*
+ * Allocation sites.
+ *
+ * Each place kmalloc is called from gets a slot in km_sites, found
+ * by hashing its return address. Slots are claimed under km_sitelock
+ * and never given back, so finding one takes no lock. Slot 0 collects
+ * the sites that couldn't get a slot of their own.
+ *
+ * The counts are per cpu and only touched with interrupts off, so
+ * they need no lock either. A subpage block starts with the slot of
+ * the site that allocated it, for kfree to count it freed; a
+ * multi-page block has no room for that, so it carries the slot in
+ * its coremap tag instead.
+ *
+ * Counting starts at kheap_bootstrap. Rates are over the time since
+ * then, or since the last kheap_resetsites.
+ */
+
+#define KM_NSITES	127	/* tags CMTAG_KMSITE+0 to +126 */
+#define KM_SITEPROBES	8	/* slots tried before using slot 0 */
+#define KM_NOSITE	0xffffffff	/* not counted */
+
+#define SITE_PTROFFSET sizeof(struct sitelabel)
+#define SITE_OVERHEAD SITE_PTROFFSET
+
+struct sitelabel {
+	uint32_t sl_site;
+	uint32_t sl_unused;	/* keeps the client's block 8-aligned */
+};
+
+struct km_sitecount {
+	uint64_t sc_bytes;
+	uint32_t sc_allocs;
+	uint32_t sc_frees;
+};
+
+static vaddr_t km_sites[KM_NSITES];
+static struct spinlock km_sitelock = SPINLOCK_INITIALIZER;
+static struct km_sitecount km_sitecounts[MAXCPUS][KM_NSITES];
+static bool km_sitesready;
+
+/* Totals when the current window started. */
+static struct timespec km_sitestart;
+static uint64_t km_sitebytes0[KM_NSITES];
+static uint32_t km_siteallocs0[KM_NSITES];
+
+/*
+ * Find the slot for the site at address CALLER, claiming one if it
+ * doesn't have one yet.
+ */
+static
+unsigned
+site_lookup(vaddr_t caller)
+{
+	unsigned hash, i, slot;
+
+	hash = ((uint32_t)caller >> 2) * 2654435761U;
+	hash = (hash >> 16) % (KM_NSITES - 1);
+
+	for (i=0; i<KM_SITEPROBES; i++) {
+		slot = 1 + (hash + i) % (KM_NSITES - 1);
+		if (km_sites[slot] == caller) {
+			return slot;
+		}
+		if (km_sites[slot] == 0) {
+			break;
+		}
+	}
+
+	spinlock_acquire(&km_sitelock);
+	for (; i<KM_SITEPROBES; i++) {
+		slot = 1 + (hash + i) % (KM_NSITES - 1);
+		if (km_sites[slot] == 0) {
+			km_sites[slot] = caller;
+		}
+		if (km_sites[slot] == caller) {
+			spinlock_release(&km_sitelock);
+			return slot;
+		}
+	}
+	spinlock_release(&km_sitelock);
+	return 0;
+}
+
+/*
+ * Count an allocation of SZ bytes, or a free, at SITE.
+ */
+static
+void
+site_count(unsigned site, size_t sz, bool alloc)
+{
+	struct km_sitecount *sc;
+	int spl;
+
+	if (site >= KM_NSITES) {
+		return;
+	}
+
+	spl = splhigh();
+	sc = &km_sitecounts[curcpu->c_number][site];
+	if (alloc) {
+		sc->sc_allocs++;
+		sc->sc_bytes += sz;
+	}
+	else {
+		sc->sc_frees++;
+	}
+	splx(spl);
+}
+
+/*
+ * Label a block of SZ bytes with the site that allocated it.
+ */
+static
+void *
+establishsite(void *block, unsigned site, size_t sz)
+{
+	struct sitelabel *sl;
+
+	sl = block;
+	sl->sl_site = site;
+	sl->sl_unused = 0;
+	site_count(site, sz, true);
+	return sl + 1;
+}
+
+/*
+ * Count a subpage block freed, given what the caller passed to kfree,
+ * and return the block under the label.
+ */
+static
+void *
+retiresite(void *ptr)
+{
+	struct sitelabel *sl;
+
+	sl = (struct sitelabel *)ptr - 1;
+	site_count(sl->sl_site, 0, false);
+	return sl;
+}
+
+/*
+ * Tag a multi-page block at ADDRESS with the site that allocated it.
+ */
+static
+void
+establishsite_pages(vaddr_t address, unsigned site, size_t sz)
+{
+	if (site == KM_NOSITE) {
+		return;
+	}
+	coremap_settag(KVADDR_TO_PADDR(address), CMTAG_KMSITE + site);
+	site_count(site, sz, true);
+}
+
+/*
+ * Count a multi-page block freed.
+ */
+static
+void
+retiresite_pages(vaddr_t address)
+{
+	unsigned tag;
+
+	tag = coremap_gettag(KVADDR_TO_PADDR(address));
+	if (tag >= CMTAG_KMSITE && tag < CMTAG_KMSITE + KM_NSITES) {
+		site_count(tag - CMTAG_KMSITE, 0, false);
+	}
+}
+
+/*
+ * Add up SITE's counts over all cpus. Without any locks, so this can
+ * be a little behind.
+ */
+static
+void
+site_total(unsigned site, struct km_sitecount *total)
+{
+	unsigned i;
+
+	total->sc_bytes = 0;
+	total->sc_allocs = 0;
+	total->sc_frees = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		total->sc_bytes += km_sitecounts[i][site].sc_bytes;
+		total->sc_allocs += km_sitecounts[i][site].sc_allocs;
+		total->sc_frees += km_sitecounts[i][site].sc_frees;
+	}
+}
+
+static
+void
+site_start(void)
+{
+	struct km_sitecount total;
+	unsigned i;
+
+	for (i=0; i<KM_NSITES; i++) {
+		site_total(i, &total);
+		km_sitebytes0[i] = total.sc_bytes;
+		km_siteallocs0[i] = total.sc_allocs;
+	}
+	gettime(&km_sitestart);
+}
+
+/*
+ * Print the MAX sites that allocated the most in the current window.
+ */
+static
+void
+site_print(unsigned max)
+{
+	struct timespec now;
+	struct km_sitecount total;
+	uint64_t ms;
+	uint32_t allocs, best;
+	unsigned i, n, bestsite;
+	bool shown[KM_NSITES];
+
+	gettime(&now);
+	timespec_sub(&now, &km_sitestart, &now);
+	ms = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+
+	kprintf("kmalloc call sites over the last %llu.%03llu seconds:\n",
+		(unsigned long long)(ms / 1000),
+		(unsigned long long)(ms % 1000));
+	kprintf("    site            allocs    per sec         bytes"
+		"      live\n");
+
+	for (i=0; i<KM_NSITES; i++) {
+		shown[i] = false;
+	}
+	for (n=0; n<max; n++) {
+		best = 0;
+		bestsite = KM_NSITES;
+		for (i=0; i<KM_NSITES; i++) {
+			if (shown[i]) {
+				continue;
+			}
+			site_total(i, &total);
+			allocs = total.sc_allocs - km_siteallocs0[i];
+			if (allocs > best) {
+				best = allocs;
+				bestsite = i;
+			}
+		}
+		if (bestsite == KM_NSITES) {
+			break;
+		}
+		shown[bestsite] = true;
+
+		site_total(bestsite, &total);
+		if (bestsite == 0) {
+			kprintf("    (others)  ");
+		}
+		else {
+			kprintf("    0x%08lx",
+				(unsigned long)km_sites[bestsite]);
+		}
+		kprintf(" %10u %10llu %13llu %9d\n", best,
+			(unsigned long long)(best * 1000ULL / ms),
+			(unsigned long long)
+			(total.sc_bytes - km_sitebytes0[bestsite]),
+			(int)(total.sc_allocs - total.sc_frees));
+	}
+	if (n == 0) {
+		kprintf("    (none)\n");
+	}
+}
+
+#else
+
+#define SITE_OVERHEAD 0
+
+#endif /* SITES */
+
+void
+kheap_printsites(unsigned max)
+{
+#ifdef SITES
+	site_print(max);
+#else
+	(void)max;
+	kprintf("Enable SITES in kmalloc.c to use this functionality.\n");
+#endif
+}
+
+void
+kheap_resetsites(void)
+{
+#ifdef SITES
+	site_start();
+#else
+	kprintf("Enable SITES in kmalloc.c to use this functionality.\n");
+#endif
+}
+
 void
 kheap_nextgeneration(void)
 {
@@ -801,6 +1173,34 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct coremap_stats cs;
+	unsigned i, j, nblocks, nbytes;
+
+	/* Get this first; the coremap has its own lock. */
+	coremap_getstats(&cs);
+	kprintf("Physical pages: %u total, %u fixed, %u used (%u pre-zeroed), "
+		"%u free (%u cached per-cpu)\n", cs.cs_total, cs.cs_fixed,
+		cs.cs_used, cs.cs_zeroed, cs.cs_free, cs.cs_cached);
+	kprintf("Free blocks by order (largest %u pages):\n   ",
+		cs.cs_largestrun);
+	for (i=0; i<COREMAP_NORDERS; i++) {
+		kprintf(" %u:%u", i, cs.cs_nblocks[i]);
+	}
+	kprintf("\n");
+
+	/* Without the magazine locks, so this is only a guide. */
+	nblocks = nbytes = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			nblocks += km_pcpu[i].kp_mags[j].km_count;
+			nbytes += km_pcpu[i].kp_mags[j].km_count * sizes[j];
+		}
+	}
+	kprintf("Per-cpu magazines: %u blocks (%u bytes) cached\n",
+		nblocks, nbytes);
+
+	kmem_cache_printstats();
+	pagecache_printstats();
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -867,66 +1267,37 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take up to N free blocks of type BLKTYPE off the pages of that size
+ * and put them in BLOCKS. Returns how many it got. Call with
+ * kmalloc_spinlock held.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+unsigned
+subpage_takeblocks(unsigned blktype, void **blocks, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
-
-	volatile int i;
-
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
+	struct freelist *fl;	// free list entry
+	unsigned got;
 
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	got = 0;
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
+		while (pr->nfree > 0 && got < n) {
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
+			blocks[got++] = fl;
 			fl = fl->next;
 			pr->nfree--;
 
@@ -940,59 +1311,355 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
+	return got;
+}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
-
-	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
-	if (prpage==0) {
-		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
-	}
-	KASSERT(prpage % PAGE_SIZE == 0);
-#ifdef CHECKBEEF
-	/* deadbeef the whole page, as it probably starts zeroed */
-	fill_deadbeef((void *)prpage, PAGE_SIZE);
-#endif
-	spinlock_acquire(&kmalloc_spinlock);
+/*
+ * Put the block at PTRADDR, of type BLKTYPE, back on its page. If
+ * that leaves the page entirely free, take the page out of the heap
+ * and return its address, for the caller to free_kpages once it's let
+ * go of kmalloc_spinlock; otherwise return 0.
+ */
+static
+vaddr_t
+subpage_putblock(vaddr_t ptraddr, unsigned blktype)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
-	}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
+	prpage = 0;
 
 	/*
-	 * Note: fl is volatile because the MIPS toolchain we were
-	 * using in spring 2001 attempted to optimize this loop and
-	 * blew it. Making fl volatile inhibits the optimization.
+	 * No checksubpage here: the block being freed is already
+	 * deadbeef but not yet on the free list, which confuses it.
+	 */
+	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+
+		prpage = PR_PAGEADDR(pr);
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			break;
+		}
+	}
+	if (pr == NULL) {
+		panic("kfree: %p is not on a heap page of size %zu\n",
+		      (void *)ptraddr, sizes[blktype]);
+	}
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = ptraddr - prpage;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+
+/*
+ * How many blocks of type BLKTYPE a magazine holds.
+ */
+static
+inline
+unsigned
+kmag_limit(unsigned blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / sizes[blktype] / 2;
+	return n < KM_MAGSIZE ? n : KM_MAGSIZE;
+}
+
+/*
+ * Lock this cpu's magazines and return them.
+ */
+static
+struct km_pcpu *
+kmag_lock(void)
+{
+	struct km_pcpu *kp;
+	int s;
+
+	/* Stay on this cpu until we've chosen its magazines. */
+	s = splhigh();
+	kp = &km_pcpu[curcpu->c_number];
+	spinlock_acquire(&kp->kp_lock);
+	splx(s);
+	return kp;
+}
+
+/*
+ * Give blocks of type BLKTYPE from MAG back to their pages until only
+ * KEEP are left. Call with the magazine's lock held. The addresses of
+ * pages that end up free go in FREEPAGES, which must have room for a
+ * whole magazine, and their number is returned; the caller frees them
+ * once it's let go of the magazine.
+ */
+static
+unsigned
+kmag_drain(struct km_magazine *mag, unsigned blktype, unsigned keep,
+	   vaddr_t *freepages)
+{
+	vaddr_t prpage;
+	unsigned nfree;
+
+	nfree = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	while (mag->km_count > keep) {
+		mag->km_count--;
+		prpage = subpage_putblock((vaddr_t)mag->km_blocks[mag->km_count],
+					  blktype);
+		if (prpage != 0) {
+			freepages[nfree++] = prpage;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return nfree;
+}
+
+/*
+ * Empty every cpu's magazines, so that any heap pages they were
+ * keeping from being freed are. Used when memory runs out.
+ */
+static
+void
+kmag_drainall(void)
+{
+	struct km_pcpu *kp;
+	vaddr_t freepages[KM_MAGSIZE];
+	unsigned i, j, k, nfree;
+
+	if (!km_ready) {
+		return;
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		kp = &km_pcpu[i];
+		for (j=0; j<NSIZES; j++) {
+			nfree = 0;
+			spinlock_acquire(&kp->kp_lock);
+			if (kp->kp_mags[j].km_count > 0) {
+				nfree = kmag_drain(&kp->kp_mags[j], j, 0,
+						   freepages);
+			}
+			spinlock_release(&kp->kp_lock);
+			for (k=0; k<nfree; k++) {
+				free_kpages(freepages[k]);
+			}
+		}
+	}
+}
+
+/*
+ * Get a block of type BLKTYPE from this cpu's magazine, refilling it
+ * from the heap pages if it's empty. Returns NULL if the pages have
+ * no free blocks either.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct km_pcpu *kp;
+	struct km_magazine *mag;
+	void *block;
+
+	KASSERT(km_ready);
+
+	kp = kmag_lock();
+	mag = &kp->kp_mags[blktype];
+	if (mag->km_count > 0) {
+		pcounter_inc(&km_maghits);
+	}
+	else {
+		pcounter_inc(&km_magmisses);
+		spinlock_acquire(&kmalloc_spinlock);
+		mag->km_count = subpage_takeblocks(blktype, mag->km_blocks,
+					   (kmag_limit(blktype) + 1) / 2);
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	block = NULL;
+	if (mag->km_count > 0) {
+		block = mag->km_blocks[--mag->km_count];
+	}
+	spinlock_release(&kp->kp_lock);
+	return block;
+}
+
+/*
+ * Put BLOCK, of type BLKTYPE, in this cpu's magazine, draining half
+ * of it first if it's full.
+ */
+static
+void
+kmag_free(void *block, unsigned blktype)
+{
+	struct km_pcpu *kp;
+	struct km_magazine *mag;
+	vaddr_t freepages[KM_MAGSIZE];
+	unsigned limit, nfree, i;
+
+	KASSERT(km_ready);
+
+	limit = kmag_limit(blktype);
+	kp = kmag_lock();
+	mag = &kp->kp_mags[blktype];
+#ifdef SLOW
+	/* this block should not already be in the magazine! */
+	for (i=0; i<mag->km_count; i++) {
+		KASSERT(mag->km_blocks[i] != block);
+	}
+#endif
+	nfree = 0;
+	if (mag->km_count >= limit) {
+		pcounter_inc(&km_magdrains);
+		nfree = kmag_drain(mag, blktype, limit - (limit + 1) / 2,
+				   freepages);
+	}
+	mag->km_blocks[mag->km_count++] = block;
+	spinlock_release(&kp->kp_lock);
+
+	/* Call free_kpages without any of our spinlocks. */
+	for (i=0; i<nfree; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Start the magazines. Pages are only tagged once the coremap is up,
+ * so this must come after vm_bootstrap.
+ */
+void
+kheap_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&km_pcpu[i].kp_lock);
+	}
+	pcounter_register(&km_maghits);
+	pcounter_register(&km_magmisses);
+	pcounter_register(&km_magdrains);
+#ifndef CHECKGUARDS
+	km_ready = true;
+#endif
+#ifdef SITES
+	site_start();
+	km_sitesready = true;
+#endif
+}
+
+////////////////////////////////////////
+
+/*
+ * Get a block of type BLKTYPE from the heap pages, starting a new
+ * page if none of them has one free. Call with kmalloc_spinlock held;
+ * it's dropped while getting the page.
+ */
+static
+void *
+subpage_allocblock(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (subpage_takeblocks(blktype, &retptr, 1) == 1) {
+		return retptr;
+	}
+
+	/*
+	 * No page of the right size available.
+	 * Make a new one.
+	 *
+	 * We release the spinlock while calling alloc_kpages. This
+	 * avoids deadlock if alloc_kpages needs to come back here.
+	 * Note that this means things can change behind our back...
+	 */
+
+	spinlock_release(&kmalloc_spinlock);
+	prpage = alloc_kpages(1);
+	if (prpage==0) {
+		/* See if the magazines or caches can spare a page. */
+		kmag_drainall();
+		kmem_cache_reap();
+		prpage = alloc_kpages(1);
+	}
+	if (prpage==0) {
+		/* Out of memory. */
+		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		spinlock_acquire(&kmalloc_spinlock);
+		return NULL;
+	}
+	KASSERT(prpage % PAGE_SIZE == 0);
+#ifdef CHECKBEEF
+	/* deadbeef the whole page, as it probably starts zeroed */
+	fill_deadbeef((void *)prpage, PAGE_SIZE);
+#endif
+	/* The page is still only ours, so this needs no lock. */
+	coremap_settag(KVADDR_TO_PADDR(prpage), CMTAG_KMALLOC + blktype);
+	spinlock_acquire(&kmalloc_spinlock);
+
+	pr = allocpageref();
+	if (pr==NULL) {
+		/* Couldn't allocate accounting space for the new page. */
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
+		spinlock_acquire(&kmalloc_spinlock);
+		return NULL;
+	}
+
+	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
+	pr->nfree = PAGE_SIZE / sizes[blktype];
+
+	/*
+	 * Note: fl is volatile because the MIPS toolchain we were
+	 * using in spring 2001 attempted to optimize this loop and
+	 * blew it. Making fl volatile inhibits the optimization.
 	 */
 
 	fla = prpage;
@@ -1013,8 +1680,113 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	if (subpage_takeblocks(blktype, &retptr, 1) != 1) {
+		panic("kmalloc: fresh heap page has no free blocks\n");
+	}
+	return retptr;
+}
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+	bool locked;		// whether we have kmalloc_spinlock
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	retptr = NULL;
+	locked = false;
+	if (km_ready) {
+		retptr = kmag_alloc(blktype);
+	}
+	if (retptr == NULL) {
+		/*
+		 * Straight from the pages, the block gets its guard
+		 * bands before anyone else can check the page.
+		 */
+		spinlock_acquire(&kmalloc_spinlock);
+		locked = true;
+
+		checksubpages();
+
+		retptr = subpage_allocblock(blktype);
+		if (retptr == NULL) {
+			spinlock_release(&kmalloc_spinlock);
+			return NULL;
+		}
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	if (locked) {
+		checksubpages();
+
+		spinlock_release(&kmalloc_spinlock);
+	}
+	return retptr;
+}
+
+/*
+ * Check a block of type BLKTYPE at PTRADDR that's being freed, and
+ * deadbeef it. PTR is what the caller passed to kfree.
+ */
+static
+void
+subpage_retire(void *ptr, vaddr_t ptraddr, int blktype)
+{
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	/* Check for proper positioning and alignment */
+	if ((ptraddr % PAGE_SIZE) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+#ifdef GUARDS
+	blocksize = sizes[blktype];
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 }
 
 /*
@@ -1029,12 +1801,7 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
+	unsigned tag;		// our coremap tag for the page
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1061,94 +1828,64 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
+	/*
+	 * Pages from after the coremap came up carry their block type
+	 * in their tag, and their blocks can go in a magazine.
+	 */
+	tag = coremap_gettag(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME));
+	if (tag == CMTAG_SLAB) {
+		panic("kfree: %p belongs to an object cache\n", ptr);
 	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
+	if (tag >= CMTAG_KMSITE) {
+		/* A multi-page block (see SITES). */
 		return -1;
 	}
-
-	offset = ptraddr - prpage;
-
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	KASSERT(tag < CMTAG_KMALLOC + NSIZES);
+	if (tag != CMTAG_NONE && km_ready) {
+		blktype = tag - CMTAG_KMALLOC;
+		subpage_retire(ptr, ptraddr, blktype);
+		kmag_free((void *)ptraddr, blktype);
+		return 0;
 	}
 
-#ifdef GUARDS
-	blocksize = sizes[blktype];
-	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
-#endif
+	spinlock_acquire(&kmalloc_spinlock);
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+	checksubpages();
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	if (tag != CMTAG_NONE) {
+		blktype = tag - CMTAG_KMALLOC;
+	}
+	else {
+		/* Silence warnings with gcc 4.8 -Og (but not -O2) */
+		blktype = 0;
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			blktype = PR_BLOCKTYPE(pr);
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+			/* check for corruption */
+			KASSERT(blktype>=0 && blktype<NSIZES);
+			checksubpage(pr);
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
 			}
 		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
+
+		if (pr==NULL) {
+			/* Not on any of our pages - not a subpage allocation */
+			spinlock_release(&kmalloc_spinlock);
+			return -1;
+		}
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	subpage_retire(ptr, ptraddr, blktype);
+	prpage = subpage_putblock(ptraddr, blktype);
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -1170,9 +1907,13 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	void *retptr;
 #ifdef LABELS
 	vaddr_t label;
 #endif
+#ifdef SITES
+	unsigned site;
+#endif
 
 #ifdef LABELS
 #ifdef __GNUC__
@@ -1181,8 +1922,14 @@ kmalloc(size_t sz)
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
 #endif /* LABELS */
+#ifdef SITES
+	site = KM_NOSITE;
+	if (km_sitesready) {
+		site = site_lookup((vaddr_t)__builtin_return_address(0));
+	}
+#endif
 
-	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD + SITE_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -1190,19 +1937,34 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+		if (address==0) {
+			/* Maybe the magazines or caches can spare some. */
+			kmag_drainall();
+			kmem_cache_reap();
+			address = alloc_kpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+#ifdef SITES
+		establishsite_pages(address, site, sz);
+#endif
 
 		return (void *)address;
 	}
 
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+	retptr = subpage_kmalloc(sz + SITE_OVERHEAD, label);
 #else
-	return subpage_kmalloc(sz);
+	retptr = subpage_kmalloc(sz + SITE_OVERHEAD);
 #endif
+#ifdef SITES
+	if (retptr != NULL) {
+		retptr = establishsite(retptr, site, sz);
+	}
+#endif
+	return retptr;
 }
 
 /*
@@ -1216,8 +1978,18 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef SITES
+	/* Subpage blocks are never page-aligned with their site label. */
+	if ((vaddr_t)ptr % PAGE_SIZE != 0) {
+		ptr = retiresite(ptr);
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#ifdef SITES
+		retiresite_pages((vaddr_t)ptr);
+#endif
 		free_kpages((vaddr_t)ptr);
 	}
 }
@@ -0,0 +1,721 @@
+/**
+ * @file:   pagecache.c
+ * @brief:  cache of file data pages, shared by all filesystems
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <slab.h>
+#include <pcounter.h>
+#include <pagecache.h>
+
+/*
+ * Each cached page has a descriptor (from an object cache) and a
+ * frame of its own, used through kseg0. Descriptors are found by
+ * hashing (vnode, offset), and are also on one LRU list, oldest
+ * first, that's walked both for eviction and for the per-vnode
+ * operations (flush, truncate, purge); there are only as many pages
+ * as there is memory, and those operations already do I/O.
+ *
+ * A page is in use while anyone holds a reference to it. A page that
+ * isn't there yet is entered FILLING by the thread that will read it
+ * in, and others that want it sleep until it's done. Writeback marks
+ * a page WRITING instead and clears DIRTY first, so a write that comes
+ * in meanwhile just dirties it again; the page isn't locked against
+ * writes while it's being written back.
+ *
+ * Forgetting a page (truncate, purge, a failed read) takes it out of
+ * the hash and the LRU list at once. If it's in use it's marked GONE
+ * and freed when the last reference goes.
+ *
+ * Memory. Cached pages aren't given to the pager as user pages are;
+ * instead, when memory runs low, swap_getpage calls pagecache_reclaim
+ * before paging anything out, and that gives back clean pages nobody
+ * is using, oldest first. The cache also stops growing once free
+ * memory falls to PC_RESERVE frames, and recycles its own oldest
+ * clean page for each new one. Dirty pages can't be given back, so
+ * once a file has more than PC_MAXDIRTY of them, writes to it flush
+ * it. (The count is per vnode: other files' dirty pages are no reason
+ * to flush this one, and a writer can't safely flush a file it holds
+ * no reference to, as that file might be being reclaimed.)
+ *
+ * Locking. pc_lock covers the hash, the list, the descriptors' flags
+ * and reference counts, and the counts of pages, including each
+ * vnode's vn_ndirty. It's never held
+ * across I/O, uiomove, or allocation. Nothing here waits for WRITING
+ * pages, and only readers and writers wait for FILLING ones, so
+ * pagecache_flush and friends can be called with filesystem locks
+ * held (sfs_sync calls VOP_FSYNC with the vfs_biglock).
+ */
+
+#define PC_NBUCKETS	256
+#define PC_MAXDIRTY	64	/* Dirty pages in a file before writes flush */
+#define PC_RESERVE	32	/* Free frames to leave for everyone else */
+#define PC_FLUSHBATCH	16	/* Pages written back per pass */
+
+#define PGF_FILLING	0x1	/* Being read in */
+#define PGF_WRITING	0x2	/* Being written back */
+#define PGF_DIRTY	0x4	/* Changed since last written back */
+#define PGF_GONE	0x8	/* Forgotten; free when no longer used */
+
+struct pc_page {
+	struct vnode *pg_vnode;
+	off_t pg_offset;		/* In the file; page-aligned */
+	void *pg_data;			/* The frame, in kseg0 */
+	pagecache_iofn pg_iofn;		/* For writing it back */
+	unsigned pg_refs;		/* Threads using it */
+	unsigned pg_flags;		/* PGF_* */
+	struct pc_page *pg_hnext;	/* Hash chain */
+	struct pc_page *pg_next;	/* LRU list */
+	struct pc_page *pg_prev;
+};
+
+static struct pc_page *pc_hash[PC_NBUCKETS];
+static struct pc_page *pc_lruhead;	/* Oldest */
+static struct pc_page *pc_lrutail;	/* Newest */
+static unsigned pc_npages;
+static unsigned pc_ndirty;
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pc_wchan;		/* For FILLING pages */
+static struct kmem_cache *pc_pagecache;	/* Descriptors */
+static bool pc_ready;
+
+static struct pcounter pc_hits = PCOUNTER_INITIALIZER("pagecache_hits");
+static struct pcounter pc_misses = PCOUNTER_INITIALIZER("pagecache_misses");
+static struct pcounter pc_writebacks =
+	PCOUNTER_INITIALIZER("pagecache_writebacks");
+static struct pcounter pc_evictions =
+	PCOUNTER_INITIALIZER("pagecache_evictions");
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU list (called with pc_lock held)
+
+static
+inline
+unsigned
+pc_hashfn(struct vnode *v, off_t offset)
+{
+	return (((vaddr_t)v >> 4) + (unsigned)(offset / PAGE_SIZE))
+		% PC_NBUCKETS;
+}
+
+static
+struct pc_page *
+pc_find(struct vnode *v, off_t offset)
+{
+	struct pc_page *pg;
+
+	for (pg = pc_hash[pc_hashfn(v, offset)]; pg != NULL;
+	     pg = pg->pg_hnext) {
+		if (pg->pg_vnode == v && pg->pg_offset == offset) {
+			return pg;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_lruremove(struct pc_page *pg)
+{
+	if (pg->pg_prev != NULL) {
+		pg->pg_prev->pg_next = pg->pg_next;
+	}
+	else {
+		KASSERT(pc_lruhead == pg);
+		pc_lruhead = pg->pg_next;
+	}
+	if (pg->pg_next != NULL) {
+		pg->pg_next->pg_prev = pg->pg_prev;
+	}
+	else {
+		KASSERT(pc_lrutail == pg);
+		pc_lrutail = pg->pg_prev;
+	}
+	pg->pg_next = pg->pg_prev = NULL;
+}
+
+static
+void
+pc_lruappend(struct pc_page *pg)
+{
+	pg->pg_next = NULL;
+	pg->pg_prev = pc_lrutail;
+	if (pc_lrutail != NULL) {
+		pc_lrutail->pg_next = pg;
+	}
+	else {
+		pc_lruhead = pg;
+	}
+	pc_lrutail = pg;
+}
+
+/*
+ * Enter PG, already named, in the hash and as the newest page.
+ */
+static
+void
+pc_enter(struct pc_page *pg)
+{
+	unsigned b;
+
+	b = pc_hashfn(pg->pg_vnode, pg->pg_offset);
+	pg->pg_hnext = pc_hash[b];
+	pc_hash[b] = pg;
+	pc_lruappend(pg);
+	pc_npages++;
+}
+
+/*
+ * Count PG as dirty, or clean, both overall and against its vnode.
+ */
+static
+void
+pc_setdirty(struct pc_page *pg)
+{
+	KASSERT((pg->pg_flags & PGF_DIRTY) == 0);
+	pg->pg_flags |= PGF_DIRTY;
+	pg->pg_vnode->vn_ndirty++;
+	pc_ndirty++;
+}
+
+static
+void
+pc_setclean(struct pc_page *pg)
+{
+	KASSERT(pg->pg_flags & PGF_DIRTY);
+	KASSERT(pg->pg_vnode->vn_ndirty > 0);
+	pg->pg_flags &= ~PGF_DIRTY;
+	pg->pg_vnode->vn_ndirty--;
+	pc_ndirty--;
+}
+
+/*
+ * Take PG out of the cache. Returns true if nobody is using it and
+ * the caller should free it (once pc_lock is released).
+ */
+static
+bool
+pc_forget(struct pc_page *pg)
+{
+	struct pc_page **pp;
+
+	KASSERT((pg->pg_flags & PGF_GONE) == 0);
+
+	pp = &pc_hash[pc_hashfn(pg->pg_vnode, pg->pg_offset)];
+	while (*pp != pg) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->pg_hnext;
+	}
+	*pp = pg->pg_hnext;
+	pg->pg_hnext = NULL;
+	pc_lruremove(pg);
+
+	pc_npages--;
+	if (pg->pg_flags & PGF_DIRTY) {
+		pc_setclean(pg);
+	}
+	pg->pg_flags |= PGF_GONE;
+	return pg->pg_refs == 0;
+}
+
+/*
+ * Forget the oldest clean page nobody is using, and return it, or
+ * NULL if there isn't one.
+ */
+static
+struct pc_page *
+pc_takeclean(void)
+{
+	struct pc_page *pg;
+
+	for (pg = pc_lruhead; pg != NULL; pg = pg->pg_next) {
+		if (pg->pg_refs == 0 && (pg->pg_flags & PGF_DIRTY) == 0) {
+			pc_forget(pg);
+			pcounter_inc(&pc_evictions);
+			return pg;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pages (called without pc_lock)
+
+static
+void
+pc_destroy(struct pc_page *pg)
+{
+	KASSERT(pg->pg_refs == 0);
+	free_kpages((vaddr_t)pg->pg_data);
+	kmem_cache_free(pc_pagecache, pg);
+}
+
+/*
+ * Get a frame for a new page. Once memory is short, reuse one of our
+ * own clean pages rather than push something else out.
+ */
+static
+void *
+pc_getframe(void)
+{
+	struct pc_page *pg;
+	vaddr_t kva;
+	void *data;
+
+	if (coremap_nfree() > PC_RESERVE) {
+		kva = alloc_kpages(1);
+		if (kva != 0) {
+			return (void *)kva;
+		}
+	}
+
+	spinlock_acquire(&pc_lock);
+	pg = pc_takeclean();
+	spinlock_release(&pc_lock);
+	if (pg != NULL) {
+		data = pg->pg_data;
+		kmem_cache_free(pc_pagecache, pg);
+		return data;
+	}
+
+	kva = alloc_kpages(1);
+	return kva == 0 ? NULL : (void *)kva;
+}
+
+/*
+ * PG, which the caller entered FILLING, has been read in, or not if
+ * RESULT is an error; then it's forgotten.
+ */
+static
+void
+pc_filled(struct pc_page *pg, int result)
+{
+	spinlock_acquire(&pc_lock);
+	KASSERT(pg->pg_flags & PGF_FILLING);
+	pg->pg_flags &= ~PGF_FILLING;
+	if (result && (pg->pg_flags & PGF_GONE) == 0) {
+		/* We still hold a reference, so it isn't freed yet. */
+		pc_forget(pg);
+	}
+	wchan_wakeall(pc_wchan, &pc_lock);
+	spinlock_release(&pc_lock);
+}
+
+/*
+ * Drop a reference to PG, marking it dirty first if DIRTY is set.
+ */
+static
+void
+pc_release(struct pc_page *pg, bool dirty)
+{
+	bool destroy;
+
+	spinlock_acquire(&pc_lock);
+	if (dirty && (pg->pg_flags & (PGF_DIRTY | PGF_GONE)) == 0) {
+		pc_setdirty(pg);
+	}
+	KASSERT(pg->pg_refs > 0);
+	pg->pg_refs--;
+	destroy = pg->pg_refs == 0 && (pg->pg_flags & PGF_GONE);
+	spinlock_release(&pc_lock);
+
+	if (destroy) {
+		pc_destroy(pg);
+	}
+}
+
+/*
+ * Get a referenced page for V at OFFSET (page-aligned), where V is
+ * SIZE bytes long. If it isn't cached, it's read in with IOFN, unless
+ * NOFILL is set; then the page comes back still FILLING and the
+ * caller must fill it and call pc_filled.
+ */
+static
+int
+pc_getpage(struct vnode *v, off_t offset, off_t size, bool nofill,
+	   pagecache_iofn iofn, struct pc_page **ret)
+{
+	struct pc_page *pg, *newpg;
+	void *data;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	newpg = NULL;
+	spinlock_acquire(&pc_lock);
+	while (1) {
+		pg = pc_find(v, offset);
+		if (pg != NULL) {
+			pg->pg_refs++;
+			while (pg->pg_flags & PGF_FILLING) {
+				wchan_sleep(pc_wchan, &pc_lock);
+			}
+			if (pg->pg_flags & PGF_GONE) {
+				/* The read failed, or it was truncated. */
+				pg->pg_refs--;
+				if (pg->pg_refs == 0) {
+					spinlock_release(&pc_lock);
+					pc_destroy(pg);
+					spinlock_acquire(&pc_lock);
+				}
+				continue;
+			}
+			pc_lruremove(pg);
+			pc_lruappend(pg);
+			spinlock_release(&pc_lock);
+
+			pcounter_inc(&pc_hits);
+			if (newpg != NULL) {
+				pc_destroy(newpg);
+			}
+			*ret = pg;
+			return 0;
+		}
+		if (newpg != NULL) {
+			break;
+		}
+
+		/* Allocate without the lock, then look again. */
+		spinlock_release(&pc_lock);
+		newpg = kmem_cache_alloc(pc_pagecache);
+		if (newpg == NULL) {
+			return ENOMEM;
+		}
+		data = pc_getframe();
+		if (data == NULL) {
+			kmem_cache_free(pc_pagecache, newpg);
+			return ENOMEM;
+		}
+		newpg->pg_data = data;
+		newpg->pg_refs = 0;
+		spinlock_acquire(&pc_lock);
+	}
+
+	newpg->pg_vnode = v;
+	newpg->pg_offset = offset;
+	newpg->pg_iofn = iofn;
+	newpg->pg_refs = 1;
+	newpg->pg_flags = PGF_FILLING;
+	pc_enter(newpg);
+	spinlock_release(&pc_lock);
+
+	pcounter_inc(&pc_misses);
+	*ret = newpg;
+	if (nofill) {
+		return 0;
+	}
+
+	if (offset >= size) {
+		bzero(newpg->pg_data, PAGE_SIZE);
+		result = 0;
+	}
+	else {
+		result = iofn(v, offset, newpg->pg_data, UIO_READ);
+	}
+	pc_filled(newpg, result);
+	if (result) {
+		pc_release(newpg, false);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Forget V's pages from LEN on, and zero the end of the page LEN is
+ * in, so the file reads back zeros there if it grows again.
+ */
+static
+void
+pc_forgetfrom(struct vnode *v, off_t len)
+{
+	struct pc_page *pg, *next, *dead;
+	off_t pgoff;
+
+	dead = NULL;
+	spinlock_acquire(&pc_lock);
+	for (pg = pc_lruhead; pg != NULL; pg = next) {
+		next = pg->pg_next;
+		if (pg->pg_vnode != v) {
+			continue;
+		}
+		if (pg->pg_offset >= len) {
+			if (pc_forget(pg)) {
+				pg->pg_hnext = dead;
+				dead = pg;
+			}
+		}
+		else if (pg->pg_offset + PAGE_SIZE > len) {
+			pgoff = len - pg->pg_offset;
+			bzero((char *)pg->pg_data + pgoff, PAGE_SIZE - pgoff);
+		}
+	}
+	spinlock_release(&pc_lock);
+
+	while (dead != NULL) {
+		pg = dead;
+		dead = pg->pg_hnext;
+		pc_destroy(pg);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+int
+pagecache_read(struct vnode *v, struct uio *uio, off_t size,
+	       pagecache_iofn iofn)
+{
+	struct pc_page *pg;
+	size_t pgoff, len, extraresid;
+	int result;
+
+	KASSERT(pc_ready);
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	/* As in sfs_io: stop at EOF, and put the rest back afterwards. */
+	if (uio->uio_offset >= size) {
+		return 0;
+	}
+	extraresid = 0;
+	if (uio->uio_offset + uio->uio_resid > size) {
+		extraresid = uio->uio_offset + uio->uio_resid - size;
+		uio->uio_resid -= extraresid;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		pgoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pgoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		result = pc_getpage(v, uio->uio_offset - pgoff, size, false,
+				    iofn, &pg);
+		if (result) {
+			break;
+		}
+		result = uiomove((char *)pg->pg_data + pgoff, len, uio);
+		pc_release(pg, false);
+		if (result) {
+			break;
+		}
+	}
+
+	uio->uio_resid += extraresid;
+	return result;
+}
+
+int
+pagecache_write(struct vnode *v, struct uio *uio, off_t size,
+		pagecache_iofn iofn)
+{
+	struct pc_page *pg;
+	size_t pgoff, len;
+	bool whole;
+	int result;
+
+	KASSERT(pc_ready);
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		pgoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pgoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		/* No point reading in what we're about to overwrite. */
+		whole = (len == PAGE_SIZE);
+		result = pc_getpage(v, uio->uio_offset - pgoff, size, whole,
+				    iofn, &pg);
+		if (result) {
+			break;
+		}
+		result = uiomove((char *)pg->pg_data + pgoff, len, uio);
+		/* Only we can have left it FILLING, so no lock needed. */
+		if (pg->pg_flags & PGF_FILLING) {
+			pc_filled(pg, result);
+		}
+		pc_release(pg, true);
+		if (result) {
+			break;
+		}
+	}
+
+	/* Unlocked; it's only a hint. */
+	if (result == 0 && v->vn_ndirty > PC_MAXDIRTY) {
+		result = pagecache_flush(v);
+	}
+	return result;
+}
+
+/*
+ * Pages that are already being written back are left to whoever is
+ * writing them, rather than waited for.
+ */
+int
+pagecache_flush(struct vnode *v)
+{
+	struct pc_page *batch[PC_FLUSHBATCH];
+	struct pc_page *pg;
+	unsigned n, i, j;
+	bool destroy;
+	int result, err;
+
+	KASSERT(pc_ready);
+
+	err = 0;
+	do {
+		n = 0;
+		spinlock_acquire(&pc_lock);
+		for (pg = pc_lruhead; pg != NULL && n < PC_FLUSHBATCH;
+		     pg = pg->pg_next) {
+			if (pg->pg_vnode != v ||
+			    (pg->pg_flags & PGF_DIRTY) == 0 ||
+			    (pg->pg_flags & PGF_WRITING) != 0) {
+				continue;
+			}
+			pc_setclean(pg);
+			pg->pg_flags |= PGF_WRITING;
+			pg->pg_refs++;
+
+			/* Keep the batch in file order, for the disk. */
+			for (j = n; j > 0 &&
+				     batch[j-1]->pg_offset > pg->pg_offset; j--) {
+				batch[j] = batch[j-1];
+			}
+			batch[j] = pg;
+			n++;
+		}
+		spinlock_release(&pc_lock);
+
+		for (i=0; i<n; i++) {
+			pg = batch[i];
+			result = pg->pg_iofn(v, pg->pg_offset, pg->pg_data,
+					     UIO_WRITE);
+
+			spinlock_acquire(&pc_lock);
+			pg->pg_flags &= ~PGF_WRITING;
+			if (result) {
+				if (err == 0) {
+					err = result;
+				}
+				/* Try again next time. */
+				if ((pg->pg_flags & (PGF_DIRTY|PGF_GONE)) == 0) {
+					pc_setdirty(pg);
+				}
+			}
+			pg->pg_refs--;
+			destroy = pg->pg_refs == 0 && (pg->pg_flags & PGF_GONE);
+			spinlock_release(&pc_lock);
+
+			if (result == 0) {
+				pcounter_inc(&pc_writebacks);
+			}
+			if (destroy) {
+				pc_destroy(pg);
+			}
+		}
+	} while (n == PC_FLUSHBATCH && err == 0);
+
+	return err;
+}
+
+void
+pagecache_truncate(struct vnode *v, off_t len)
+{
+	KASSERT(len >= 0);
+	if (pc_ready) {
+		pc_forgetfrom(v, len);
+	}
+}
+
+void
+pagecache_purge(struct vnode *v)
+{
+	if (pc_ready) {
+		pc_forgetfrom(v, 0);
+	}
+}
+
+unsigned
+pagecache_reclaim(unsigned npages)
+{
+	struct pc_page *pg, *dead;
+	unsigned n;
+
+	if (!pc_ready) {
+		return 0;
+	}
+
+	dead = NULL;
+	spinlock_acquire(&pc_lock);
+	for (n = 0; n < npages; n++) {
+		pg = pc_takeclean();
+		if (pg == NULL) {
+			break;
+		}
+		pg->pg_hnext = dead;
+		dead = pg;
+	}
+	spinlock_release(&pc_lock);
+
+	while (dead != NULL) {
+		pg = dead;
+		dead = pg->pg_hnext;
+		pc_destroy(pg);
+	}
+	return n;
+}
+
+void
+pagecache_printstats(void)
+{
+	uint64_t hits, misses;
+	unsigned npages, ndirty;
+
+	hits = pcounter_read(&pc_hits);
+	misses = pcounter_read(&pc_misses);
+	spinlock_acquire(&pc_lock);
+	npages = pc_npages;
+	ndirty = pc_ndirty;
+	spinlock_release(&pc_lock);
+
+	kprintf("Page cache: %u pages (%u dirty), %llu hits, %llu misses "
+		"(%llu%% hit ratio)\n", npages, ndirty,
+		(unsigned long long)hits, (unsigned long long)misses,
+		(unsigned long long)(hits + misses == 0 ? 0 :
+				     hits * 100 / (hits + misses)));
+	kprintf("    %llu pages written back, %llu evicted\n",
+		(unsigned long long)pcounter_read(&pc_writebacks),
+		(unsigned long long)pcounter_read(&pc_evictions));
+}
+
+void
+pagecache_bootstrap(void)
+{
+	pc_pagecache = kmem_cache_create("pagecache", sizeof(struct pc_page),
+					 0, NULL, NULL);
+	pc_wchan = wchan_create("pagecache");
+	if (pc_pagecache == NULL || pc_wchan == NULL) {
+		panic("pagecache_bootstrap: Out of memory\n");
+	}
+	pcounter_register(&pc_hits);
+	pcounter_register(&pc_misses);
+	pcounter_register(&pc_writebacks);
+	pcounter_register(&pc_evictions);
+	pc_ready = true;
+}
@@ -0,0 +1,108 @@
+/**
+ * @file:   pagetable.c
+ * @brief:  two-level page tables for user address spaces
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <membar.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+
+#define PT_DIRINDEX(va)		((va) >> PT_DIRSHIFT)
+#define PT_TABLEINDEX(va)	(((va) >> 12) % PT_TABLESIZE)
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_DIRSIZE; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+/*
+ * Free the tables. Whatever the PTEs pointed to is the caller's
+ * business and should have been dealt with already.
+ */
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_DIRSIZE; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			free_kpages((vaddr_t)pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+/*
+ * Find the PTE for VA. If its second-level table doesn't exist yet,
+ * either allocate it (if CREATE) or return NULL. Also returns NULL if
+ * the allocation fails.
+ */
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t va, bool create)
+{
+	pte_t *table;
+	paddr_t pa;
+
+	KASSERT(va < USERSPACETOP);
+
+	table = pt->pt_dir[PT_DIRINDEX(va)];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		pa = swap_getzeropage();
+		if (pa == 0) {
+			return NULL;
+		}
+		table = (pte_t *)PADDR_TO_KVADDR(pa);
+		/* The refill handler reads tables without our locks. */
+		membar_store_store();
+		pt->pt_dir[PT_DIRINDEX(va)] = table;
+	}
+	return &table[PT_TABLEINDEX(va)];
+}
+
+/*
+ * Iterate over the non-empty PTEs. Returns the first at or above *VA
+ * and sets *VA to its page address, or returns NULL if there are no
+ * more. Missing second-level tables are skipped whole. To step past
+ * the one returned, add PAGE_SIZE to *VA (stop if that wraps to 0 or
+ * reaches USERSPACETOP).
+ */
+pte_t *
+pt_next(struct pagetable *pt, vaddr_t *va)
+{
+	vaddr_t v;
+	pte_t *table;
+	unsigned d, t;
+
+	v = *va & PAGE_FRAME;
+	for (d = PT_DIRINDEX(v); d < PT_DIRSIZE; d++) {
+		table = pt->pt_dir[d];
+		if (table != NULL) {
+			for (t = PT_TABLEINDEX(v); t < PT_TABLESIZE; t++) {
+				if (table[t] != 0) {
+					*va = ((vaddr_t)d << PT_DIRSHIFT) |
+						((vaddr_t)t << 12);
+					return &table[t];
+				}
+			}
+		}
+		v = (vaddr_t)(d + 1) << PT_DIRSHIFT;
+	}
+	return NULL;
+}
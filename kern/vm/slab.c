@@ -0,0 +1,453 @@
+/**
+ * @file:   slab.c
+ * @brief:  object caches for fixed-size kernel objects
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <current.h>
+#include <thread.h>
+#include <vm.h>
+#include <coremap.h>
+#include <slab.h>
+
+/*
+ * Each slab is one page. The slab header goes at the start of the
+ * page, followed by one link per object, then the objects. The links
+ * chain the free objects together by index; they can't live in the
+ * objects themselves, which hold constructed state. An allocated
+ * object's link is KS_INUSE, which catches double frees.
+ *
+ * Since a slab is a page, an object's slab is just the page it's on.
+ * Slab pages are tagged CMTAG_SLAB in the coremap, so kfree can tell
+ * when it's been handed an object from a cache.
+ *
+ * A cache keeps its slabs on three lists: partly used, full, and
+ * empty. Allocation takes from a partly used slab if there is one,
+ * so objects pack into as few slabs as possible and empty slabs stay
+ * empty. Empty slabs are kept, objects still constructed, until the
+ * cache is shrunk.
+ *
+ * Locking. Each cache has a spinlock for its lists. Constructors and
+ * destructors may need to allocate or free memory, so they run
+ * without it, on slabs that aren't on any list. kmem_reaplock keeps
+ * a cache from being destroyed while it's being reaped; a thread that
+ * can't get it just doesn't reap.
+ */
+
+#define KS_NONE		0xffff		/* End of a free chain */
+#define KS_INUSE	0xfffe		/* Link of an allocated object */
+
+/* Alignment when the caller doesn't care; the same as kmalloc's. */
+#define KMEM_DEFALIGN	8
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* On one of the cache's lists */
+	struct kmem_slab *ks_prev;
+	unsigned ks_inuse;		/* Objects allocated */
+	uint16_t ks_free;		/* First free object */
+	uint16_t ks_link[];		/* One per object */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* Object size, rounded to kc_align */
+	size_t kc_align;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	unsigned kc_perslab;		/* Objects per slab */
+	size_t kc_offset;		/* Of the first object in a slab */
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nslabs;
+	unsigned kc_inuse;		/* Objects allocated */
+
+	/* Statistics */
+	unsigned kc_peak;		/* Most objects ever allocated */
+	uint64_t kc_allocs;
+	unsigned kc_grows;		/* Slabs made */
+	unsigned kc_reaped;		/* Slabs given back */
+
+	struct kmem_cache *kc_next;	/* All caches */
+};
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_listlock = SPINLOCK_INITIALIZER;
+static struct lock *kmem_reaplock;
+
+////////////////////////////////////////////////////////////
+//
+// Slab lists (called with kc_lock held)
+
+static
+void
+kmem_slab_insert(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+kmem_slab_remove(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev == NULL) {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	else {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * The list a slab with INUSE objects allocated belongs on.
+ */
+static
+struct kmem_slab **
+kmem_slab_list(struct kmem_cache *kc, unsigned inuse)
+{
+	if (inuse == 0) {
+		return &kc->kc_empty;
+	}
+	if (inuse == kc->kc_perslab) {
+		return &kc->kc_full;
+	}
+	return &kc->kc_partial;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slabs (called without kc_lock)
+
+static
+inline
+void *
+kmem_slab_obj(struct kmem_cache *kc, struct kmem_slab *ks, unsigned i)
+{
+	return (void *)((vaddr_t)ks + kc->kc_offset + i * kc->kc_size);
+}
+
+/*
+ * Destroy the first N objects of a slab and give the page back.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(ks->ks_inuse == 0);
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			kc->kc_dtor(kmem_slab_obj(kc, ks, i));
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Get a page and make it a slab of constructed objects.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		/* Maybe another cache has pages to spare. */
+		kmem_cache_reap();
+		page = alloc_kpages(1);
+		if (page == 0) {
+			return NULL;
+		}
+	}
+	coremap_settag(KVADDR_TO_PADDR(page), CMTAG_SLAB);
+
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_inuse = 0;
+	ks->ks_free = 0;
+	for (i=0; i<kc->kc_perslab; i++) {
+		ks->ks_link[i] = i + 1 < kc->kc_perslab ? i + 1 : KS_NONE;
+		if (kc->kc_ctor != NULL &&
+		    kc->kc_ctor(kmem_slab_obj(kc, ks, i)) != 0) {
+			kmem_slab_destroy(kc, ks, i);
+			return NULL;
+		}
+	}
+	return ks;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Caches
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	size_t hdrsize;
+	unsigned n;
+
+	if (align == 0) {
+		align = KMEM_DEFALIGN;
+	}
+	KASSERT((align & (align - 1)) == 0);
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = ROUNDUP(size, align);
+	kc->kc_align = align;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	/* Fit as many objects as we can after the header and links. */
+	hdrsize = sizeof(struct kmem_slab);
+	n = (PAGE_SIZE - hdrsize) / (kc->kc_size + sizeof(uint16_t));
+	while (n > 0 && ROUNDUP(hdrsize + n * sizeof(uint16_t), align) +
+	       n * kc->kc_size > PAGE_SIZE) {
+		n--;
+	}
+	if (n == 0) {
+		panic("kmem_cache_create: %s: %zu-byte objects don't fit "
+		      "in a slab\n", name, size);
+	}
+	KASSERT(n < KS_INUSE);
+	kc->kc_perslab = n;
+	kc->kc_offset = ROUNDUP(hdrsize + n * sizeof(uint16_t), align);
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_peak = 0;
+	kc->kc_allocs = 0;
+	kc->kc_grows = 0;
+	kc->kc_reaped = 0;
+
+	spinlock_acquire(&kmem_listlock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_listlock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	/* Wait out anyone reaping, who might be looking at us. */
+	if (kmem_reaplock != NULL) {
+		lock_acquire(kmem_reaplock);
+	}
+
+	spinlock_acquire(&kmem_listlock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_listlock);
+
+	if (kmem_reaplock != NULL) {
+		lock_release(kmem_reaplock);
+	}
+
+	if (kc->kc_inuse != 0) {
+		panic("kmem_cache_destroy: %s: %u objects still in use\n",
+		      kc->kc_name, kc->kc_inuse);
+	}
+	kmem_cache_shrink(kc);
+	KASSERT(kc->kc_nslabs == 0);
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+	unsigned i;
+
+	spinlock_acquire(&kc->kc_lock);
+	for (;;) {
+		ks = kc->kc_partial != NULL ? kc->kc_partial : kc->kc_empty;
+		if (ks != NULL) {
+			break;
+		}
+
+		/* Make a new slab, without the lock. */
+		spinlock_release(&kc->kc_lock);
+		ks = kmem_slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_slab_insert(&kc->kc_empty, ks);
+		kc->kc_nslabs++;
+		kc->kc_grows++;
+	}
+
+	kmem_slab_remove(kmem_slab_list(kc, ks->ks_inuse), ks);
+	i = ks->ks_free;
+	KASSERT(i < kc->kc_perslab);
+	ks->ks_free = ks->ks_link[i];
+	ks->ks_link[i] = KS_INUSE;
+	ks->ks_inuse++;
+	kmem_slab_insert(kmem_slab_list(kc, ks->ks_inuse), ks);
+
+	kc->kc_inuse++;
+	if (kc->kc_inuse > kc->kc_peak) {
+		kc->kc_peak = kc->kc_inuse;
+	}
+	kc->kc_allocs++;
+	obj = kmem_slab_obj(kc, ks, i);
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+	vaddr_t offset;
+	unsigned i;
+
+	KASSERT(obj != NULL);
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	offset = (vaddr_t)obj - (vaddr_t)ks;
+	if (ks->ks_cache != kc || offset < kc->kc_offset ||
+	    (offset - kc->kc_offset) % kc->kc_size != 0) {
+		panic("kmem_cache_free: %p is not a %s object\n",
+		      obj, kc->kc_name);
+	}
+	i = (offset - kc->kc_offset) / kc->kc_size;
+	KASSERT(i < kc->kc_perslab);
+
+	spinlock_acquire(&kc->kc_lock);
+	if (ks->ks_link[i] != KS_INUSE) {
+		panic("kmem_cache_free: %s object %p freed twice\n",
+		      kc->kc_name, obj);
+	}
+	kmem_slab_remove(kmem_slab_list(kc, ks->ks_inuse), ks);
+	ks->ks_link[i] = ks->ks_free;
+	ks->ks_free = i;
+	ks->ks_inuse--;
+	kmem_slab_insert(kmem_slab_list(kc, ks->ks_inuse), ks);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	spinlock_release(&kc->kc_lock);
+}
+
+unsigned
+kmem_cache_shrink(struct kmem_cache *kc)
+{
+	struct kmem_slab *list, *ks;
+	unsigned n;
+
+	spinlock_acquire(&kc->kc_lock);
+	list = kc->kc_empty;
+	kc->kc_empty = NULL;
+	n = 0;
+	for (ks = list; ks != NULL; ks = ks->ks_next) {
+		n++;
+	}
+	KASSERT(kc->kc_nslabs >= n);
+	kc->kc_nslabs -= n;
+	kc->kc_reaped += n;
+	spinlock_release(&kc->kc_lock);
+
+	while (list != NULL) {
+		ks = list;
+		list = ks->ks_next;
+		kmem_slab_destroy(kc, ks, kc->kc_perslab);
+	}
+	return n;
+}
+
+unsigned
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	if (kmem_reaplock == NULL || curthread->t_in_interrupt ||
+	    lock_do_i_hold(kmem_reaplock) ||
+	    !lock_tryacquire(kmem_reaplock)) {
+		return 0;
+	}
+
+	/* Holding the reap lock, caches can be added but not removed. */
+	spinlock_acquire(&kmem_listlock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_listlock);
+
+	n = 0;
+	for (; kc != NULL; kc = kc->kc_next) {
+		n += kmem_cache_shrink(kc);
+	}
+
+	lock_release(kmem_reaplock);
+	return n;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	kprintf("    %-16s %5s %6s %13s %6s %10s\n", "name", "size",
+		"/slab", "inuse/total", "slabs", "allocs");
+
+	spinlock_acquire(&kmem_listlock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("    %-16s %5zu %6u %6u/%-6u %6u %10llu\n",
+			kc->kc_name, kc->kc_size, kc->kc_perslab,
+			kc->kc_inuse, kc->kc_nslabs * kc->kc_perslab,
+			kc->kc_nslabs, (unsigned long long)kc->kc_allocs);
+		kprintf("    %-16s peak %u objects, %u slabs made, "
+			"%u given back\n", "", kc->kc_peak, kc->kc_grows,
+			kc->kc_reaped);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_listlock);
+}
+
+void
+kmem_bootstrap(void)
+{
+	kmem_reaplock = lock_create("kmem_reap");
+	if (kmem_reaplock == NULL) {
+		panic("kmem_bootstrap: no memory for lock\n");
+	}
+}
@@ -0,0 +1,469 @@
+/**
+ * @file:   swap.c
+ * @brief:  paging user memory out to a swap device
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <membar.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <slab.h>
+#include <pagecache.h>
+#include <pcounter.h>
+
+/*
+ * When an allocation finds no free page, swap_getpage evicts one: the
+ * coremap's clock picks a user page that hasn't been used lately, and
+ * it's written to a free slot on the swap device, its PTE is changed
+ * to point at the slot, and the frame is freed. The next fault on the
+ * page reads it back into a new frame and frees the slot.
+ *
+ * Clustering. Pages next to the victim in its address space that
+ * haven't been used lately either go out with it, into consecutive
+ * slots, in one write. A fault on any of them later reads the ones
+ * after it back in the same read (if there's memory to spare), since
+ * a program that wants one of them probably wants the rest.
+ *
+ * Locking. To change a PTE the pager needs the owning address space's
+ * lock, but whoever wants memory may already hold a different address
+ * space's lock, and its owner may be waiting for ours. So the pager
+ * never waits for an address space lock: if it can't get the victim's
+ * at once, it passes over the page. Only one thread evicts at a time
+ * (swap_evictlock); anything the swap I/O itself allocates must not
+ * evict again, so a thread that already holds it gets no help.
+ */
+
+/* Most pages written or read in one go */
+#define SWAP_CLUSTER	8
+#define SWAP_PREFETCH	4
+
+/* Victims the clock may pass over for their locks before giving up */
+#define SWAP_PICKTRIES	16
+
+static struct vnode *swap_vnode;	/* NULL until swap_on */
+static struct bitmap *swap_map;		/* Slots in use */
+static unsigned swap_nslots;
+static unsigned swap_rotor;		/* Where to look for free slots */
+static struct spinlock swap_maplock = SPINLOCK_INITIALIZER;
+
+static struct lock *swap_evictlock;
+
+static struct pcounter swap_pageouts =
+	PCOUNTER_INITIALIZER("swap_pageouts");
+static struct pcounter swap_writes = PCOUNTER_INITIALIZER("swap_writes");
+static struct pcounter swap_pageins = PCOUNTER_INITIALIZER("swap_pageins");
+static struct pcounter swap_zerosync =
+	PCOUNTER_INITIALIZER("zeropool_misses");
+static struct pcounter swap_prefetched =
+	PCOUNTER_INITIALIZER("swap_prefetched");
+
+void
+swap_bootstrap(void)
+{
+	swap_evictlock = lock_create("swap");
+	if (swap_evictlock == NULL) {
+		panic("swap: no memory for lock\n");
+	}
+	pcounter_register(&swap_pageouts);
+	pcounter_register(&swap_writes);
+	pcounter_register(&swap_pageins);
+	pcounter_register(&swap_prefetched);
+	pcounter_register(&swap_zerosync);
+}
+
+int
+swap_on(const char *devname)
+{
+	struct vnode *v;
+	struct stat st;
+	struct bitmap *map;
+	unsigned nslots;
+	int result;
+
+	lock_acquire(swap_evictlock);
+	if (swap_vnode != NULL) {
+		lock_release(swap_evictlock);
+		return EBUSY;
+	}
+
+	result = vfs_swapon(devname, &v);
+	if (result) {
+		lock_release(swap_evictlock);
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		goto fail;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		result = EINVAL;
+		goto fail;
+	}
+	map = bitmap_create(nslots);
+	if (map == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	swap_map = map;
+	swap_nslots = nslots;
+	swap_rotor = 0;
+	/* Anyone who sees the vnode must see the map. */
+	membar_store_store();
+	swap_vnode = v;
+	lock_release(swap_evictlock);
+
+	kprintf("swap: %u pages\n", nslots);
+	return 0;
+
+ fail:
+	VOP_DECREF(v);
+	vfs_swapoff(devname);
+	lock_release(swap_evictlock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slots
+
+/*
+ * Find N free slots in a row, starting the search where the last one
+ * ended so consecutive clusters land next to each other.
+ */
+static
+int
+swap_allocslots(unsigned n, unsigned *ret)
+{
+	unsigned i, len, scanned;
+
+	spinlock_acquire(&swap_maplock);
+	i = swap_rotor;
+	len = 0;
+	for (scanned = 0; scanned < swap_nslots + n; scanned++) {
+		if (i == swap_nslots) {
+			/* A run can't wrap. */
+			i = 0;
+			len = 0;
+		}
+		if (bitmap_isset(swap_map, i)) {
+			len = 0;
+		}
+		else if (++len == n) {
+			*ret = i + 1 - n;
+			for (len = 0; len < n; len++) {
+				bitmap_mark(swap_map, *ret + len);
+			}
+			swap_rotor = i + 1;
+			spinlock_release(&swap_maplock);
+			return 0;
+		}
+		i++;
+	}
+	spinlock_release(&swap_maplock);
+	return ENOSPC;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(swap_vnode != NULL && slot < swap_nslots);
+
+	spinlock_acquire(&swap_maplock);
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_maplock);
+}
+
+/*
+ * Transfer N pages, at the frames in PAS, to or from the N slots
+ * starting at SLOT.
+ */
+static
+int
+swap_io(unsigned slot, const paddr_t *pas, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	KASSERT(slot + n <= swap_nslots);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t pa)
+{
+	return swap_io(slot, &pa, 1, UIO_READ);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Paging out
+
+/*
+ * Page out the page at VA in AS, which is at PA and marked busy,
+ * along with whichever pages after it can go too. Call with AS's lock
+ * held. Unbusies and frees the pages it writes out, and unbusies the
+ * rest if it fails.
+ */
+static
+int
+swap_out(struct addrspace *as, vaddr_t va, paddr_t pa)
+{
+	pte_t *ptes[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	pte_t *pte;
+	vaddr_t v;
+	unsigned n, i, slot;
+	int result;
+
+	pte = pt_lookup(as->as_pt, va, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_FRAME | PTE_VALID)) == (pa | PTE_VALID));
+	ptes[0] = pte;
+	pas[0] = pa;
+
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		v = va + n * PAGE_SIZE;
+		if (v >= USERSPACETOP) {
+			break;
+		}
+		pte = pt_lookup(as->as_pt, v, false);
+		if (pte == NULL || (*pte & PTE_VALID) == 0) {
+			break;
+		}
+		if (!coremap_trybusy(*pte & PTE_FRAME, as, v)) {
+			break;
+		}
+		ptes[n] = pte;
+		pas[n] = *pte & PTE_FRAME;
+	}
+
+	/* If swap is too fragmented for the whole cluster, send less. */
+	while (swap_allocslots(n, &slot) != 0) {
+		if (n == 1) {
+			coremap_unbusy(pas[0]);
+			return ENOSPC;
+		}
+		n--;
+		coremap_unbusy(pas[n]);
+	}
+
+	/*
+	 * No more writes through the TLB once we start copying. The
+	 * refill handler doesn't wait for our lock, so the PTEs have to
+	 * stop being valid before the old entries go.
+	 */
+	for (i=0; i<n; i++) {
+		*ptes[i] &= ~PTE_VALID;
+	}
+	vm_tlbshootdown_as(as);
+
+	result = swap_io(slot, pas, n, UIO_WRITE);
+	if (result) {
+		for (i=0; i<n; i++) {
+			*ptes[i] |= PTE_VALID;
+			swap_free(slot + i);
+			coremap_unbusy(pas[i]);
+		}
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		*ptes[i] = PTE_MKSWAPPED(slot + i) | (*ptes[i] & PTE_DIRTY);
+		coremap_unbusy(pas[i]);
+		coremap_free(pas[i]);
+	}
+	pcounter_add(&swap_pageouts, n);
+	pcounter_inc(&swap_writes);
+	return 0;
+}
+
+/*
+ * Free up some memory by paging something out.
+ */
+static
+int
+swap_evict(void)
+{
+	struct addrspace *as;
+	paddr_t pa;
+	vaddr_t va;
+	unsigned tries;
+	bool held;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOMEM;
+	}
+	if (lock_do_i_hold(swap_evictlock)) {
+		/* Allocating for the pager itself. */
+		return ENOMEM;
+	}
+
+	lock_acquire(swap_evictlock);
+	result = ENOMEM;
+	for (tries = 0; tries < SWAP_PICKTRIES && result != 0; tries++) {
+		if (coremap_pickvictim(&pa, &as, &va)) {
+			break;
+		}
+
+		/*
+		 * The page is busy, so its owner can't free it, or
+		 * itself, until we let go of it.
+		 */
+		held = lock_do_i_hold(as->as_lock);
+		if (!held && !lock_tryacquire(as->as_lock)) {
+			coremap_unbusy(pa);
+			continue;
+		}
+		result = swap_out(as, va, pa);
+		if (!held) {
+			lock_release(as->as_lock);
+		}
+	}
+	lock_release(swap_evictlock);
+	return result;
+}
+
+paddr_t
+swap_getpage(void)
+{
+	paddr_t pa;
+
+	while ((pa = coremap_alloc(1)) == 0) {
+		/* Idle cached objects are cheaper to lose than user pages. */
+		if (kmem_cache_reap() > 0) {
+			continue;
+		}
+
+		/* So are clean file pages; they can be read back. */
+		if (pagecache_reclaim(SWAP_CLUSTER) > 0) {
+			continue;
+		}
+		if (swap_evict()) {
+			return 0;
+		}
+	}
+	return pa;
+}
+
+paddr_t
+swap_getzeropage(void)
+{
+	paddr_t pa;
+
+	pa = coremap_getzeroed();
+	if (pa != 0) {
+		return pa;
+	}
+	pa = swap_getpage();
+	if (pa != 0) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+		pcounter_inc(&swap_zerosync);
+	}
+	return pa;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Paging in
+
+int
+swap_pagein(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	pte_t *ptes[SWAP_PREFETCH];
+	paddr_t pas[SWAP_PREFETCH];
+	unsigned n, i, slot;
+	vaddr_t v;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT(*pte & PTE_SWAPPED);
+	slot = PTE_SLOT(*pte);
+
+	pas[0] = swap_getpage();
+	if (pas[0] == 0) {
+		return ENOMEM;
+	}
+	ptes[0] = pte;
+
+	/*
+	 * Prefetch the pages that went out after this one, as long as
+	 * they're still in the slots after its slot. Only take memory
+	 * that's free; it's not worth evicting anything for a guess.
+	 */
+	for (n = 1; n < SWAP_PREFETCH; n++) {
+		v = va + n * PAGE_SIZE;
+		if (v >= USERSPACETOP || slot + n >= swap_nslots) {
+			break;
+		}
+		pte = pt_lookup(as->as_pt, v, false);
+		if (pte == NULL ||
+		    (*pte & ~PTE_DIRTY) != PTE_MKSWAPPED(slot + n)) {
+			break;
+		}
+		pas[n] = coremap_alloc(1);
+		if (pas[n] == 0) {
+			break;
+		}
+		ptes[n] = pte;
+	}
+
+	result = swap_io(slot, pas, n, UIO_READ);
+	if (result) {
+		for (i=0; i<n; i++) {
+			coremap_free(pas[i]);
+		}
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		*ptes[i] = pas[i] | PTE_VALID | (*ptes[i] & PTE_DIRTY);
+		swap_free(slot + i);
+		coremap_touch(pas[i], as, va + i * PAGE_SIZE);
+	}
+	pcounter_inc(&swap_pageins);
+	pcounter_add(&swap_prefetched, n - 1);
+	return 0;
+}
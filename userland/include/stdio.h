@@ -41,6 +41,54 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/*
+ * Buffering modes for setvbuf, and the default buffer size.
+ *
+ * Unless changed with setvbuf, stdout is line buffered when it's the
+ * console (or anything else that can't seek) and fully buffered
+ * otherwise, and stdin is read a buffer at a time from files but a
+ * byte at a time from the console, whose reads don't echo; stderr is
+ * unbuffered. Output still in a buffer is written by fflush, by
+ * exit, and (if line buffered) before stdin reads more input.
+ */
+#define _IOFBF 0	/* fully buffered */
+#define _IOLBF 1	/* line buffered */
+#define _IONBF 2	/* unbuffered */
+
+#define BUFSIZ 1024
+
+/*
+ * A stdio stream. There are only the three standard ones, as there's
+ * no fopen. The fields are for libc internal use only.
+ */
+typedef struct __file {
+	int f_fd;		/* file handle */
+	int f_mode;		/* _IOFBF etc., or -1 until first use */
+	int f_write;		/* nonzero for output */
+	char *f_buf;		/* the buffer */
+	size_t f_bufsize;	/* its size */
+	size_t f_pos;		/* output: bytes held; input: next byte */
+	size_t f_len;		/* input: bytes in the buffer */
+	int f_used;		/* nonzero once read or written */
+} FILE;
+
+extern FILE __stdin, __stdout, __stderr;
+#define stdin (&__stdin)
+#define stdout (&__stdout)
+#define stderr (&__stderr)
+
+/*
+ * The guts of the buffering
+ * (for libc internal use only)
+ *
+ * __stdio_write sends LEN bytes to F; __stdio_getc reads a byte from
+ * F; __stdio_flush writes out F's buffer. They return 0 or a byte, or
+ * -1 (EOF) with errno set.
+ */
+int __stdio_write(FILE *f, const char *data, size_t len);
+int __stdio_getc(FILE *f);
+int __stdio_flush(FILE *f);
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -69,4 +117,10 @@ int putchar(int);
 /* Reads one character (0-255) or returns EOF on error. */
 int getchar(void);
 
+/* Write out buffered output; fflush(NULL) does all streams. */
+int fflush(FILE *f);
+
+/* Set buffering; must come before any I/O on the stream. */
+int setvbuf(FILE *f, char *buf, int mode, size_t size);
+
 #endif /* _STDIO_H_ */
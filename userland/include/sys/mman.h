@@ -0,0 +1,7 @@
+/**
+ * @file:   mman.h
+ * @brief:  mmap, munmap, and msync
+ */
+
+/* This file is for UNIX compat. In OS/161, everything's in <unistd.h> */
+#include <unistd.h>
@@ -0,0 +1,43 @@
+/**
+ * @file:   ulock.h
+ * @brief:  userland mutexes and condition variables built on futex()
+ */
+
+#ifndef _ULOCK_H_
+#define _ULOCK_H_
+
+/*
+ * The lock state lives in user memory and is updated with LL/SC, so
+ * the uncontended paths never enter the kernel. futex() is only
+ * called to sleep when a lock is busy, and to wake when someone is
+ * known to be sleeping.
+ *
+ * These are only useful between threads sharing an address space;
+ * the kernel keys sleepers on (address space, address).
+ *
+ * Link with -lulock.
+ */
+
+struct umutex {
+	volatile int um_state;	/* 0 free, 1 held, 2 held with sleepers */
+};
+
+struct ucond {
+	volatile int uc_seq;		/* Bumped by every signal/broadcast */
+	volatile int uc_waiters;	/* Threads in ucond_wait */
+};
+
+#define UMUTEX_INITIALIZER	{ 0 }
+#define UCOND_INITIALIZER	{ 0, 0 }
+
+void umutex_init(struct umutex *m);
+void umutex_lock(struct umutex *m);
+int umutex_trylock(struct umutex *m);	/* Returns 1 if acquired */
+void umutex_unlock(struct umutex *m);
+
+void ucond_init(struct ucond *cv);
+void ucond_wait(struct ucond *cv, struct umutex *m);
+void ucond_signal(struct ucond *cv);
+void ucond_broadcast(struct ucond *cv);
+
+#endif /* _ULOCK_H_ */
@@ -0,0 +1,168 @@
+/**
+ * @file:   __stdio.c
+ * @brief:  the standard streams and their buffering
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * The three standard streams. Each starts out with its mode undecided
+ * (-1); the first read or write on it picks one, unless setvbuf got
+ * there first. stderr is never buffered, so it has no buffer.
+ */
+
+static char __stdin_buf[BUFSIZ];
+static char __stdout_buf[BUFSIZ];
+
+FILE __stdin = { STDIN_FILENO, -1, 0, __stdin_buf, BUFSIZ, 0, 0, 0 };
+FILE __stdout = { STDOUT_FILENO, -1, 1, __stdout_buf, BUFSIZ, 0, 0, 0 };
+FILE __stderr = { STDERR_FILENO, _IONBF, 1, NULL, 0, 0, 0, 0 };
+
+/*
+ * Pick the default mode for F. There's no isatty (or fstat), but the
+ * console is the only thing here that can't seek, so that will do:
+ * if it seeks it's a file and gets a full buffer. If not, output is
+ * line buffered, and input is unbuffered, because a console read
+ * waits for a whole line and doesn't echo it, which would leave
+ * programs that echo what they read (like the shell) typing blind.
+ */
+static
+void
+__stdio_setmode(FILE *f)
+{
+	int olderrno;
+
+	olderrno = errno;
+	if (lseek(f->f_fd, 0, SEEK_CUR) >= 0) {
+		f->f_mode = _IOFBF;
+	}
+	else {
+		f->f_mode = f->f_write ? _IOLBF : _IONBF;
+	}
+	errno = olderrno;
+}
+
+/*
+ * Write out all of LEN bytes, as write can be short.
+ */
+static
+int
+__stdio_writeall(int fd, const char *data, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, data, len);
+		if (r < 0) {
+			return -1;
+		}
+		if (r == 0) {
+			errno = EIO;
+			return -1;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ * Write out what's in F's buffer.
+ */
+int
+__stdio_flush(FILE *f)
+{
+	int result;
+
+	if (!f->f_write || f->f_pos == 0) {
+		return 0;
+	}
+	result = __stdio_writeall(f->f_fd, f->f_buf, f->f_pos);
+	/* Drop the data even on error, or we'd keep failing on it. */
+	f->f_pos = 0;
+	return result;
+}
+
+int
+__stdio_write(FILE *f, const char *data, size_t len)
+{
+	size_t i;
+
+	if (f->f_mode < 0) {
+		__stdio_setmode(f);
+	}
+	f->f_used = 1;
+	if (f->f_mode == _IONBF) {
+		return __stdio_writeall(f->f_fd, data, len);
+	}
+
+	/*
+	 * If it doesn't fit, empty the buffer; and if it won't fit
+	 * even then, send it straight out rather than copying it
+	 * through the buffer a piece at a time.
+	 */
+	if (len > f->f_bufsize - f->f_pos) {
+		if (__stdio_flush(f)) {
+			return -1;
+		}
+		if (len >= f->f_bufsize) {
+			return __stdio_writeall(f->f_fd, data, len);
+		}
+	}
+
+	memcpy(f->f_buf + f->f_pos, data, len);
+	f->f_pos += len;
+
+	if (f->f_mode == _IOLBF) {
+		for (i=0; i<len; i++) {
+			if (data[i] == '\n') {
+				return __stdio_flush(f);
+			}
+		}
+	}
+	return 0;
+}
+
+int
+__stdio_getc(FILE *f)
+{
+	unsigned char ch;
+	ssize_t r;
+
+	if (f->f_mode < 0) {
+		__stdio_setmode(f);
+	}
+	f->f_used = 1;
+
+	if (f->f_pos < f->f_len) {
+		return (unsigned char)f->f_buf[f->f_pos++];
+	}
+
+	/*
+	 * About to wait for input: anything line buffered that's been
+	 * printed (a prompt, say) should be showing first.
+	 */
+	if (__stdout.f_mode == _IOLBF) {
+		__stdio_flush(&__stdout);
+	}
+
+	if (f->f_mode == _IONBF) {
+		r = read(f->f_fd, &ch, 1);
+		if (r <= 0) {
+			/* end of file or error */
+			return EOF;
+		}
+		return ch;
+	}
+
+	r = read(f->f_fd, f->f_buf, f->f_bufsize);
+	if (r <= 0) {
+		return EOF;
+	}
+	f->f_len = r;
+	f->f_pos = 1;
+	return (unsigned char)f->f_buf[0];
+}
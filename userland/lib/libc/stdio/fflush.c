@@ -0,0 +1,29 @@
+/**
+ * @file:   fflush.c
+ * @brief:  C standard function - write out buffered output
+ */
+
+#include <stdio.h>
+
+/*
+ * fflush(NULL) flushes every output stream; exit does that.
+ */
+int
+fflush(FILE *f)
+{
+	int result;
+
+	if (f == NULL) {
+		result = __stdio_flush(stdout);
+		if (__stdio_flush(stderr)) {
+			result = EOF;
+		}
+		return result ? EOF : 0;
+	}
+	if (f == stdin) {
+		/* Input: throw away what's been read ahead. */
+		f->f_pos = f->f_len = 0;
+		return 0;
+	}
+	return __stdio_flush(f) ? EOF : 0;
+}
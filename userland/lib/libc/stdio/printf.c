@@ -29,7 +29,6 @@
 
 #include <stdio.h>
 #include <stdarg.h>
-#include <unistd.h>
 #include <errno.h>
 
 /*
@@ -44,11 +43,12 @@ static
 void
 __printf_send(void *mydata, const char *data, size_t len)
 {
-	ssize_t ret;
 	int *err = mydata;
 
-	ret = write(STDOUT_FILENO, data, len);
-	*err = (ret == -1) ? errno : 0;
+	/* Keep the first error; later pieces may still go through. */
+	if (__stdio_write(stdout, data, len) && *err == 0) {
+		*err = errno;
+	}
 }
 
 /* printf: hand off to vprintf */
@@ -68,7 +68,7 @@ printf(const char *fmt, ...)
 int
 vprintf(const char *fmt, va_list ap)
 {
-	int chars, err;
+	int chars, err = 0;
 	chars = __vprintf(__printf_send, &err, fmt, ap);
 	if (err) {
 		errno = err;
@@ -0,0 +1,33 @@
+/**
+ * @file:   setvbuf.c
+ * @brief:  C standard function - choose how a stream is buffered
+ */
+
+#include <stdio.h>
+#include <errno.h>
+
+/*
+ * Set F's buffering MODE, and, if BUF isn't NULL, use BUF (of SIZE
+ * bytes) as its buffer. Has to come before any I/O on F; after that
+ * it fails, as does an unknown mode, or buffering stderr without
+ * giving it a buffer (it doesn't have one of its own).
+ */
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (f->f_used ||
+	    (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (buf != NULL && size > 0) {
+		f->f_buf = buf;
+		f->f_bufsize = size;
+	}
+	else if (mode != _IONBF && f->f_buf == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	f->f_mode = mode;
+	return 0;
+}
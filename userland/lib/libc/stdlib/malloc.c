@@ -30,10 +30,25 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator with boundary tags. Every block
+ * has a header that gives the size of the block below it as well as
+ * its own, so free can find both neighbors in constant time and
+ * merge with whichever of them are free. Free blocks are never left
+ * next to each other.
+ *
+ * Free blocks are filed by size. Small ones (less than MSMALLMAX
+ * bytes of data) go on a list per exact size, with a bitmap of which
+ * lists are nonempty; malloc takes the first block from the smallest
+ * nonempty list that's big enough. Larger ones go in a bitwise trie
+ * on their size, which malloc searches for the best fit; blocks of
+ * the same size hang on a list off one node of it. Either way a free
+ * block is filed or found in time bounded by the number of bits in a
+ * size. The list and trie links live in the free blocks' data areas.
+ * Only if nothing fits is the heap grown with sbrk.
+ *
+ * When a free leaves a big free block at the top of the heap, the
+ * whole pages of it are given back with sbrk. (Note that the OS/161
+ * kernel has to implement sbrk for any of this to work there.)
  */
 
 #include <stdlib.h>
@@ -92,15 +107,16 @@ struct mheader {
 #define MMAGIC 6
 	/*
 	 * 64-bit platform. size_t is 64 bits (8 bytes)
-	 * Block size is 16 bytes.
+	 * Block size is 16 bytes. (The fields are unsigned long because
+	 * a bitfield can't be wider than its type.)
 	 */
-	unsigned mh_prevblock:60;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:3;
+	unsigned long mh_prevblock:60;
+	unsigned long mh_pad:1;
+	unsigned long mh_magic1:3;
 
-	unsigned mh_nextblock:60;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:3;
+	unsigned long mh_nextblock:60;
+	unsigned long mh_inuse:1;
+	unsigned long mh_magic2:3;
 
 #else
 #error "please fix me"
@@ -147,6 +163,66 @@ static size_t __malloc_pagesize;
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * Free block bookkeeping.
+ *
+ * Blocks with less than MSMALLMAX bytes of data are kept on
+ * doubly-linked lists, one per size (in MBLOCKSIZE steps), through a
+ * struct mfree at the start of their data; a block has at least
+ * MBLOCKSIZE bytes of data, which is room for the two pointers.
+ * __malloc_binmap has a bit set for each nonempty list.
+ *
+ * Bigger blocks go in a trie through a struct mtree at the start of
+ * their data. A node at depth D has a size whose top D bits (from
+ * MTREETOP down) are the path to it, with mt_child[0] for a 0 bit and
+ * mt_child[1] for a 1; its own size's lower bits can be anything.
+ * Only one block of each size is in the trie; others of the same
+ * size are on a list from its mt_next, with their mt_prev set and
+ * their other links unused. In the trie, mt_prev is NULL.
+ *
+ * MTRIM is how big the free block at the top of the heap must get
+ * before free gives memory back; MTRIMKEEP is how much of it stays.
+ */
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
+
+struct mtree {
+	struct mtree *mt_child[2];
+	struct mtree *mt_parent;
+	struct mtree *mt_next;
+	struct mtree *mt_prev;
+};
+
+#define MSMALLMAX	512
+#define MNBINS		(MSMALLMAX / MBLOCKSIZE)
+#define MBINMAPBITS	32
+#define MBINMAPWORDS	((MNBINS + MBINMAPBITS - 1) / MBINMAPBITS)
+
+#define MTREETOP	((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+#define MTRIM		(16 * PAGE_SIZE)
+#define MTRIMKEEP	(4 * PAGE_SIZE)
+
+/* Sizes past this would overflow the header fields or the arithmetic. */
+#define MMAXSIZE	((size_t)1 << (sizeof(size_t) * 8 - 4))
+
+#define M_HEADER(p)	(((struct mheader *)(p)) - 1)
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+#define M_TREE(mh)	((struct mtree *)M_DATA(mh))
+#define M_BIN(size)	((size) / MBLOCKSIZE)
+
+static struct mfree *__malloc_bins[MNBINS];
+static uint32_t __malloc_binmap[MBINMAPWORDS];
+static struct mtree *__malloc_tree;
+
+/*
+ * The highest block in the heap, or NULL if the heap is empty. (Its
+ * top is __heaptop.)
+ */
+static struct mheader *__malloc_last;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -299,9 +375,308 @@ __malloc_sbrk(size_t size)
 }
 
 /*
- * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * Small-block lists.
+ */
+static
+void
+__malloc_binlink(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned bin = M_BIN(M_SIZE(mh));
+
+	mf->mf_prev = NULL;
+	mf->mf_next = __malloc_bins[bin];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__malloc_bins[bin] = mf;
+	__malloc_binmap[bin / MBINMAPBITS] |= (uint32_t)1 << (bin % MBINMAPBITS);
+}
+
+static
+void
+__malloc_binunlink(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned bin = M_BIN(M_SIZE(mh));
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		if (__malloc_bins[bin] != mf) {
+			errx(1, "malloc: Heap corrupt; free block %p not "
+			     "on its list", mh);
+		}
+		__malloc_bins[bin] = mf->mf_next;
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+	if (__malloc_bins[bin] == NULL) {
+		__malloc_binmap[bin / MBINMAPBITS] &=
+			~((uint32_t)1 << (bin % MBINMAPBITS));
+	}
+}
+
+/*
+ * Find the smallest nonempty list at or above BIN and return its
+ * first block, or NULL if they're all empty.
+ */
+static
+struct mheader *
+__malloc_binfind(unsigned bin)
+{
+	unsigned word;
+	uint32_t bits;
+
+	for (word = bin / MBINMAPBITS; word < MBINMAPWORDS; word++) {
+		bits = __malloc_binmap[word];
+		if (word == bin / MBINMAPBITS) {
+			/* skip the lists below BIN */
+			bits &= ~(uint32_t)0 << (bin % MBINMAPBITS);
+		}
+		if (bits == 0) {
+			continue;
+		}
+		bin = word * MBINMAPBITS;
+		while ((bits & 1) == 0) {
+			bits >>= 1;
+			bin++;
+		}
+		return M_HEADER(__malloc_bins[bin]);
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Large-block trie.
+ */
+
+static
+void
+__malloc_treelink(struct mheader *mh)
+{
+	struct mtree *mt = M_TREE(mh);
+	struct mtree **where, *t;
+	size_t size = M_SIZE(mh);
+	size_t bit;
+
+	mt->mt_child[0] = mt->mt_child[1] = NULL;
+	mt->mt_next = mt->mt_prev = NULL;
+
+	t = NULL;
+	where = &__malloc_tree;
+	bit = MTREETOP;
+	while (*where != NULL) {
+		t = *where;
+		if (M_SIZE(M_HEADER(t)) == size) {
+			/* Go on its list. */
+			mt->mt_parent = NULL;
+			mt->mt_prev = t;
+			mt->mt_next = t->mt_next;
+			if (mt->mt_next != NULL) {
+				mt->mt_next->mt_prev = mt;
+			}
+			t->mt_next = mt;
+			return;
+		}
+		where = &t->mt_child[(size & bit) != 0];
+		bit >>= 1;
+	}
+	mt->mt_parent = t;
+	*where = mt;
+}
+
+/* Point whatever points to OLD (its parent, or the root) at NEW. */
+static
+void
+__malloc_treereplace(struct mtree *old, struct mtree *new)
+{
+	if (old->mt_parent == NULL) {
+		__malloc_tree = new;
+	}
+	else if (old->mt_parent->mt_child[0] == old) {
+		old->mt_parent->mt_child[0] = new;
+	}
+	else {
+		old->mt_parent->mt_child[1] = new;
+	}
+	if (new != NULL) {
+		new->mt_parent = old->mt_parent;
+	}
+}
+
+static
+void
+__malloc_treeunlink(struct mheader *mh)
+{
+	struct mtree *mt = M_TREE(mh);
+	struct mtree *repl;
+	unsigned i;
+
+	if (mt->mt_prev != NULL) {
+		/* Just on a list. */
+		mt->mt_prev->mt_next = mt->mt_next;
+		if (mt->mt_next != NULL) {
+			mt->mt_next->mt_prev = mt->mt_prev;
+		}
+		return;
+	}
+
+	if (mt->mt_next != NULL) {
+		/* The next one of the same size takes its place. */
+		repl = mt->mt_next;
+		repl->mt_prev = NULL;
+	}
+	else {
+		/*
+		 * Any leaf below MT has the same leading bits as MT's
+		 * place, so it can move up into it.
+		 */
+		repl = mt;
+		while (repl->mt_child[0] != NULL || repl->mt_child[1] != NULL) {
+			repl = repl->mt_child[repl->mt_child[1] != NULL];
+		}
+		if (repl == mt) {
+			repl = NULL;
+		}
+		else {
+			__malloc_treereplace(repl, NULL);
+		}
+	}
+
+	if (repl != NULL) {
+		for (i = 0; i < 2; i++) {
+			repl->mt_child[i] = mt->mt_child[i];
+			if (repl->mt_child[i] != NULL) {
+				repl->mt_child[i]->mt_parent = repl;
+			}
+		}
+	}
+	__malloc_treereplace(mt, repl);
+}
+
+/*
+ * Best fit: the smallest block with at least SIZE bytes of data, or
+ * NULL if there isn't one. The sizes at least SIZE are on the path
+ * SIZE's bits lead down, or in the 1 subtrees off it where SIZE has a
+ * 0 bit; those all beat the ones above them, so only the last needs
+ * searching, and its smallest is somewhere on its leftmost path.
+ */
+static
+struct mheader *
+__malloc_treefind(size_t size)
+{
+	struct mtree *mt, *best, *rest;
+	size_t bit, mtsize, bestsize;
+
+	best = rest = NULL;
+	bestsize = 0;
+	mt = __malloc_tree;
+	bit = MTREETOP;
+	while (mt != NULL) {
+		mtsize = M_SIZE(M_HEADER(mt));
+		if (mtsize >= size && (best == NULL || mtsize < bestsize)) {
+			best = mt;
+			bestsize = mtsize;
+			if (mtsize == size) {
+				break;
+			}
+		}
+		if ((size & bit) == 0 && mt->mt_child[1] != NULL) {
+			rest = mt->mt_child[1];
+		}
+		mt = mt->mt_child[(size & bit) != 0];
+		bit >>= 1;
+	}
+
+	if (best == NULL || bestsize != size) {
+		for (mt = rest; mt != NULL;
+		     mt = mt->mt_child[mt->mt_child[0] == NULL]) {
+			mtsize = M_SIZE(M_HEADER(mt));
+			if (best == NULL || mtsize < bestsize) {
+				best = mt;
+				bestsize = mtsize;
+			}
+		}
+	}
+
+	if (best == NULL) {
+		return NULL;
+	}
+	/* Take one off the list if there is one; that's quicker. */
+	if (best->mt_next != NULL) {
+		best = best->mt_next;
+	}
+	return M_HEADER(best);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * File a free block where malloc will find it, or take it back out.
+ */
+static
+void
+__malloc_link(struct mheader *mh)
+{
+	if (M_SIZE(mh) < MSMALLMAX) {
+		__malloc_binlink(mh);
+	}
+	else {
+		__malloc_treelink(mh);
+	}
+}
+
+static
+void
+__malloc_unlink(struct mheader *mh)
+{
+	if (M_SIZE(mh) < MSMALLMAX) {
+		__malloc_binunlink(mh);
+	}
+	else {
+		__malloc_treeunlink(mh);
+	}
+}
+
+/*
+ * Find a free block with at least SIZE bytes of data and take it out
+ * of the free lists and tree. NULL if there isn't one.
+ */
+static
+struct mheader *
+__malloc_findfit(size_t size)
+{
+	struct mheader *mh = NULL;
+
+	if (size < MSMALLMAX) {
+		mh = __malloc_binfind(M_BIN(size));
+	}
+	if (mh == NULL) {
+		mh = __malloc_treefind(size);
+	}
+	if (mh != NULL) {
+		if (!M_OK(mh) || mh->mh_inuse) {
+			errx(1, "malloc: Heap corrupt; bad free block at %p",
+			     mh);
+		}
+		__malloc_unlink(mh);
+	}
+	return mh;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Cut the block passed in down to SIZE bytes of data, and file the
+ * rest, if there's enough for a block, as a new free block. SIZE must
+ * be a multiple of MBLOCKSIZE. MH must not be on a free list, and the
+ * block above it must be in use (or be the top of the heap), so the
+ * new block has no free neighbor to merge with.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -343,96 +718,27 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__malloc_last = mhnew;
+	}
+
+	__malloc_link(mhnew);
 }
 
 /*
- * malloc itself.
+ * Grow the heap so there's a block with at least SIZE bytes of data
+ * at the top, and return it, not on any free list; NULL if sbrk
+ * fails. If the top block is free, it's grown; otherwise a new block
+ * is made above it.
  */
-void *
-malloc(size_t size)
+static
+struct mheader *
+__malloc_grow(size_t size)
 {
-	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mheader *mh = __malloc_last;
 	size_t morespace;
 	void *p;
 
-	if (__heapbase==0) {
-		__malloc_init();
-	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
-	}
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes",
-	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
-#endif
-
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	mh = NULL;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i,
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
-
-	/*
-	 * Didn't find anything. Expand the heap.
-	 *
-	 * If the heap is nonempty and the top block (the one mh is
-	 * left pointing to after the above loop) is free, we can
-	 * expand it. Otherwise we need a new block.
-	 */
 	if (mh != NULL && !mh->mh_inuse) {
 		assert(size > M_SIZE(mh));
 		morespace = size - M_SIZE(mh);
@@ -451,26 +757,74 @@ malloc(size_t size)
 
 	if (mh != NULL && !mh->mh_inuse) {
 		/* update old header */
+		__malloc_unlink(mh);
 		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + morespace);
-		mh->mh_inuse = 1;
 	}
 	else {
 		/* fill out new header */
 		mh = p;
-		mh->mh_prevblock = rightprevblock;
+		mh->mh_prevblock = __malloc_last == NULL ? 0 :
+			__malloc_last->mh_nextblock;
 		mh->mh_magic1 = MMAGIC;
 		mh->mh_magic2 = MMAGIC;
 		mh->mh_pad = 0;
-		mh->mh_inuse = 1;
+		mh->mh_inuse = 0;
 		mh->mh_nextblock = M_MKFIELD(morespace);
+		__malloc_last = mh;
+	}
+	return mh;
+}
+
+/*
+ * malloc itself.
+ */
+void *
+malloc(size_t size)
+{
+	struct mheader *mh;
+
+	if (__heapbase==0) {
+		__malloc_init();
+	}
+	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+		warnx("malloc: Internal error - local data corrupt");
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("malloc: about to allocate %lu (0x%lx) bytes",
+	      (unsigned long) size, (unsigned long) size);
+	__malloc_dump();
+#endif
+
+	if (size > MMAXSIZE) {
+		return NULL;
+	}
+
+	/*
+	 * Round size up to an integral number of blocks, and to at
+	 * least one, so there's room for the free list links.
+	 */
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
+	}
+
+	mh = __malloc_findfit(size);
+	if (mh == NULL) {
+		mh = __malloc_grow(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
 
 	/*
-	 * Either way, try splitting the block we got as because of
-	 * the page rounding it might be quite a bit bigger than we
-	 * needed.
+	 * The block we got may be quite a bit bigger than we needed;
+	 * put the rest back.
 	 */
 	__malloc_split(mh, size);
+	mh->mh_inuse = 1;
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -481,6 +835,7 @@ malloc(size_t size)
 
 ////////////////////////////////////////////////////////////
 
+#ifdef MALLOCDEBUG
 /*
  * Clear a range of memory with 0xdeadbeef.
  * ptr must be suitably aligned.
@@ -495,13 +850,15 @@ __malloc_deadbeef(void *ptr, size_t size)
 		x[i] = 0xdeadbeef;
 	}
 }
+#endif
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Merge two adjacent blocks (mh below mhnext). Both must be free and
+ * off the free lists.
  */
 static
 void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
@@ -509,10 +866,6 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
 
 	mhnextnext = M_NEXT(mhnext);
 
@@ -522,9 +875,46 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__malloc_last = mh;
+	}
 
+#ifdef MALLOCDEBUG
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+#endif
+}
+
+/*
+ * The free block MH is at the top of the heap and big; give all but
+ * MTRIMKEEP bytes of it back, in whole pages.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t release;
+	void *x;
+
+	release = M_NEXTOFF(mh) - MTRIMKEEP;
+	release -= release % PAGE_SIZE;
+	if (release == 0) {
+		return;
+	}
+
+	x = sbrk(-(intptr_t)release);
+	if (x == (void *)-1) {
+		/* Just keep it, then. */
+		return;
+	}
+	if ((uintptr_t)x != __heaptop) {
+		errx(1, "free: Internal error - "
+		     "heap top moved itself from 0x%lx to 0x%lx",
+		     (unsigned long) __heaptop,
+		     (unsigned long) (uintptr_t) x);
+	}
+	__heaptop -= release;
+	mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) - release);
 }
 
 /*
@@ -557,7 +947,7 @@ free(void *x)
 	__malloc_dump();
 #endif
 
-	mh = ((struct mheader *)x)-1;
+	mh = M_HEADER(x);
 	if (!M_OK(mh)) {
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
@@ -569,20 +959,36 @@ free(void *x)
 	/* mark it free */
 	mh->mh_inuse = 0;
 
+#ifdef MALLOCDEBUG
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
-	/* Try merging with the block above (but not if we're at the top) */
+	/* Merge with the block above if it's free (and not the top) */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mhnext != (struct mheader *)__heaptop && !mhnext->mh_inuse) {
+		__malloc_unlink(mhnext);
+		__malloc_merge(mh, mhnext);
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
+	/* Merge with the block below if it's free (and not the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!M_OK(mhprev)) {
+			errx(1, "free: Heap corrupt; header at %p"
+			     " has bad magic bits", mhprev);
+		}
+		if (!mhprev->mh_inuse) {
+			__malloc_unlink(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
+	}
+
+	if (mh == __malloc_last && M_NEXTOFF(mh) >= MTRIM) {
+		__malloc_trim(mh);
 	}
+	__malloc_link(mh);
 
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
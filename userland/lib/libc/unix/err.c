@@ -84,6 +84,12 @@ __printerr(int use_errno, const char *fmt, va_list ap)
 	 */
 	errmsg = strerror(errno);
 
+	/*
+	 * Anything buffered for stdout was printed before this, so
+	 * make it show up first.
+	 */
+	fflush(stdout);
+
 	/*
 	 * Look up the program name.
 	 * Strictly speaking we should pull off the rightmost
@@ -0,0 +1,208 @@
+/**
+ * @file:   ulock.c
+ * @brief:  userland mutexes and condition variables built on futex()
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <ulock.h>
+
+/*
+ * Atomic operations, using LL/SC the same way the kernel's spinlocks
+ * do. Each one ends with SYNC so it also acts as a full barrier, which
+ * is what a lock needs on both acquire and release.
+ */
+
+/* If *p == old, set it to new. Returns the previous value. */
+static
+int
+ulock_cas(volatile int *p, int old, int new)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"
+		".set mips2;"
+		".set noreorder;"
+		"1: ll %0, 0(%2);"
+		"   bne %0, %3, 2f;"
+		"   move %1, %4;"	/* delay slot */
+		"   sc %1, 0(%2);"
+		"   beqz %1, 1b;"
+		"   nop;"
+		"2: sync;"
+		".set pop"
+		: "=&r" (prev), "=&r" (tmp)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return prev;
+}
+
+/* Set *p to val. Returns the previous value. */
+static
+int
+ulock_swap(volatile int *p, int val)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"
+		".set mips2;"
+		".set noreorder;"
+		"1: ll %0, 0(%2);"
+		"   move %1, %3;"
+		"   sc %1, 0(%2);"
+		"   beqz %1, 1b;"
+		"   nop;"
+		"   sync;"
+		".set pop"
+		: "=&r" (prev), "=&r" (tmp)
+		: "r" (p), "r" (val)
+		: "memory");
+	return prev;
+}
+
+/* Add delta to *p. Returns the previous value. */
+static
+int
+ulock_add(volatile int *p, int delta)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"
+		".set mips2;"
+		".set noreorder;"
+		"1: ll %0, 0(%2);"
+		"   addu %1, %0, %3;"
+		"   sc %1, 0(%2);"
+		"   beqz %1, 1b;"
+		"   nop;"
+		"   sync;"
+		".set pop"
+		: "=&r" (prev), "=&r" (tmp)
+		: "r" (p), "r" (delta)
+		: "memory");
+	return prev;
+}
+
+/*
+ * Sleep while *p == val. EAGAIN just means *p changed before we got
+ * to sleep, and the callers all recheck, so it isn't an error.
+ */
+static
+void
+ulock_sleep(volatile int *p, int val)
+{
+	if (futex(p, FUTEX_WAIT, val) < 0 && errno != EAGAIN) {
+		err(1, "futex wait");
+	}
+}
+
+static
+void
+ulock_wake(volatile int *p, int count)
+{
+	if (futex(p, FUTEX_WAKE, count) < 0) {
+		err(1, "futex wake");
+	}
+}
+
+////////////////////////////////////////////////////////////
+// mutex
+
+/*
+ * The three-state mutex: 0 is free, 1 is held, 2 is held and someone
+ * may be asleep on it. Lockers that find it busy set it to 2 before
+ * sleeping, so the unlocker knows whether it needs to call the
+ * kernel.
+ */
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	c = ulock_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		/* fast path */
+		return;
+	}
+
+	if (c != 2) {
+		c = ulock_swap(&m->um_state, 2);
+	}
+	while (c != 0) {
+		ulock_sleep(&m->um_state, 2);
+		c = ulock_swap(&m->um_state, 2);
+	}
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	return ulock_cas(&m->um_state, 0, 1) == 0;
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	if (ulock_add(&m->um_state, -1) != 1) {
+		/* was 2: there may be sleepers */
+		m->um_state = 0;
+		ulock_wake(&m->um_state, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// condition variable
+
+void
+ucond_init(struct ucond *cv)
+{
+	cv->uc_seq = 0;
+	cv->uc_waiters = 0;
+}
+
+/*
+ * The sequence number is sampled before the mutex is released, so a
+ * signal sent after that point changes it and the futex wait returns
+ * at once rather than missing the wakeup.
+ */
+void
+ucond_wait(struct ucond *cv, struct umutex *m)
+{
+	int seq;
+
+	ulock_add(&cv->uc_waiters, 1);
+	seq = cv->uc_seq;
+	umutex_unlock(m);
+	ulock_sleep(&cv->uc_seq, seq);
+	ulock_add(&cv->uc_waiters, -1);
+	umutex_lock(m);
+}
+
+void
+ucond_signal(struct ucond *cv)
+{
+	ulock_add(&cv->uc_seq, 1);
+	if (cv->uc_waiters > 0) {
+		ulock_wake(&cv->uc_seq, 1);
+	}
+}
+
+void
+ucond_broadcast(struct ucond *cv)
+{
+	ulock_add(&cv->uc_seq, 1);
+	if (cv->uc_waiters > 0) {
+		ulock_wake(&cv->uc_seq, FUTEX_WAKE_ALL);
+	}
+}
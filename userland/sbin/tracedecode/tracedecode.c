@@ -0,0 +1,317 @@
+/**
+ * @file:   tracedecode.c
+ * @brief:  decode a kernel event trace saved with the tracesave menu command
+ */
+
+/*
+ * Prints the records as a timeline (nanoseconds since the first
+ * record, plus the gap since the previous record on the same cpu),
+ * followed by a summary: how many of each event, and per-syscall
+ * latency worked out from matching syscall/sysret pairs.
+ *
+ * Builds both for OS/161 and for the host, like dumpsfs.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "kern/trace.h"
+
+#ifdef HOST
+/*
+ * OS/161 runs natively on a big-endian platform, so we can
+ * conveniently use the byteswapping functions for network byte order.
+ */
+#include <netinet/in.h> // for arpa/inet.h
+#include <arpa/inet.h>  // for ntohl
+#include "hostcompat.h"
+#define SWAP32(x) ntohl(x)
+#define SWAP16(x) ntohs(x)
+
+extern const char *hostcompat_progname;
+
+#else
+
+#define SWAP32(x) (x)
+#define SWAP16(x) (x)
+
+#endif
+
+#define MAXCPUS 32
+#define MAXCALLS 128		/* syscall numbers tracked in the summary */
+#define MAXPENDING 64		/* threads with a syscall in progress */
+
+static const char *const eventnames[TRACE_NEVENTS] = {
+	"?", "switch", "wakeup", "syscall", "sysret", "vop", "intr",
+};
+
+static const char *const vopnames[TRACEVOP_NOPS] = {
+	"eachopen", "reclaim", "read", "readlink", "getdirentry", "write",
+	"ioctl", "stat", "gettype", "isseekable", "fsync", "mmap",
+	"truncate", "namefile", "creat", "symlink", "mkdir", "link",
+	"remove", "rmdir", "rename", "lookup", "lookparent",
+};
+
+static bool quiet;		/* summary only */
+static int onlycpu = -1;	/* show only this cpu's records */
+
+static unsigned long eventcount[TRACE_NEVENTS];
+
+struct callstats {
+	unsigned long count;
+	unsigned long long total;
+	unsigned long long max;
+};
+static struct callstats calls[MAXCALLS];
+
+struct pending {
+	uint32_t thread;	/* 0 if free */
+	uint32_t callno;
+	unsigned long long start;
+};
+static struct pending pending[MAXPENDING];
+
+static
+void
+swaprecord(struct trace_record *r)
+{
+	r->tr_sec = SWAP32(r->tr_sec);
+	r->tr_nsec = SWAP32(r->tr_nsec);
+	r->tr_event = SWAP16(r->tr_event);
+	r->tr_cpu = SWAP16(r->tr_cpu);
+	r->tr_thread = SWAP32(r->tr_thread);
+	r->tr_arg0 = SWAP32(r->tr_arg0);
+	r->tr_arg1 = SWAP32(r->tr_arg1);
+}
+
+static
+unsigned long long
+rectime(const struct trace_record *r)
+{
+	return (unsigned long long)r->tr_sec * 1000000000ULL + r->tr_nsec;
+}
+
+static
+struct pending *
+findpending(uint32_t thread)
+{
+	unsigned i;
+
+	for (i=0; i<MAXPENDING; i++) {
+		if (pending[i].thread == thread) {
+			return &pending[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Pair up syscall and sysret records from the same thread. A thread
+ * can only be in one syscall at a time, so the latest entry wins.
+ */
+static
+void
+account(const struct trace_record *r, unsigned long long t)
+{
+	struct pending *p;
+	unsigned long long lat;
+
+	if (r->tr_event < TRACE_NEVENTS) {
+		eventcount[r->tr_event]++;
+	}
+
+	if (r->tr_event == TRACE_SYSCALL) {
+		p = findpending(r->tr_thread);
+		if (p == NULL) {
+			p = findpending(0);
+		}
+		if (p != NULL) {
+			p->thread = r->tr_thread;
+			p->callno = r->tr_arg0;
+			p->start = t;
+		}
+	}
+	else if (r->tr_event == TRACE_SYSRET) {
+		p = findpending(r->tr_thread);
+		if (p == NULL || p->callno != r->tr_arg0) {
+			/* entry fell off the front of the buffer */
+			return;
+		}
+		p->thread = 0;
+		if (r->tr_arg0 < MAXCALLS) {
+			lat = t - p->start;
+			calls[r->tr_arg0].count++;
+			calls[r->tr_arg0].total += lat;
+			if (lat > calls[r->tr_arg0].max) {
+				calls[r->tr_arg0].max = lat;
+			}
+		}
+	}
+}
+
+static
+void
+printrecord(const struct trace_record *r, unsigned long long t,
+	    unsigned long long gap)
+{
+	const char *name;
+
+	name = r->tr_event < TRACE_NEVENTS ? eventnames[r->tr_event] : "?";
+	printf("%12llu %10llu cpu%-2u %08x %-8s ", t, gap,
+	       r->tr_cpu, r->tr_thread, name);
+
+	switch (r->tr_event) {
+	    case TRACE_SWITCH:
+		printf("to %08x (%s)\n", r->tr_arg0,
+		       r->tr_arg1 == 1 ? "ready" :
+		       r->tr_arg1 == 2 ? "sleep" :
+		       r->tr_arg1 == 3 ? "zombie" : "?");
+		break;
+	    case TRACE_WAKEUP:
+		printf("%08x on cpu%u\n", r->tr_arg0, r->tr_arg1);
+		break;
+	    case TRACE_SYSCALL:
+		printf("call %u arg %08x\n", r->tr_arg0, r->tr_arg1);
+		break;
+	    case TRACE_SYSRET:
+		printf("call %u err %u\n", r->tr_arg0, r->tr_arg1);
+		break;
+	    case TRACE_VOP:
+		printf("%s vn %08x\n", r->tr_arg0 < TRACEVOP_NOPS ?
+		       vopnames[r->tr_arg0] : "?", r->tr_arg1);
+		break;
+	    case TRACE_INTR:
+		printf("slot %u\n", r->tr_arg0);
+		break;
+	    default:
+		printf("%08x %08x\n", r->tr_arg0, r->tr_arg1);
+		break;
+	}
+}
+
+static
+void
+summary(void)
+{
+	unsigned i;
+
+	printf("\nEvents:\n");
+	for (i=1; i<TRACE_NEVENTS; i++) {
+		printf("    %-8s %10lu\n", eventnames[i], eventcount[i]);
+	}
+
+	printf("\nSyscall latency (ns):\n");
+	printf("    %5s %8s %12s %12s\n", "call", "count", "avg", "max");
+	for (i=0; i<MAXCALLS; i++) {
+		if (calls[i].count == 0) {
+			continue;
+		}
+		printf("    %5u %8lu %12llu %12llu\n", i, calls[i].count,
+		       calls[i].total / calls[i].count, calls[i].max);
+	}
+}
+
+static
+void
+usage(void)
+{
+	warnx("Usage: tracedecode [-s] [-c cpu] tracefile");
+	warnx("   -s: print only the summary");
+	errx(1, "   -c cpu: print only records from that cpu");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct trace_filehdr hdr;
+	struct trace_record r;
+	unsigned long long t, first, last[MAXCPUS];
+	const char *file = NULL;
+	uint32_t i;
+	int fd, ch;
+
+#ifdef HOST
+	hostcompat_progname = argv[0];
+#endif
+
+	for (ch=1; ch<argc; ch++) {
+		if (!strcmp(argv[ch], "-s")) {
+			quiet = true;
+		}
+		else if (!strcmp(argv[ch], "-c") && ch+1 < argc) {
+			onlycpu = atoi(argv[++ch]);
+		}
+		else if (argv[ch][0] == '-' || file != NULL) {
+			usage();
+		}
+		else {
+			file = argv[ch];
+		}
+	}
+	if (file == NULL) {
+		usage();
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		errx(1, "%s: short header", file);
+	}
+	if (SWAP32(hdr.tf_magic) != TRACE_MAGIC) {
+		errx(1, "%s: not a trace file", file);
+	}
+	if (SWAP32(hdr.tf_recsize) != sizeof(r)) {
+		errx(1, "%s: record size %u, expected %u", file,
+		     (unsigned)SWAP32(hdr.tf_recsize), (unsigned)sizeof(r));
+	}
+	hdr.tf_numrecs = SWAP32(hdr.tf_numrecs);
+	hdr.tf_ncpus = SWAP32(hdr.tf_ncpus);
+
+	printf("%s: %u records, %u cpus\n", file,
+	       (unsigned)hdr.tf_numrecs, (unsigned)hdr.tf_ncpus);
+	if (!quiet) {
+		printf("%12s %10s %-5s %-8s %-8s %s\n", "ns", "gap", "cpu",
+		       "thread", "event", "args");
+	}
+
+	first = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		last[i] = 0;
+	}
+	for (i=0; i<hdr.tf_numrecs; i++) {
+		if (read(fd, &r, sizeof(r)) != sizeof(r)) {
+			errx(1, "%s: truncated at record %u", file,
+			     (unsigned)i);
+		}
+		swaprecord(&r);
+		if (r.tr_cpu >= MAXCPUS) {
+			warnx("record %u: bad cpu %u", (unsigned)i, r.tr_cpu);
+			continue;
+		}
+
+		t = rectime(&r);
+		if (i == 0) {
+			first = t;
+		}
+		account(&r, t);
+
+		if (!quiet && (onlycpu < 0 || onlycpu == r.tr_cpu)) {
+			printrecord(&r, t - first,
+				    last[r.tr_cpu] ? t - last[r.tr_cpu] : 0);
+		}
+		last[r.tr_cpu] = t;
+	}
+	close(fd);
+
+	summary();
+	return 0;
+}
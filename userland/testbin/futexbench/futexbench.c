@@ -0,0 +1,159 @@
+/**
+ * @file:   futexbench.c
+ * @brief:  compare futex-based userland locks against semfs semaphores
+ */
+
+/*
+ * Times LOOPS iterations of each of:
+ *
+ *    - umutex_lock/umutex_unlock with no contention (no kernel entry)
+ *    - FUTEX_WAKE on an address nobody sleeps on (one kernel entry)
+ *    - FUTEX_WAIT with a stale value (kernel entry plus copyin)
+ *    - V then P on a semfs semaphore (two trips through the VFS)
+ *
+ * The last is what userland had to use for mutual exclusion before
+ * futex(); the first is what an uncontended umutex costs now, and
+ * the middle two bound what a contended one adds.
+ *
+ * Usage: futexbench [loops]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <ulock.h>
+
+#define DEFAULT_LOOPS 10000
+#define SEMNAME "sem:futexbench"
+
+static time_t start_secs;
+static unsigned long start_nsecs;
+
+static
+void
+timer_start(void)
+{
+	__time(&start_secs, &start_nsecs);
+}
+
+/* Print nanoseconds per operation since timer_start. */
+static
+void
+timer_report(const char *what, unsigned loops)
+{
+	time_t secs;
+	unsigned long nsecs;
+	unsigned long long total;
+
+	__time(&secs, &nsecs);
+	total = (unsigned long long)(secs - start_secs) * 1000000000ULL;
+	total += nsecs;
+	total -= start_nsecs;
+
+	printf("%-32s %10llu ns total %8llu ns/op\n", what, total,
+	       total / loops);
+}
+
+static
+void
+bench_umutex(unsigned loops)
+{
+	struct umutex m = UMUTEX_INITIALIZER;
+	unsigned i;
+
+	timer_start();
+	for (i=0; i<loops; i++) {
+		umutex_lock(&m);
+		umutex_unlock(&m);
+	}
+	timer_report("umutex lock/unlock", loops);
+}
+
+static
+void
+bench_futexwake(unsigned loops)
+{
+	static volatile int word;
+	unsigned i;
+	int r;
+
+	timer_start();
+	for (i=0; i<loops; i++) {
+		r = futex(&word, FUTEX_WAKE, 1);
+		if (r != 0) {
+			err(1, "futex wake: returned %d", r);
+		}
+	}
+	timer_report("futex wake (no sleepers)", loops);
+}
+
+static
+void
+bench_futexwait(unsigned loops)
+{
+	static volatile int word = 1;
+	unsigned i;
+	int r;
+
+	timer_start();
+	for (i=0; i<loops; i++) {
+		r = futex(&word, FUTEX_WAIT, 0);
+		if (r != -1 || errno != EAGAIN) {
+			errx(1, "futex wait: expected EAGAIN, got %d", r);
+		}
+	}
+	timer_report("futex wait (stale value)", loops);
+}
+
+static
+void
+bench_semfs(unsigned loops)
+{
+	unsigned i;
+	int fd;
+	char c = 0;
+
+	fd = open(SEMNAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		warn("%s: skipping semfs test", SEMNAME);
+		return;
+	}
+
+	timer_start();
+	for (i=0; i<loops; i++) {
+		/* V first, so P never blocks */
+		if (write(fd, &c, 1) != 1) {
+			err(1, "%s: write", SEMNAME);
+		}
+		if (read(fd, &c, 1) != 1) {
+			err(1, "%s: read", SEMNAME);
+		}
+	}
+	timer_report("semfs V/P", loops);
+
+	close(fd);
+	(void)remove(SEMNAME);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned loops = DEFAULT_LOOPS;
+
+	if (argc > 1) {
+		loops = atoi(argv[1]);
+		if (loops == 0) {
+			errx(1, "Usage: futexbench [loops]");
+		}
+	}
+
+	printf("futexbench: %u iterations each\n", loops);
+	bench_umutex(loops);
+	bench_futexwake(loops);
+	bench_futexwait(loops);
+	bench_semfs(loops);
+	return 0;
+}
@@ -0,0 +1,201 @@
+/**
+ * @file:   mallocbench.c
+ * @brief:  benchmark the libc malloc against the first-fit one it replaced
+ */
+
+/*
+ * Runs the same random workload through both allocators: keep SLOTS
+ * blocks live, and OPS times free a random one and allocate a new
+ * block of random size in its place. Most blocks are small (up to 256
+ * bytes); one in sixteen is large (1K to 16K). Then free everything.
+ * For each allocator it prints the time taken and how big the heap
+ * got, and how big it is once everything's been freed.
+ *
+ * The first-fit allocator walks the whole heap on every malloc, so it
+ * slows down in proportion to the number of live blocks; the new one
+ * shouldn't.
+ *
+ * Each allocator gets a private heap carved out of a static arena
+ * here, so this builds and runs the same on the host (as
+ * host-mallocbench) as on OS/161.
+ *
+ * Usage: mallocbench [slots [ops]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#ifdef HOST
+#include "hostcompat.h"
+#endif
+
+#include "mallocbench.h"
+
+#define DEFAULT_SLOTS	1000
+#define DEFAULT_OPS	10000
+#define MAXSLOTS	20000
+
+#define ARENASIZE	(16*1024*1024)
+#define PAGESIZE	4096
+
+////////////////////////////////////////////////////////////
+//
+// Private heaps
+
+struct arena {
+	char *base;		/* page-aligned start */
+	size_t brk;		/* current break, as an offset */
+	size_t maxbrk;		/* highest it's been */
+};
+
+static char oldspace[ARENASIZE + PAGESIZE];
+static char newspace[ARENASIZE + PAGESIZE];
+static struct arena oldarena, newarena;
+
+static
+void *
+arena_sbrk(struct arena *a, char *space, intptr_t change)
+{
+	size_t old;
+
+	if (a->base == NULL) {
+		a->base = space + PAGESIZE - (uintptr_t)space % PAGESIZE;
+	}
+	old = a->brk;
+	if ((change < 0 && (size_t)-change > old) ||
+	    (change > 0 && (size_t)change > ARENASIZE - old)) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	a->brk += change;
+	if (a->brk > a->maxbrk) {
+		a->maxbrk = a->brk;
+	}
+	return a->base + old;
+}
+
+void *
+oldmalloc_sbrk(intptr_t change)
+{
+	return arena_sbrk(&oldarena, oldspace, change);
+}
+
+void *
+newmalloc_sbrk(intptr_t change)
+{
+	return arena_sbrk(&newarena, newspace, change);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Workload
+
+static void *slots[MAXSLOTS];
+
+/* Our own generator, so both allocators see the same sequence. */
+static unsigned long seed;
+
+static
+unsigned long
+nextrand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static
+size_t
+randsize(void)
+{
+	if (nextrand() % 16 == 0) {
+		return 1024 + nextrand() % (15*1024);
+	}
+	return 1 + nextrand() % 256;
+}
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+run(const char *name, void *(*mallocfn)(size_t), void (*freefn)(void *),
+    struct arena *a, unsigned nslots, unsigned nops)
+{
+	unsigned long long start, ns;
+	unsigned i, j;
+	size_t size;
+
+	seed = 1;
+	start = now_ns();
+
+	for (i=0; i<nslots; i++) {
+		size = randsize();
+		slots[i] = mallocfn(size);
+		if (slots[i] == NULL) {
+			errx(1, "%s: out of memory", name);
+		}
+		memset(slots[i], i, size < 16 ? size : 16);
+	}
+	for (i=0; i<nops; i++) {
+		j = nextrand() % nslots;
+		freefn(slots[j]);
+		size = randsize();
+		slots[j] = mallocfn(size);
+		if (slots[j] == NULL) {
+			errx(1, "%s: out of memory", name);
+		}
+		memset(slots[j], i, size < 16 ? size : 16);
+	}
+	for (i=0; i<nslots; i++) {
+		freefn(slots[i]);
+	}
+
+	ns = now_ns() - start;
+	printf("%-10s %8llu us  %6llu ns/op  heap max %5lu KB, "
+	       "after %5lu KB\n",
+	       name, ns / 1000, ns / (2*nslots + 2*nops),
+	       (unsigned long)(a->maxbrk / 1024),
+	       (unsigned long)(a->brk / 1024));
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned nslots = DEFAULT_SLOTS, nops = DEFAULT_OPS;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	if (argc > 1) {
+		nslots = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nops = atoi(argv[2]);
+	}
+	if (nslots == 0 || nslots > MAXSLOTS || argc > 3) {
+		errx(1, "Usage: mallocbench [slots [ops]] (slots <= %u)",
+		     MAXSLOTS);
+	}
+
+	printf("mallocbench: %u live blocks, %u replacements\n",
+	       nslots, nops);
+	run("first-fit", oldmalloc_malloc, oldmalloc_free, &oldarena,
+	    nslots, nops);
+	run("seg-fit", newmalloc_malloc, newmalloc_free, &newarena,
+	    nslots, nops);
+	return 0;
+}
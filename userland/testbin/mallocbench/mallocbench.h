@@ -0,0 +1,27 @@
+/**
+ * @file:   mallocbench.h
+ * @brief:  the two allocators mallocbench compares, under their own names
+ */
+
+#ifndef _MALLOCBENCH_H_
+#define _MALLOCBENCH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Each allocator is compiled with malloc, free, and sbrk renamed, so
+ * both can live in one program next to the real libc, and each gets
+ * its own heap (an arena in mallocbench.c) instead of the process
+ * break, which libc or the host's stdio may be using.
+ */
+
+void *newmalloc_malloc(size_t size);
+void newmalloc_free(void *ptr);
+void *newmalloc_sbrk(intptr_t change);
+
+void *oldmalloc_malloc(size_t size);
+void oldmalloc_free(void *ptr);
+void *oldmalloc_sbrk(intptr_t change);
+
+#endif /* _MALLOCBENCH_H_ */
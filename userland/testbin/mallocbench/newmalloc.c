@@ -0,0 +1,12 @@
+/**
+ * @file:   newmalloc.c
+ * @brief:  libc's malloc, renamed for mallocbench
+ */
+
+#include "mallocbench.h"
+
+#define malloc newmalloc_malloc
+#define free newmalloc_free
+#define sbrk newmalloc_sbrk
+
+#include "../../lib/libc/stdlib/malloc.c"
@@ -0,0 +1,323 @@
+/**
+ * @file:   membench.c
+ * @brief:  microbenchmark for the libc/kernel memcpy, memmove, and memset
+ */
+
+/*
+ * Times the shared word-at-a-time memcpy, memmove, and memset from
+ * common/libc/string against a plain byte loop, over a range of sizes
+ * and with the source and destination at different alignments. The
+ * shared sources are compiled straight into this program under other
+ * names, so it also builds and runs on the host (as host-membench),
+ * where it compares them with the host's libc too.
+ *
+ * Before timing anything it checks every alignment and length up to
+ * a few words against the byte loop, including overlapping memmoves
+ * in both directions, and stops if anything comes out wrong.
+ *
+ * Usage: membench [scale]
+ *    SCALE multiplies the number of bytes moved per measurement
+ *    (default 1; System/161 is slow, so keep it small there).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#ifdef HOST
+#include "hostcompat.h"
+#endif
+
+/*
+ * The shared code, renamed so it doesn't collide with libc's. (On
+ * OS/161 libc's are the same code, but the host's aren't.)
+ */
+#define memcpy wc_memcpy
+#define memmove wc_memmove
+#define memset wc_memset
+#define bzero wc_bzero
+void *wc_memcpy(void *dst, const void *src, size_t len);
+void *wc_memmove(void *dst, const void *src, size_t len);
+void *wc_memset(void *ptr, int ch, size_t len);
+void wc_bzero(void *vblock, size_t len);
+#include "../../../common/libc/string/memcpy.c"
+#include "../../../common/libc/string/memmove.c"
+#include "../../../common/libc/string/memset.c"
+#include "../../../common/libc/string/bzero.c"
+#undef memcpy
+#undef memmove
+#undef memset
+#undef bzero
+
+#define BUFSIZE		(64*1024 + 64)
+#define CHECKLEN	(8*sizeof(long) + 8)
+#define CHECKSIZE	256	/* how much of the buffers check() uses */
+#define BYTESPERRUN	(1024*1024)
+
+static unsigned char srcbuf[BUFSIZE];
+static unsigned char dstbuf[BUFSIZE];
+static unsigned char refbuf[BUFSIZE];
+
+////////////////////////////////////////////////////////////
+//
+// Reference versions
+
+static
+void *
+byte_memcpy(void *dst, const void *src, size_t len)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		d[i] = s[i];
+	}
+	return dst;
+}
+
+static
+void *
+byte_memmove(void *dst, const void *src, size_t len)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t i;
+
+	if ((uintptr_t)dst < (uintptr_t)src) {
+		return byte_memcpy(dst, src, len);
+	}
+	for (i=len; i>0; i--) {
+		d[i-1] = s[i-1];
+	}
+	return dst;
+}
+
+static
+void *
+byte_memset(void *ptr, int ch, size_t len)
+{
+	unsigned char *p = ptr;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		p[i] = ch;
+	}
+	return ptr;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Checking
+
+static
+void
+fillbufs(void)
+{
+	unsigned i;
+
+	for (i=0; i<CHECKSIZE; i++) {
+		srcbuf[i] = random();
+		dstbuf[i] = refbuf[i] = random();
+	}
+}
+
+static
+void
+compare(const char *what, unsigned doff, unsigned soff, size_t len)
+{
+	if (memcmp(dstbuf, refbuf, CHECKSIZE) != 0) {
+		errx(1, "%s: wrong result at dst+%u src+%u len %lu",
+		     what, doff, soff, (unsigned long)len);
+	}
+}
+
+static
+void
+check(void)
+{
+	unsigned doff, soff;
+	size_t len;
+
+	for (doff=0; doff<2*sizeof(long); doff++) {
+		for (soff=0; soff<2*sizeof(long); soff++) {
+			for (len=0; len<=CHECKLEN; len++) {
+				fillbufs();
+				byte_memcpy(refbuf+doff, srcbuf+soff, len);
+				wc_memcpy(dstbuf+doff, srcbuf+soff, len);
+				compare("memcpy", doff, soff, len);
+
+				/* overlapping, both directions */
+				fillbufs();
+				memcpy(refbuf, dstbuf, CHECKSIZE);
+				byte_memmove(refbuf+64+doff, refbuf+64+soff, len);
+				wc_memmove(dstbuf+64+doff, dstbuf+64+soff, len);
+				compare("memmove", doff, soff, len);
+
+				fillbufs();
+				byte_memset(refbuf+doff, soff * 37, len);
+				wc_memset(dstbuf+doff, soff * 37, len);
+				compare("memset", doff, soff, len);
+
+				fillbufs();
+				byte_memset(refbuf+doff, 0, len);
+				wc_bzero(dstbuf+doff, len);
+				compare("bzero", doff, soff, len);
+			}
+		}
+	}
+	printf("membench: results check out\n");
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timing
+
+typedef void *(*copyfn)(void *, const void *, size_t);
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+/*
+ * Move SCALE megabytes LEN bytes at a time with FN and return the
+ * rate in KB/s.
+ */
+static
+unsigned long
+rate(copyfn fn, unsigned doff, unsigned soff, size_t len, unsigned scale)
+{
+	unsigned long long start, ns;
+	unsigned long i, n;
+
+	n = (unsigned long)scale * BYTESPERRUN / len;
+	start = now_ns();
+	for (i=0; i<n; i++) {
+		fn(dstbuf+doff, srcbuf+soff, len);
+	}
+	ns = now_ns() - start;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (unsigned long)((unsigned long long)n * len * 1000000ULL / ns);
+}
+
+/* memset, shaped like a copy function so it fits in the table */
+static
+void *
+byte_set(void *dst, const void *src, size_t len)
+{
+	(void)src;
+	return byte_memset(dst, 0x5a, len);
+}
+
+static
+void *
+wc_set(void *dst, const void *src, size_t len)
+{
+	(void)src;
+	return wc_memset(dst, 0x5a, len);
+}
+
+#ifdef HOST
+static
+void *
+libc_set(void *dst, const void *src, size_t len)
+{
+	(void)src;
+	return memset(dst, 0x5a, len);
+}
+#endif
+
+static const struct {
+	const char *name;
+	copyfn ref, ours;
+#ifdef HOST
+	copyfn libc;
+#endif
+} funcs[] = {
+#ifdef HOST
+	{ "memcpy",  byte_memcpy,  wc_memcpy,  memcpy },
+	{ "memmove", byte_memmove, wc_memmove, memmove },
+	{ "memset",  byte_set,     wc_set,     libc_set },
+#else
+	{ "memcpy",  byte_memcpy,  wc_memcpy },
+	{ "memmove", byte_memmove, wc_memmove },
+	{ "memset",  byte_set,     wc_set },
+#endif
+};
+
+static const size_t sizes[] = { 16, 64, 256, 4096, 65536 };
+
+/* dst, src offsets from word alignment */
+static const unsigned aligns[][2] = { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 3, 3 } };
+
+#define ARRAYCOUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static
+void
+bench(unsigned scale)
+{
+	unsigned f, z, a, doff, soff;
+
+#ifdef HOST
+	printf("%-8s %6s %7s %10s %10s %10s\n",
+	       "func", "size", "dst/src", "bytes KB/s", "word KB/s",
+	       "libc KB/s");
+#else
+	printf("%-8s %6s %7s %10s %10s\n",
+	       "func", "size", "dst/src", "bytes KB/s", "word KB/s");
+#endif
+	for (f=0; f<ARRAYCOUNT(funcs); f++) {
+		for (z=0; z<ARRAYCOUNT(sizes); z++) {
+			for (a=0; a<ARRAYCOUNT(aligns); a++) {
+				doff = aligns[a][0];
+				soff = aligns[a][1];
+				printf("%-8s %6lu   +%u/+%u %10lu %10lu",
+				       funcs[f].name, (unsigned long)sizes[z],
+				       doff, soff,
+				       rate(funcs[f].ref, doff, soff,
+					    sizes[z], scale),
+				       rate(funcs[f].ours, doff, soff,
+					    sizes[z], scale));
+#ifdef HOST
+				printf(" %10lu",
+				       rate(funcs[f].libc, doff, soff,
+					    sizes[z], scale));
+#endif
+				printf("\n");
+			}
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned scale = 1;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	if (argc > 1) {
+		scale = atoi(argv[1]);
+		if (scale == 0) {
+			errx(1, "Usage: membench [scale]");
+		}
+	}
+
+	check();
+	bench(scale);
+	return 0;
+}
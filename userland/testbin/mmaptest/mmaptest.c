@@ -0,0 +1,325 @@
+/**
+ * @file:   mmaptest.c
+ * @brief:  test mmap, munmap, and msync on a regular file
+ */
+
+/*
+ * Writes a test file a few pages long (not a whole number of pages)
+ * and then checks that:
+ *
+ *    - a private mapping reads the file, and zeros past its end;
+ *    - writes to a private mapping don't reach the file;
+ *    - writes to a shared mapping reach the file on msync, and on
+ *      munmap without one;
+ *    - bad arguments fail with the right errors.
+ *
+ * Then it times summing the file through read() and through a
+ * mapping, which is the case mmap is for.
+ *
+ * Usage: mmaptest [pages]
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define FILENAME "mmaptest.dat"
+#define PAGE 4096
+#define DEFAULT_PAGES 16
+#define TAIL 100		/* Bytes in the file's last page */
+
+static unsigned npages;
+static size_t filesize;
+static char buf[PAGE];
+
+static
+char
+pattern(size_t pos)
+{
+	return (char)('a' + (pos * 7 + pos / PAGE) % 26);
+}
+
+static
+void
+makefile(void)
+{
+	size_t pos, n, i;
+	ssize_t r;
+	int fd;
+
+	fd = open(FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	for (pos = 0; pos < filesize; pos += n) {
+		n = filesize - pos < PAGE ? filesize - pos : PAGE;
+		for (i=0; i<n; i++) {
+			buf[i] = pattern(pos + i);
+		}
+		r = write(fd, buf, n);
+		if (r != (ssize_t)n) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+	close(fd);
+}
+
+static
+int
+openfile(int flags)
+{
+	int fd;
+
+	fd = open(FILENAME, flags);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	return fd;
+}
+
+/* Read the byte at POS through the file, not a mapping. */
+static
+char
+fileat(int fd, size_t pos)
+{
+	char c;
+
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "%s: lseek", FILENAME);
+	}
+	if (read(fd, &c, 1) != 1) {
+		err(1, "%s: read", FILENAME);
+	}
+	return c;
+}
+
+static
+char *
+map(size_t len, int prot, int flags, int fd, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, len, prot, flags, fd, offset);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+unmap(void *p, size_t len)
+{
+	if (munmap(p, len) < 0) {
+		err(1, "munmap");
+	}
+}
+
+static
+void
+test_private(void)
+{
+	size_t i, maplen;
+	char *p;
+	int fd;
+
+	maplen = npages * PAGE;
+	fd = openfile(O_RDONLY);
+	p = map(maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	for (i=0; i<filesize; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "private: byte %u is %d, not %d",
+			     (unsigned)i, p[i], pattern(i));
+		}
+	}
+	for (; i<maplen; i++) {
+		if (p[i] != 0) {
+			errx(1, "private: byte %u past the end isn't 0",
+			     (unsigned)i);
+		}
+	}
+
+	/* Writes stay in the mapping. */
+	for (i=0; i<filesize; i+=PAGE/2) {
+		p[i] = '!';
+	}
+	for (i=0; i<filesize; i+=PAGE/2) {
+		if (p[i] != '!' || fileat(fd, i) != pattern(i)) {
+			errx(1, "private: write at %u went wrong",
+			     (unsigned)i);
+		}
+	}
+
+	unmap(p, maplen);
+	close(fd);
+	printf("private mapping: ok\n");
+}
+
+static
+void
+test_shared(void)
+{
+	size_t i, off;
+	char *p;
+	int fd;
+
+	fd = openfile(O_RDWR);
+
+	/* A mapping from an offset, written back with msync. */
+	off = PAGE;
+	p = map(filesize - off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+	if (p[0] != pattern(off)) {
+		errx(1, "shared: offset mapping starts at the wrong place");
+	}
+	for (i=0; i<filesize - off; i+=PAGE/4) {
+		p[i] = 'S';
+	}
+	if (msync(p, filesize - off, MS_SYNC) < 0) {
+		err(1, "msync");
+	}
+	for (i=0; i<filesize - off; i+=PAGE/4) {
+		if (fileat(fd, off + i) != 'S') {
+			errx(1, "shared: byte %u not written back by msync",
+			     (unsigned)(off + i));
+		}
+	}
+
+	/* Written again after the msync; munmap writes it back too. */
+	p[1] = 'M';
+	unmap(p, filesize - off);
+	if (fileat(fd, off + 1) != 'M') {
+		errx(1, "shared: munmap didn't write back");
+	}
+	if (fileat(fd, 0) != pattern(0)) {
+		errx(1, "shared: page before the mapping changed");
+	}
+
+	close(fd);
+	printf("shared mapping: ok\n");
+}
+
+static
+void
+test_errors(void)
+{
+	char *p;
+	int fd;
+
+	fd = openfile(O_RDONLY);
+
+	if (mmap(NULL, PAGE, PROT_READ, MAP_PRIVATE, fd, 1) != MAP_FAILED ||
+	    errno != EINVAL) {
+		errx(1, "unaligned offset: expected EINVAL");
+	}
+	if (mmap(NULL, PAGE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+	    != MAP_FAILED || errno != EACCES) {
+		errx(1, "writeable shared map of read-only file: "
+		     "expected EACCES");
+	}
+	if (mmap(NULL, PAGE, PROT_READ, MAP_PRIVATE, -1, 0) != MAP_FAILED ||
+	    errno != EBADF) {
+		errx(1, "bad fd: expected EBADF");
+	}
+	if (mmap(NULL, 0, PROT_READ, MAP_PRIVATE, fd, 0) != MAP_FAILED ||
+	    errno != EINVAL) {
+		errx(1, "zero length: expected EINVAL");
+	}
+
+	p = map(2 * PAGE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (munmap(p, PAGE) == 0 || errno != EINVAL) {
+		errx(1, "unmapping half a mapping: expected EINVAL");
+	}
+	unmap(p, 2 * PAGE);
+
+	close(fd);
+	printf("errors: ok\n");
+}
+
+static time_t start_secs;
+static unsigned long start_nsecs;
+
+static
+void
+timer_start(void)
+{
+	__time(&start_secs, &start_nsecs);
+}
+
+static
+void
+timer_report(const char *what, unsigned sum)
+{
+	time_t secs;
+	unsigned long nsecs;
+	unsigned long long total;
+
+	__time(&secs, &nsecs);
+	total = (unsigned long long)(secs - start_secs) * 1000000000ULL;
+	total += nsecs;
+	total -= start_nsecs;
+
+	printf("%-24s %10llu ns (sum %u)\n", what, total, sum);
+}
+
+static
+void
+bench_scan(void)
+{
+	unsigned sum;
+	size_t i;
+	ssize_t r;
+	char *p;
+	int fd;
+
+	fd = openfile(O_RDONLY);
+
+	timer_start();
+	sum = 0;
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		for (i=0; i<(size_t)r; i++) {
+			sum += (unsigned char)buf[i];
+		}
+	}
+	timer_report("scan with read()", sum);
+
+	timer_start();
+	sum = 0;
+	p = map(filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	for (i=0; i<filesize; i++) {
+		sum += (unsigned char)p[i];
+	}
+	unmap(p, filesize);
+	timer_report("scan with mmap()", sum);
+
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	npages = DEFAULT_PAGES;
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 2) {
+		errx(1, "Usage: mmaptest [pages], at least 2 pages");
+	}
+	filesize = (npages - 1) * PAGE + TAIL;
+
+	makefile();
+	test_private();
+	test_shared();
+	test_errors();
+
+	makefile();
+	bench_scan();
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
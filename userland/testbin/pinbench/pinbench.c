@@ -0,0 +1,160 @@
+/**
+ * @file:   pinbench.c
+ * @brief:  repeated file reads, pinned to one cpu vs. hopping between cpus
+ */
+
+/*
+ * Writes a test file, then reads it end to end PASSES times, twice:
+ * first with the process pinned to one cpu, then moving to the next
+ * cpu before every pass. The pinned run keeps the vnode, buffer and
+ * kernel stack state warm in one cpu's cache; the hopping run pays
+ * the migration and the cold cache on every pass.
+ *
+ * (System/161 doesn't model caches, so there the difference is just
+ * the cost of moving; on real hardware the cache effect dominates.)
+ *
+ * Usage: pinbench [passes]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define FILENAME "pinbench.dat"
+#define FILESIZE (64*1024)
+#define DEFAULT_PASSES 50
+
+static char buf[4096];
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+makefile(void)
+{
+	unsigned i;
+	int fd;
+
+	for (i=0; i<sizeof(buf); i++) {
+		buf[i] = 'a' + i % 26;
+	}
+
+	fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", FILENAME);
+	}
+	for (i=0; i<FILESIZE; i += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+	close(fd);
+}
+
+static
+void
+readfile(int fd)
+{
+	ssize_t r;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", FILENAME);
+	}
+	do {
+		r = read(fd, buf, sizeof(buf));
+		if (r < 0) {
+			err(1, "%s: read", FILENAME);
+		}
+	} while (r > 0);
+}
+
+/*
+ * Read the file PASSES times. Before each pass, pin to the next cpu
+ * in CPUS (a list of NCPUS cpu numbers).
+ */
+static
+unsigned long long
+run(int fd, unsigned passes, const unsigned *cpus, unsigned ncpus)
+{
+	unsigned long long start;
+	unsigned i;
+
+	/* one untimed pass to warm up */
+	if (setaffinity(1U << cpus[0]) < 0) {
+		err(1, "setaffinity");
+	}
+	readfile(fd);
+
+	start = now_ns();
+	for (i=0; i<passes; i++) {
+		if (ncpus > 1 && setaffinity(1U << cpus[i % ncpus]) < 0) {
+			err(1, "setaffinity");
+		}
+		readfile(fd);
+	}
+	return now_ns() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned passes = DEFAULT_PASSES;
+	unsigned mask, cpus[32], ncpus, i;
+	unsigned long long pinned, hopping;
+	int fd;
+
+	if (argc > 1) {
+		passes = atoi(argv[1]);
+		if (passes == 0) {
+			errx(1, "Usage: pinbench [passes]");
+		}
+	}
+
+	/* Find out which cpus exist. */
+	if (setaffinity(~0U) < 0 || getaffinity(&mask) < 0) {
+		err(1, "affinity");
+	}
+	ncpus = 0;
+	for (i=0; i<32; i++) {
+		if (mask & (1U << i)) {
+			cpus[ncpus++] = i;
+		}
+	}
+
+	makefile();
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+
+	printf("pinbench: %u passes over %u bytes, %u cpus\n",
+	       passes, FILESIZE, ncpus);
+
+	pinned = run(fd, passes, cpus, 1);
+	printf("pinned to cpu%u:  %10llu ns (%llu ns/pass)\n",
+	       cpus[0], pinned, pinned / passes);
+
+	if (ncpus > 1) {
+		hopping = run(fd, passes, cpus, ncpus);
+		printf("hopping cpus:   %10llu ns (%llu ns/pass)\n",
+		       hopping, hopping / passes);
+	}
+	else {
+		printf("Only one cpu; nothing to compare against\n");
+	}
+
+	close(fd);
+	(void)remove(FILENAME);
+	return 0;
+}